@@ -39,7 +39,7 @@ static char *filename;
 static int quiet_opt = 0;
 
 static int parse_address(char *address, struct sockaddr_in *sin);
-static int get_nvt_line(int sd, char *line);
+static int get_nvt_line(int sd, char *line, size_t line_len);
 static void loop_until_end(int sd);
 
 
@@ -168,7 +168,7 @@ loop_until_end(int sd)
             break;
         }
 
-        if (get_nvt_line(sd, line) < 0)
+        if (get_nvt_line(sd, line, sizeof(line)) < 0)
         {
             perror("get_nvt_line");
             errcnd = 1;
@@ -218,11 +218,14 @@ loop_until_end(int sd)
         /* Retrieve the remote file and write it to a local file */
         while (length)
         {
-            to_read = MIN(length, (int) sizeof(line));
+            const void *data;
 
-            if ((got = myread(sd, line, to_read)) < 0)
+            /* borrow the received data rather than copying it out; it goes
+             * straight from the mysocket layer's buffer to the file.
+             */
+            if ((got = myread_zc(sd, &data, length)) < 0)
             {
-                perror("myread");
+                perror("myread_zc");
                 errcnd = 1;
                 break;
             }
@@ -232,14 +235,11 @@ loop_until_end(int sd)
                 break;
             }
 
-            if (got < to_read)
-            {
-                to_read = got;
-            }
+            to_read = got;
 
             if (!quiet_opt)
             {
-                while (0 == fwrite(line, 1, to_read, file))
+                while (0 == fwrite(data, 1, to_read, file))
                 {
                     if (errno != EINTR)
                     {
@@ -249,6 +249,7 @@ loop_until_end(int sd)
                     }
                 }
             }
+            (void) myread_release(sd);
             length -= to_read;
         }
 
@@ -336,36 +337,33 @@ cleanup:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t line_len)
 {
-    char last_char;
-    char this_char;
+    size_t total;
     int len;
 
-    last_char = '\0';
-    for (;;)
+    for (total = 0; total < line_len - 1; )
     {
-        len = myread(sd, &this_char, sizeof(this_char));
+        /* pull in everything up to the next LF in one call */
+        len = myreadline(sd, line + total, line_len - 1 - total, '\n');
         if (len < 0)
             return -1;
 
         if (len == 0)
         {
             /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
+            break;
         }
-        /** fprintf(stderr, "read character %c\n", this_char); **/
+        total += len;
 
-        if (last_char == '\r' && this_char == '\n')
+        if (total >= 2 && line[total - 2] == '\r' && line[total - 1] == '\n')
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
+            /* Reached the end of line; drop the CRLF */
+            total -= 2;
+            break;
         }
-
-        *line++ = this_char;
-        last_char = this_char;
     }
+
+    line[total] = '\0';
+    return 0;
 }
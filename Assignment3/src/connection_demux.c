@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -59,10 +60,13 @@ typedef struct
     }
 
 /* maintains queue of pending connections per listening socket.
- * there is one entry in listen_table per passive (listening) socket.
+ * there is one entry in listen_table per passive (listening) socket; the
+ * table starts small and grows with the number of listening sockets.
  */
+#define LISTEN_TABLE_INITIAL_SIZE 64
+
 HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
-                   MAX_NUM_CONNECTIONS);
+                   LISTEN_TABLE_INITIAL_SIZE);
 static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
 
 static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
@@ -137,18 +141,24 @@ static void _debug_print_connection(const char *msg, const char *reason,
  * a mysocket for which myaccept() will be called (i.e., a listening
  * socket).
  *
- * returns TRUE if the new connection has been queued, FALSE otherwise.
+ * this is called by the network reactor, which mustn't wait for the
+ * listen table while myclose() or mylisten() is changing it.
+ *
+ * returns 1 if the new connection has been queued, 0 if the request has
+ * been dropped, or -1 with errno set to EAGAIN if the listen table is busy,
+ * in which case the caller should try again later with the same request.
  */
-bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
-                                  const void            *packet,
-                                  size_t                 packet_len,
-                                  const struct sockaddr *peer_addr,
-                                  int                    peer_addr_len,
-                                  void                  *user_data)
+int _mysock_enqueue_connection(mysock_context_t      *ctx,
+                               const void            *packet,
+                               size_t                 packet_len,
+                               const struct sockaddr *peer_addr,
+                               int                    peer_addr_len,
+                               void                  *user_data)
 {
     listen_queue_t *q;
     connect_request_t *queue_entry = NULL;
     unsigned int k;
+    int rc;
 
     assert(ctx && ctx->listening && ctx->bound);
     assert(packet && peer_addr);
@@ -157,7 +167,13 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 #define DEBUG_CONNECTION_MSG(msg, reason) \
     _debug_print_connection(msg, reason, ctx, peer_addr)
 
-    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    if ((rc = pthread_rwlock_tryrdlock(&listen_lock)) != 0)
+    {
+        assert(rc == EBUSY || rc == EAGAIN);
+        errno = EAGAIN;
+        return -1;
+    }
+
     if (packet_len < sizeof(struct tcphdr) ||
         !(((struct tcphdr *) packet)->th_flags & TH_SYN))
     {
@@ -165,6 +181,12 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
         goto done;  /* not a connection setup request */
     }
 
+    if (!_mysock_segment_ok(ctx, peer_addr, packet, packet_len))
+    {
+        DEBUG_CONNECTION_MSG("dropping SYN packet", "(bad checksum)");
+        goto done;
+    }
+
     if (!(q = _get_connection_queue(ctx)))
     {
         DEBUG_CONNECTION_MSG("dropping SYN packet", "(socket not listening)");
@@ -221,9 +243,14 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
 
-        new_ctx->network_state.peer_addr       = *peer_addr;
-        new_ctx->network_state.peer_addr_len   = peer_addr_len;
-        new_ctx->network_state.peer_addr_valid = TRUE;
+        /* options are inherited from the listening mysocket */
+        memcpy(new_ctx->stcp_options, ctx->stcp_options,
+               sizeof(new_ctx->stcp_options));
+        new_ctx->stcp_options_set =
+            __atomic_load_n(&ctx->stcp_options_set, __ATOMIC_ACQUIRE);
+
+        _network_set_peer_addr(&new_ctx->network_state,
+                               peer_addr, peer_addr_len);
 
         queue_entry->peer_addr     = *peer_addr;
         queue_entry->peer_addr_len = peer_addr_len;
@@ -238,11 +265,15 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                       &ctx->network_state,
                                       user_data, packet, packet_len);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
+        /* pass the SYN packet on to the main STCP code.  this is done
+         * before the new context's network receive thread starts, as that
+         * thread must be the only producer for the receive ring from then
+         * on.
+         */
+        _mysock_ring_push(new_ctx, &new_ctx->network_recv_queue,
+                          _mysock_buf_copy(packet, packet_len));
 
-        /* pass the SYN packet on to the main STCP code */
-        _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
-                               packet, packet_len);
+        _mysock_transport_init(queue_entry->sd, FALSE);
     }
     else
     {
@@ -252,7 +283,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
 done:
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
-    return (queue_entry != NULL);
+    return (queue_entry != NULL) ? 1 : 0;
 
 #undef DEBUG_CONNECTION_MSG
 }
@@ -365,9 +396,15 @@ void _mysock_close_passive_socket(mysock_context_t *ctx)
 
     PTHREAD_CALL(pthread_rwlock_wrlock(&listen_lock));
     if ((q = _get_connection_queue(ctx)) != NULL)
+        HASH_DELETE(listen_table, ctx->my_sd);
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    if (q != NULL)
     {
         /* close any queued connections that haven't been passed up to the
-         * user via myaccept()...
+         * user via myaccept().  this waits for their transport layers, so
+         * it's done without the listen table locked; they find the queue
+         * gone once they complete.
          */
         unsigned int k;
         completed_connect_t *connect_iter;
@@ -390,11 +427,9 @@ void _mysock_close_passive_socket(mysock_context_t *ctx)
         PTHREAD_CALL(pthread_cond_destroy(&q->connection_cond));
         PTHREAD_CALL(pthread_mutex_destroy(&q->connection_lock));
 
-        HASH_DELETE(listen_table, ctx->my_sd);
         memset(q, 0, sizeof(*q));
         free(q);
     }
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
 }
 
 /* assumes calling code has locked the listen table */
@@ -7,10 +7,17 @@
 #include <assert.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
 #include "mysock.h"
 #include "mysock_impl.h"
+#include "network.h"
 #include "network_io.h"
 #include "stcp_api.h"
+#include "tcp_sum.h"
 #include "transport.h"
 
 
@@ -24,16 +31,64 @@
 
 /* helper functions to start transport layer and network receive threads */
 static void *transport_thread_func(void *arg);
+static void _mysock_start_transport_thread(mysock_context_t *ctx);
 
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
+static void _mysock_release_descriptor(mysock_context_t *ctx);
+static void _mysock_close_network(mysock_context_t *ctx);
+static void _mysock_destroy_context(mysock_context_t *ctx);
+static void _mysock_reset_context(mysock_context_t *ctx);
+static void _mysock_eventfd_set(int fd);
+static void _mysock_eventfd_clear(int fd);
+static void _mysock_remove_head(mysock_context_t *ctx, packet_queue_t *pq);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
 
 
-/* mysocket descriptor table, one entry per STCP connection */
-static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
+/* mysocket descriptor table, one entry per STCP connection.  the table is a
+ * directory of fixed-size chunks, allocated as the table grows; chunks are
+ * never moved or freed, so a descriptor's slot stays put for the life of
+ * the process and lookups are plain (atomic) loads.  free descriptors are
+ * chained through next_free, so allocation and release are O(1).
+ * table_lock serialises allocation and release.
+ */
+#define MYSOCK_TABLE_CHUNK  256
+
+#if (MYSOCK_DESCRIPTOR_LIMIT % MYSOCK_TABLE_CHUNK) != 0
+    #error MYSOCK_DESCRIPTOR_LIMIT should be a multiple of MYSOCK_TABLE_CHUNK
+#endif
+
+typedef struct
+{
+    mysock_context_t *ctx[MYSOCK_TABLE_CHUNK];
+    int               next_free[MYSOCK_TABLE_CHUNK];
+} mysock_table_chunk_t;
 
+static mysock_table_chunk_t *
+    global_ctx[MYSOCK_DESCRIPTOR_LIMIT / MYSOCK_TABLE_CHUNK];
+static int table_len;           /* # of descriptors ever handed out */
+static int table_free = -1;     /* most recently released descriptor */
+static int table_limit;         /* zero until first mysocket() */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TABLE_CHUNK(sd)     (global_ctx[(sd) / MYSOCK_TABLE_CHUNK])
+#define TABLE_SLOT(sd)      (TABLE_CHUNK(sd)->ctx[(sd) % MYSOCK_TABLE_CHUNK])
+#define TABLE_NEXT_FREE(sd) \
+    (TABLE_CHUNK(sd)->next_free[(sd) % MYSOCK_TABLE_CHUNK])
+
+
+/* maximum number of descriptors, from MYSOCK_MAX_CONNECTIONS if set */
+static int _mysock_table_limit(void)
+{
+    const char *env = getenv("MYSOCK_MAX_CONNECTIONS");
+    long limit;
+
+    if (!env || (limit = strtol(env, NULL, 10)) <= 0)
+        return MAX_NUM_CONNECTIONS;
+
+    return (int) MIN(limit, (long) MYSOCK_DESCRIPTOR_LIMIT);
+}
 
 /* create a new mysocket, and find space in our mysocket descriptor table */
 mysocket_t _mysock_new_mysocket()
@@ -47,30 +102,284 @@ mysocket_t _mysock_new_mysocket()
         return -1;
     }
 
-    /* search for a free mysocket descriptor */
-    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+    if (!table_limit)
+        table_limit = _mysock_table_limit();
+
+    if ((k = table_free) >= 0)
     {
-        if (!global_ctx[k])
+        /* reuse a released descriptor */
+        table_free = TABLE_NEXT_FREE(k);
+    }
+    else if (table_len < table_limit)
+    {
+        /* extend the table, adding a chunk if necessary */
+        k = table_len;
+        if (!TABLE_CHUNK(k))
         {
-            global_ctx[k] = connection_context;
-            connection_context->my_sd = k;
-            return k;
+            TABLE_CHUNK(k) = (mysock_table_chunk_t *)
+                calloc(1, sizeof(mysock_table_chunk_t));
+            assert(TABLE_CHUNK(k));
         }
+        __atomic_store_n(&table_len, table_len + 1, __ATOMIC_RELEASE);
     }
 
-    _mysock_free_context(connection_context);
-    errno = EMFILE;
-    return -1;
+    if (k >= 0)
+    {
+        assert(!TABLE_SLOT(k));
+        connection_context->my_sd = k;
+        __atomic_store_n(&TABLE_SLOT(k), connection_context,
+                         __ATOMIC_RELEASE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+
+    if (k < 0)
+    {
+        _mysock_close_network(connection_context);
+        _mysock_destroy_context(connection_context);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return k;
+}
+
+/* give the given context's descriptor back to the table, if it has one */
+static void _mysock_release_descriptor(mysock_context_t *ctx)
+{
+    mysocket_t sd;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+    sd = ctx->my_sd;
+    if (sd >= 0 && sd < table_len && TABLE_SLOT(sd) == ctx)
+    {
+        __atomic_store_n(&TABLE_SLOT(sd), (mysock_context_t *) NULL,
+                         __ATOMIC_RELEASE);
+        TABLE_NEXT_FREE(sd) = table_free;
+        table_free = sd;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+}
+
+/* wait-free lookup of a descriptor's context, or NULL */
+static mysock_context_t *_mysock_lookup(mysocket_t sd)
+{
+    if (sd < 0 || sd >= __atomic_load_n(&table_len, __ATOMIC_ACQUIRE))
+        return NULL;
+    return __atomic_load_n(&TABLE_SLOT(sd), __ATOMIC_ACQUIRE);
 }
 
 /* obtain a pointer to the connection context for the given mysocket
- * descriptor.
+ * descriptor.  this is for the connection's own transport and network
+ * threads, which finish before the context can be freed; the application
+ * API uses _mysock_acquire_context() instead.
  */
 mysock_context_t *_mysock_get_context(mysocket_t sd)
 {
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(NULL, sd);
-    return (sd >= 0 && sd < (int)ARRAY_DIM(global_ctx))
-        ? global_ctx[sd] : NULL;
+    return _mysock_lookup(sd);
+}
+
+
+/* closed contexts are reclaimed using epochs.  a thread looking up a
+ * descriptor first announces the current global epoch in its record; a
+ * context is retired (after its descriptor has been cleared) tagged with
+ * the global epoch at that time.  the global epoch only advances once
+ * every thread inside a lookup has announced the current one, so once it
+ * has moved on twice, no lookup can still be looking at a retired context.
+ *
+ * lookups are short and never block.  an application call that may block
+ * (e.g. myread()) instead counts itself in ctx->users, so a retired
+ * context is destroyed once the grace period has passed *and* its last
+ * user has left.
+ */
+typedef struct mysock_epoch_record
+{
+    unsigned long               state;      /* epoch << 1 | active */
+    bool_t                      in_use;     /* owned by a live thread */
+    struct mysock_epoch_record *next;
+} mysock_epoch_record_t;
+
+static unsigned long          global_epoch;
+static mysock_epoch_record_t *epoch_records;    /* never freed */
+static pthread_key_t          epoch_key;
+static pthread_once_t         epoch_once = PTHREAD_ONCE_INIT;
+
+static mysock_context_t *retired_list;
+static int               retired_count;
+static pthread_mutex_t   retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* destroyed contexts are kept on a free list (chained through
+ * next_retired) for the next mysocket(), with their locks and condition
+ * variables still initialised; see _mysock_reset_context().
+ */
+#define MYSOCK_CONTEXT_CACHE_MAX 256
+
+static mysock_context_t *context_cache;
+static unsigned int      context_cache_len;
+static pthread_mutex_t   context_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* likewise, a transport thread whose connection has finished parks for up
+ * to TRANSPORT_THREAD_IDLE_SECS waiting for another one, rather than
+ * exiting; at most TRANSPORT_THREAD_CACHE_MAX are parked at once.
+ */
+#define TRANSPORT_THREAD_CACHE_MAX  64
+#define TRANSPORT_THREAD_IDLE_SECS  30
+
+typedef struct transport_thread
+{
+    mysock_context_t        *ctx;   /* connection to run next, or NULL */
+    pthread_cond_t           cond;  /* signaled when ctx is set */
+    struct transport_thread *next;
+} transport_thread_t;
+
+static transport_thread_t *idle_threads;
+static unsigned int        idle_thread_count;
+static pthread_mutex_t     idle_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a thread's record is handed back for reuse when the thread exits */
+static void _mysock_epoch_thread_exit(void *arg)
+{
+    mysock_epoch_record_t *rec = (mysock_epoch_record_t *) arg;
+
+    assert(rec && !(rec->state & 1));
+    __atomic_store_n(&rec->in_use, FALSE, __ATOMIC_RELEASE);
+}
+
+static void _mysock_epoch_init(void)
+{
+    PTHREAD_CALL(pthread_key_create(&epoch_key, _mysock_epoch_thread_exit));
+}
+
+static mysock_epoch_record_t *_mysock_epoch_record(void)
+{
+    mysock_epoch_record_t *rec;
+
+    PTHREAD_CALL(pthread_once(&epoch_once, _mysock_epoch_init));
+    if ((rec = (mysock_epoch_record_t *) pthread_getspecific(epoch_key)))
+        return rec;
+
+    /* first lookup on this thread; take over a dead thread's record if
+     * there is one, or add a new one.
+     */
+    for (rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+         rec; rec = rec->next)
+    {
+        bool_t expected = FALSE;
+
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, TRUE,
+                                        FALSE, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!rec)
+    {
+        rec = (mysock_epoch_record_t *) calloc(1, sizeof(*rec));
+        assert(rec);
+
+        rec->in_use = TRUE;
+        rec->next = __atomic_load_n(&epoch_records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&epoch_records, &rec->next, rec,
+                                            TRUE, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+
+    PTHREAD_CALL(pthread_setspecific(epoch_key, rec));
+    return rec;
+}
+
+/* try to advance the global epoch, then destroy whatever retired contexts
+ * are past their grace period and no longer in use.
+ */
+static void _mysock_reclaim(void)
+{
+    mysock_epoch_record_t *rec;
+    mysock_context_t *ctx, **prev, *dead = NULL;
+    unsigned long epoch;
+    bool_t advance = TRUE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&retire_lock));
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+         rec && advance; rec = rec->next)
+    {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+
+        if ((state & 1) && (state >> 1) != epoch)
+            advance = FALSE;
+    }
+
+    if (advance)
+        __atomic_store_n(&global_epoch, ++epoch, __ATOMIC_SEQ_CST);
+
+    for (prev = &retired_list; (ctx = *prev); )
+    {
+        if (epoch - ctx->retire_epoch >= 2 &&
+            !__atomic_load_n(&ctx->users, __ATOMIC_ACQUIRE))
+        {
+            *prev = ctx->next_retired;
+            ctx->next_retired = dead;
+            dead = ctx;
+            --retired_count;
+        }
+        else
+        {
+            prev = &ctx->next_retired;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&retire_lock));
+
+    while ((ctx = dead))
+    {
+        dead = ctx->next_retired;
+        _mysock_destroy_context(ctx);
+    }
+}
+
+/* look up the context for a descriptor passed in by the application, and
+ * keep it from being destroyed until _mysock_release_context().  returns
+ * NULL if the descriptor isn't open.
+ */
+mysock_context_t *_mysock_acquire_context(mysocket_t sd)
+{
+    mysock_epoch_record_t *rec = _mysock_epoch_record();
+    mysock_context_t *ctx;
+    unsigned long epoch;
+
+    /* announce the epoch, re-checking it in case it moved on before the
+     * announcement became visible.
+     */
+    do
+    {
+        epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&rec->state, epoch << 1 | 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&global_epoch, __ATOMIC_RELAXED) != epoch);
+
+    if ((ctx = _mysock_lookup(sd)) != NULL)
+        (void) __atomic_add_fetch(&ctx->users, 1, __ATOMIC_ACQ_REL);
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    return ctx;
+}
+
+void _mysock_release_context(mysock_context_t *ctx)
+{
+    if (!ctx)
+        return;
+
+    assert(ctx->users > 0);
+    (void) __atomic_sub_fetch(&ctx->users, 1, __ATOMIC_ACQ_REL);
+
+    if (__atomic_load_n(&retired_count, __ATOMIC_RELAXED) > 0)
+        _mysock_reclaim();
 }
 
 /* initiate a new STCP connection; called by myconnect() and myaccept() */
@@ -81,10 +390,17 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
-    /* start a new network thread; this handles incoming data, passing it
-     * up to the transport layer.  (the network input is threaded so we can
-     * keep track of timeouts/when data arrives, in a portable manner
-     * independent of the underlying network I/O functionality).
+    /* with MYSOCK_SHARDS set, everything for this connection happens on
+     * the shard its addresses hash to
+     */
+    if (_mysock_shard_enabled())
+        _mysock_shard_assign(connection_context);
+
+    /* start receiving network input; the network layer's reactor thread
+     * handles incoming data, passing it up to the transport layer.  (the
+     * network input is threaded so we can keep track of timeouts/when data
+     * arrives, in a portable manner independent of the underlying network
+     * I/O functionality).
      */
     if (_network_start_recv_thread(connection_context) < 0)
     {
@@ -92,14 +408,62 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
         abort();
     }
 
-    /* start a new transport layer thread */
-    connection_context->transport_thread = _mysock_create_thread(
-        transport_thread_func,
-        connection_context,
-        FALSE);
+    /* start a transport layer thread (or wake a parked one), or hand the
+     * connection to its shard, or to the worker pool if
+     * MYSOCK_TRANSPORT_WORKERS asks for one
+     */
+    if (connection_context->shard)
+        _mysock_shard_start(connection_context);
+    else if (_mysock_pool_enabled())
+        _mysock_pool_start(connection_context);
+    else
+        _mysock_start_transport_thread(connection_context);
     connection_context->transport_thread_started = TRUE;
 }
 
+/* run the given connection on a parked transport thread if there is one,
+ * otherwise on a new one
+ */
+static void _mysock_start_transport_thread(mysock_context_t *ctx)
+{
+    transport_thread_t *t;
+
+    PTHREAD_CALL(pthread_mutex_lock(&idle_thread_lock));
+    if ((t = idle_threads) != NULL)
+    {
+        idle_threads = t->next;
+        --idle_thread_count;
+
+        assert(!t->ctx);
+        t->ctx = ctx;
+        PTHREAD_CALL(pthread_cond_signal(&t->cond));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&idle_thread_lock));
+
+    if (t)
+        return;
+
+    t = (transport_thread_t *) calloc(1, sizeof(*t));
+    assert(t);
+    PTHREAD_CALL(pthread_cond_init(&t->cond, NULL));
+    t->ctx = ctx;
+    (void) _mysock_create_thread(transport_thread_func, t, TRUE);
+}
+
+/* block until the transport layer is done with the given connection */
+void _mysock_transport_join(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->transport_thread_started);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    while (!ctx->transport_done)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
+                                       &ctx->blocking_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+}
+
 int _mysock_wait_for_connection(mysock_context_t *ctx)
 {
     assert(ctx);
@@ -117,40 +481,79 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
-/* add an incoming buffer (packet) to a queue for this connection; it will be
- * dequeued by stcp_network_recv() or myread() when the transport layer or
+/* add an incoming buffer to a queue for this connection; it will be
+ * dequeued by stcp_app_recv() or myread() when the transport layer or
  * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
+ * the buffer is added.  (packets from the network go through
+ * _mysock_ring_push() instead).
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * this copies the specified buffer for its own use, so the calling code can
+ * do whatever it wants with the packet afterwards; _mysock_enqueue_buf()
+ * queues an existing buffer by reference instead.
  */
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
                             const void       *packet,
                             size_t            packet_len)
+{
+    assert(ctx && pq && (packet || !packet_len));
+    _mysock_enqueue_buf(ctx, pq, _mysock_buf_copy(packet, packet_len));
+}
+
+/* like _mysock_enqueue_buffer(), but splits the data across buffers of at
+ * most seg_len bytes.  mywrite() uses this so that each buffer holds one
+ * segment's worth of payload, with headroom for the segment header; the
+ * transport layer can then send the buffer as-is, without copying it again.
+ */
+void _mysock_enqueue_segments(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              const void       *src,
+                              size_t            len,
+                              size_t            seg_len)
+{
+    const char *csrc = (const char *) src;
+    size_t      off = 0;
+
+    assert(ctx && pq && (src || !len) && seg_len > 0);
+
+    do
+    {
+        size_t chunk = MIN(seg_len, len - off);
+
+        _mysock_enqueue_buf(ctx, pq, _mysock_buf_copy(csrc + off, chunk));
+        off += chunk;
+    } while (off < len);
+}
+
+/* add the given buffer to a queue for this connection, taking over the
+ * caller's reference to it.  the buffer is released once it has been
+ * completely dequeued.
+ */
+void _mysock_enqueue_buf(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         mysock_buf_t     *buf)
 {
     packet_queue_node_t *node;
+    bool_t               wake_transport;
 
-    assert(ctx && pq && (packet || !packet_len));
+    assert(ctx && pq && buf);
 
     node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
     assert(node);
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
-
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+    node->buf      = buf;
+    node->data     = buf->data;
+    node->data_len = buf->data_len;
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     if (!pq->head)
     {
         assert(!pq->tail);
         pq->head = pq->tail = node;
+
+        /* myread() no longer blocks */
+        if (pq == &ctx->app_send_queue)
+            _mysock_eventfd_set(ctx->read_eventfd);
     }
     else
     {
@@ -160,8 +563,43 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
         pq->tail->next = node;
         pq->tail = node;
     }
+
+    /* the app send queue is consumed only by myread(); anything else is an
+     * event for the transport layer, which may be parked in
+     * stcp_wait_for_event() rather than on the queue itself.
+     */
+    wake_transport = (pq != &ctx->app_send_queue) && ctx->event_waiting;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    PTHREAD_CALL(pthread_cond_signal(&pq->ready_cond));
+    if (wake_transport)
+        _mysock_wake_transport(ctx);
+}
+
+/* unlink the buffer at the head of the given queue and free it.  the
+ * caller holds data_ready_lock.
+ */
+static void _mysock_remove_head(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    packet_queue_node_t *node = pq->head;
+
+    assert(node);
+    if (!(pq->head = pq->head->next))
+    {
+        assert(pq->tail == node);
+        pq->tail = NULL;
+
+        /* myread() blocks again, unless this was the EOF marker, in
+         * which case all subsequent myread() calls return immediately.
+         */
+        if (pq == &ctx->app_send_queue && node->data_len > 0)
+            _mysock_eventfd_clear(ctx->read_eventfd);
+    }
+
+    if (node->buf)
+        _mysock_buf_release(node->buf);
+    memset(node, 0, sizeof(*node));
+    free(node);
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -186,7 +624,7 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     while (!pq->head)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+        PTHREAD_CALL(pthread_cond_wait(&pq->ready_cond,
                                        &ctx->data_ready_lock));
     }
 
@@ -201,30 +639,565 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
         memcpy(dst, node->data, max_len);
-        memcpy(node->data, node->data + max_len, node->data_len - max_len);
+        node->data     += max_len;
         node->data_len -= max_len;
         packet_len = max_len;
     }
     else
     {
         /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
+        packet_len = node->data_len;
+        memcpy(dst, node->data, MIN(max_len, node->data_len));
+        _mysock_remove_head(ctx, pq);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+
+    return packet_len;
+}
+
+/* like _mysock_dequeue_buffer() with remove_partial set, but returns a
+ * handle to (up to max_len bytes of) the buffer at the head of the queue
+ * rather than copying its contents.  if the whole of the queued buffer is
+ * being dequeued, the queue's reference is simply handed over to the
+ * caller; otherwise the caller gets a clone referring to the same storage.
+ */
+mysock_buf_t *_mysock_dequeue_buf(mysock_context_t *ctx,
+                                  packet_queue_t   *pq,
+                                  size_t            max_len)
+{
+    packet_queue_node_t *node;
+    mysock_buf_t        *buf;
+
+    assert(ctx && pq);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&pq->ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    node = pq->head;
+    assert(node && node->buf);
+
+    if (node->data_len > max_len)
+    {
+        buf = _mysock_buf_clone(node->buf, node->data, max_len);
+        node->data     += max_len;
+        node->data_len -= max_len;
+    }
+    else
+    {
+        if (node->data == node->buf->data &&
+            node->data_len == node->buf->data_len)
+        {
+            buf = node->buf;
+            node->buf = NULL;   /* reference passes to the caller */
+        }
+        else
+        {
+            buf = _mysock_buf_clone(node->buf, node->data, node->data_len);
+        }
+
+        _mysock_remove_head(ctx, pq);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return buf;
+}
+
+/* copy up to max_len bytes of stream data from the head of the given
+ * queue into dst, with recv()-style flags:
+ *   MSG_PEEK      leave the data in the queue
+ *   MSG_WAITALL   block until max_len bytes (or EOF) are queued, rather
+ *                 than returning as soon as anything is available
+ *   MSG_DONTWAIT  fail with EAGAIN rather than blocking
+ * unlike _mysock_dequeue_buffer(), this may gather bytes from several
+ * queued buffers, so a full-length read needs only a single wait.  returns
+ * the number of bytes copied (zero at EOF), or -1 with errno set.
+ */
+ssize_t _mysock_dequeue_stream(mysock_context_t *ctx,
+                               packet_queue_t   *pq,
+                               void             *dst,
+                               size_t            max_len,
+                               int               flags)
+{
+    packet_queue_node_t *node;
+    size_t               avail, copied;
+    bool_t               eof;
+
+    assert(ctx && pq && (dst || !max_len));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    for (;;)
+    {
+        /* count what's queued ahead of the EOF marker */
+        for (node = pq->head, avail = 0, eof = FALSE;
+             node && avail < max_len; node = node->next)
+        {
+            if (node->data_len == 0)
+            {
+                eof = TRUE;
+                break;
+            }
+            avail += node->data_len;
+        }
+
+        if (avail >= max_len || eof ||
+            (avail > 0 && !(flags & MSG_WAITALL)))
+            break;
+
+        if (flags & MSG_DONTWAIT)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            errno = EAGAIN;
+            return -1;
+        }
+
+        PTHREAD_CALL(pthread_cond_wait(&pq->ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    avail = MIN(avail, max_len);
+    for (copied = 0, node = pq->head; copied < avail; )
+    {
+        size_t n;
+
+        assert(node && node->data_len > 0);
+        n = MIN(node->data_len, avail - copied);
+        memcpy((char *) dst + copied, node->data, n);
+        copied += n;
+
+        if (flags & MSG_PEEK)
         {
-            assert(pq->tail == node);
-            pq->tail = NULL;
+            node = node->next;
         }
+        else if (n == node->data_len)
+        {
+            _mysock_remove_head(ctx, pq);
+            node = pq->head;
+        }
+        else
+        {
+            node->data     += n;
+            node->data_len -= n;
+        }
+    }
+
+    /* EOF with nothing before it; consume the marker */
+    if (avail == 0 && max_len > 0 && !(flags & MSG_PEEK))
+    {
+        assert(eof && pq->head && pq->head->data_len == 0);
+        _mysock_remove_head(ctx, pq);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return avail;
+}
+
+/* copy bytes from the head of the given queue into dst, up to and
+ * including the first occurrence of delim, or up to max_len bytes if the
+ * delimiter doesn't occur before then.  this blocks until the delimiter
+ * has arrived, max_len bytes are available, or the EOF marker is reached;
+ * the bytes are then removed from the queue in a single locked operation,
+ * rather than the caller dequeueing a byte at a time.  returns the number
+ * of bytes copied; zero indicates EOF.
+ */
+size_t _mysock_dequeue_until(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             void             *dst,
+                             size_t            max_len,
+                             int               delim)
+{
+    packet_queue_node_t *node;
+    size_t               scanned = 0;   /* bytes known not to hold delim */
+    size_t               len, copied;
+    bool_t               done = FALSE;
+
+    assert(ctx && pq && dst);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!done)
+    {
+        size_t skip = scanned;
+
+        for (node = pq->head, len = 0; node && !done; node = node->next)
+        {
+            size_t      n = MIN(node->data_len, max_len - len);
+            const char *p;
+
+            if (node->data_len == 0 || n == 0)
+            {
+                done = TRUE;    /* EOF marker, or dst is full */
+                break;
+            }
+
+            /* don't rescan bytes we've already looked at */
+            if (skip >= n)
+            {
+                skip -= n;
+                len  += n;
+                continue;
+            }
+
+            if ((p = (const char *) memchr(node->data + skip, delim, n - skip)))
+            {
+                len += (p - node->data) + 1;
+                done = TRUE;
+            }
+            else
+            {
+                len += n;
+            }
+            skip = 0;
+        }
+
+        if (len == max_len)
+            done = TRUE;
+
+        if (!done)
+        {
+            scanned = len;
+            PTHREAD_CALL(pthread_cond_wait(&pq->ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+    }
+
+    /* hand over len bytes, freeing any buffers we've emptied */
+    for (copied = 0; copied < len; )
+    {
+        size_t n;
+
+        node = pq->head;
+        assert(node && node->data_len > 0);
+
+        n = MIN(node->data_len, len - copied);
+        memcpy((char *) dst + copied, node->data, n);
+        copied += n;
+
+        if (n == node->data_len)
+        {
+            _mysock_remove_head(ctx, pq);
+        }
+        else
+        {
+            node->data     += n;
+            node->data_len -= n;
+        }
+    }
+
+    /* EOF with nothing before it; consume the marker */
+    if (len == 0 && max_len > 0)
+    {
+        assert(pq->head && pq->head->data_len == 0);
+        _mysock_remove_head(ctx, pq);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return len;
+}
+
+/* return an eventfd for the given mysocket that is readable whenever
+ * myread() (is_write == FALSE) or mywrite() (is_write == TRUE) would not
+ * block, creating it on first use.  this lets applications wait on a
+ * mysocket from their own poll()/epoll loop.  returns -1 on error.
+ */
+int _mysock_get_eventfd(mysock_context_t *ctx, bool_t is_write)
+{
+#ifdef LINUX
+    int *fd_ptr;
+
+    assert(ctx);
+    fd_ptr = is_write ? &ctx->write_eventfd : &ctx->read_eventfd;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (*fd_ptr < 0)
+    {
+        if ((*fd_ptr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)
+        {
+            /* mywrite() queues everything, so it never blocks; myread()
+             * doesn't block if there's already data (or EOF) waiting.
+             */
+            if (is_write || ctx->app_send_queue.head || ctx->eof)
+                _mysock_eventfd_set(*fd_ptr);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return *fd_ptr;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* mark an eventfd readable.  this is only called on a transition from
+ * the unreadable state, so the counter is only ever 0 or 1, and a single
+ * read() in _mysock_eventfd_clear() resets it.  the caller holds
+ * data_ready_lock.
+ */
+static void _mysock_eventfd_set(int fd)
+{
+#ifdef LINUX
+    if (fd >= 0)
+        (void) eventfd_write(fd, 1);
+#endif
+}
+
+/* mark an eventfd unreadable; the caller holds data_ready_lock */
+static void _mysock_eventfd_clear(int fd)
+{
+#ifdef LINUX
+    eventfd_t value;
+
+    if (fd >= 0)
+        (void) eventfd_read(fd, &value);
+#endif
+}
+
+/* TRUE if a segment the network layer has received is to be passed up to
+ * the transport layer.  with STCP_CHECKSUM on (the default), one whose
+ * checksum is wrong is dropped, as a NIC would drop it, and counted in
+ * STCP_CHECKSUM_ERRORS.  peer_addr is where a SYN for a listening ctx came
+ * from, or NULL for a segment on ctx's own connection.
+ */
+bool_t _mysock_segment_ok(mysock_context_t      *ctx,
+                          const struct sockaddr *peer_addr,
+                          const void            *packet,
+                          size_t                 len)
+{
+    bool_t ok;
+
+    assert(ctx && packet);
+
+    if (!_mysock_get_option(ctx, STCP_CHECKSUM, TRUE))
+        return TRUE;
+
+    if (len < sizeof(struct tcphdr))
+    {
+        ok = FALSE;
+    }
+    else if (!peer_addr)
+    {
+        ok = _mysock_verify_checksum(ctx, packet, len);
+    }
+    else
+    {
+        uint32_t src_addr;
+
+        assert(peer_addr->sa_family == AF_INET);
+        src_addr = ((const struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
+        ok = (_mysock_tcp_checksum(src_addr,
+                                   _network_get_interface_ip(src_addr),
+                                   packet, len) ==
+              ((const struct tcphdr *) packet)->th_sum);
+    }
+
+    if (!ok)
+    {
+        DEBUG_LOG(("dropping %u byte segment with bad checksum\n",
+                   (unsigned int) len));
+        __atomic_add_fetch(&ctx->checksum_errors, 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+/* add an incoming packet to the network receive ring, taking over the
+ * caller's reference to it.  this must only be called from the context's
+ * network receive thread (or before that thread has started); see
+ * packet_ring_t.  blocks while the ring is full, unless the transport
+ * layer has already finished with the connection, in which case the packet
+ * is silently dropped.
+ */
+void _mysock_ring_push(mysock_context_t *ctx,
+                       packet_ring_t    *ring,
+                       mysock_buf_t     *buf)
+{
+    unsigned int tail;
+
+    assert(ctx && ring && buf);
+
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+        PACKET_RING_SIZE)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        __atomic_store_n(&ring->producer_waiting, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!ring->closed &&
+               tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+               PACKET_RING_SIZE)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ring->space_cond,
+                                           &ctx->data_ready_lock));
+        }
+        __atomic_store_n(&ring->producer_waiting, FALSE, __ATOMIC_RELAXED);
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+    {
+        _mysock_buf_release(buf);
+        return;
+    }
 
-        free(node->data);
+    ring->slots[tail & (PACKET_RING_SIZE - 1)] = buf;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+    /* pairs with the fence in _mysock_ring_pop() and
+     * stcp_wait_for_event(); either the consumer sees the new tail before
+     * sleeping, or we see that it's asleep.  taking the lock before
+     * signaling closes the window between its check and its wait.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&ctx->event_waiting, __ATOMIC_RELAXED))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_signal(&ring->ready_cond));
+        _mysock_wake_transport(ctx);
     }
+}
 
-    return packet_len;
+/* called by a producer that can't wait for room in the ring (i.e. the
+ * network reactor) once it has stopped reading the context's input because
+ * the ring is full.  returns TRUE if the consumer will call
+ * _network_resume_input() after it has made room, or FALSE if room has
+ * been made meanwhile, in which case the producer starts reading again
+ * itself.
+ */
+bool_t _mysock_ring_pause(mysock_context_t *ctx, packet_ring_t *ring)
+{
+    assert(ctx && ring);
+
+    /* pairs with the fence in _mysock_ring_pop(); either the consumer sees
+     * the flag after taking a packet, or we see the packet gone.
+     */
+    __atomic_store_n(&ring->producer_paused, TRUE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (_mysock_ring_full(ring))
+        return TRUE;
+
+    /* if the consumer got here first, it asks for input to be resumed as
+     * well, which does no harm
+     */
+    __atomic_store_n(&ring->producer_paused, FALSE, __ATOMIC_RELAXED);
+    return FALSE;
+}
+
+/* remove one packet from the network receive ring, blocking until one is
+ * available.  the caller takes over the ring's reference to the returned
+ * buffer.  this must only be called from the transport layer thread.
+ */
+mysock_buf_t *_mysock_ring_pop(mysock_context_t *ctx, packet_ring_t *ring)
+{
+    mysock_buf_t *buf;
+    unsigned int  head;
+
+    assert(ctx && ring);
+
+    if (_mysock_ring_empty(ring))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        __atomic_store_n(&ring->consumer_waiting, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (_mysock_ring_empty(ring))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ring->ready_cond,
+                                           &ctx->data_ready_lock));
+        }
+        __atomic_store_n(&ring->consumer_waiting, FALSE, __ATOMIC_RELAXED);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+
+    head = ring->head;
+    buf = ring->slots[head & (PACKET_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        PTHREAD_CALL(pthread_cond_signal(&ring->space_cond));
+    }
+    if (__atomic_load_n(&ring->producer_paused, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->producer_paused, FALSE, __ATOMIC_RELAXED))
+    {
+        _network_resume_input(ctx);
+    }
+
+    assert(buf);
+    return buf;
+}
+
+/* called once the consumer of the ring has gone away for good; any
+ * subsequent packets are dropped, and a producer blocked on (or paused by)
+ * a full ring is released.
+ */
+void _mysock_ring_close(mysock_context_t *ctx, packet_ring_t *ring)
+{
+    assert(ctx && ring);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    __atomic_store_n(&ring->closed, TRUE, __ATOMIC_RELEASE);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_signal(&ring->space_cond));
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->producer_paused, FALSE, __ATOMIC_RELAXED))
+        _network_resume_input(ctx);
+}
+
+/* the events in flags that are waiting for the transport layer, as
+ * reported by stcp_wait_for_event().  a close request is reported (and
+ * consumed) only once, and only after all of the app's data has been
+ * dequeued; with MYSOCK_EVENT_KEEP_CLOSE, it's left alone.  the caller
+ * holds data_ready_lock.
+ */
+unsigned int _mysock_take_events(mysock_context_t *ctx, unsigned int flags)
+{
+    unsigned int rc = 0;
+
+    assert(ctx);
+
+    if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
+        rc |= APP_DATA;
+
+    if ((flags & NETWORK_DATA) &&
+        !_mysock_ring_empty(&ctx->network_recv_queue))
+        rc |= NETWORK_DATA;
+
+    if (/*(flags & APP_CLOSE_REQUESTED) &&*/
+        !(flags & MYSOCK_EVENT_KEEP_CLOSE) &&
+        ctx->close_requested && (ctx->app_recv_queue.head == NULL))
+    {
+        /* we should only wake up on this event once.  also, we don't
+         * pass the close event down to STCP until we've already passed
+         * it all outstanding data from the app.
+         */
+        ctx->close_requested = FALSE;
+        rc |= APP_CLOSE_REQUESTED;
+    }
+
+    return rc;
+}
+
+/* let the transport layer know about a new event:  wake its thread if it's
+ * waiting in stcp_wait_for_event(), or schedule the connection if it's run
+ * by a shard or the worker pool.
+ */
+void _mysock_wake_transport(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (ctx->shard)
+        _mysock_shard_wake(ctx);
+    else if (ctx->pooled)
+        _mysock_pool_wake(ctx);
+    else
+        PTHREAD_CALL(pthread_cond_signal(&ctx->event_cond));
 }
 
 /* free any last buffers in the specified queue, discarding the contents.
@@ -246,7 +1219,7 @@ static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
         if (node->data_len > 0)
             result = TRUE;
 
-        free(node->data);
+        _mysock_buf_release(node->buf);
         free(node);
         node = next;
     }
@@ -263,101 +1236,336 @@ static mysock_context_t *_mysock_allocate_context(void)
 {
     mysock_context_t *ctx = 0;
 
-    ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
-    assert(ctx);
+    /* a recycled context is already cleared, and initialised as below */
+    PTHREAD_CALL(pthread_mutex_lock(&context_cache_lock));
+    if ((ctx = context_cache) != NULL)
+    {
+        context_cache = ctx->next_retired;
+        --context_cache_len;
+        ctx->next_retired = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&context_cache_lock));
 
-    /* by default, sockets are active */
-    ctx->listen_sd = -1;
+    if (!ctx)
+    {
+        ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
+        assert(ctx);
 
-    /* initialise connection condition variable.  this is signaled when the
-     * connection is established, i.e. myconnect() or myaccept() should
-     * unblock and return to the calling application.
-     */
-    PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
-    PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
+        /* initialise connection condition variable.  this is signaled when
+         * the connection is established, i.e. myconnect() or myaccept()
+         * should unblock and return to the calling application.
+         */
+        PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
+        PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
 
-    /* initialise data ready condition variable.  this is signaled when
-     * data is ready from the application or the network.
-     */
-    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
-    PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+        /* initialise data ready condition variables.  each queue's
+         * condition variable is signaled when data is added to that queue;
+         * event_cond is signaled when data is ready for the transport layer
+         * from either the application or the network.
+         */
+        PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&ctx->event_cond, NULL));
+        PTHREAD_CALL(pthread_cond_init(&ctx->network_recv_queue.ready_cond,
+                                       NULL));
+        PTHREAD_CALL(pthread_cond_init(&ctx->network_recv_queue.space_cond,
+                                       NULL));
+        PTHREAD_CALL(pthread_cond_init(&ctx->app_send_queue.ready_cond, NULL));
+        PTHREAD_CALL(pthread_cond_init(&ctx->app_recv_queue.ready_cond, NULL));
+    }
+
+    /* by default, sockets are active */
+    ctx->listen_sd = -1;
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
+    /* readiness eventfds are only created if the app asks for them */
+    ctx->read_eventfd = ctx->write_eventfd = -1;
+
 
-    /* initialise underlying network state.  this includes creating the actual
-     * socket used for communication to the peer--this is analogous to the
-     * underlying raw IP socket used by a real TCP implementation.
+    /* initialise underlying network state.  this includes the actual socket
+     * used for communication to the peer--this is analogous to the
+     * underlying raw IP socket used by a real TCP implementation--although
+     * that isn't created until it's needed.
      */
     if (_network_init(ctx, &ctx->network_state) < 0)
     {
-        _mysock_free_context(ctx);
+        _mysock_close_network(ctx);
+        _mysock_destroy_context(ctx);
         return NULL;
     }
 
     return ctx;
 }
 
-/* destroy a connection context previously created with allocate_context().
+/* free a connection context previously created with allocate_context().
  * this is invoked only if and when the network and transport threads are
- * done.
+ * done.  the descriptor and the network layer's resources are released
+ * straight away, but the context itself is only destroyed once no
+ * application thread can still be using it.
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
-    int sd;
+    assert(ctx);
 
+    /* clear mysocket descriptor table entry */
+    _mysock_release_descriptor(ctx);
+    _mysock_close_network(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&retire_lock));
+    ctx->retire_epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    ctx->next_retired = retired_list;
+    retired_list = ctx;
+    ++retired_count;
+    PTHREAD_CALL(pthread_mutex_unlock(&retire_lock));
+
+    _mysock_reclaim();
+}
+
+/* close a context's network layer state, sending anything still on the
+ * simulated link first, and the app's readiness eventfds.  this mustn't
+ * wait for the context to be destroyed, which may not happen until some
+ * later API call (if any).
+ */
+static void _mysock_close_network(mysock_context_t *ctx)
+{
     assert(ctx);
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
-    PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (ctx->read_eventfd >= 0)
+        close(ctx->read_eventfd);
+    if (ctx->write_eventfd >= 0)
+        close(ctx->write_eventfd);
+    ctx->read_eventfd = ctx->write_eventfd = -1;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
-    PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
+    _network_send_drain(ctx);
+    _network_close(&ctx->network_state);
+}
+
+/* destroy a context that is no longer reachable, keeping it for reuse if
+ * the cache has room.  its network state has already been closed.
+ */
+static void _mysock_destroy_context(mysock_context_t *ctx)
+{
+    unsigned int k;
+    bool_t cached = FALSE;
+
+    assert(ctx);
 
     /* free any last buffers that might be lying around (e.g. retransmitted
      * packets from the peer).  normally, the application from/to queues
-     * should be empty by this point; the network receive queue may
+     * should be empty by this point; the network receive ring may
      * legitimately have retransmitted packets, so silently discard these.
      */
-    (void) _mysock_free_queue(ctx, &ctx->network_recv_queue);
+    for (k = ctx->network_recv_queue.head;
+         k != ctx->network_recv_queue.tail; ++k)
+    {
+        _mysock_buf_release(ctx->network_recv_queue.slots[
+            k & (PACKET_RING_SIZE - 1)]);
+    }
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
-    _network_close(&ctx->network_state);
+    /* the app never gave back its last myread_zc() buffer */
+    if (ctx->loaned_buf)
+        _mysock_buf_release(ctx->loaned_buf);
 
-    /* clear mysocket descriptor table entry */
-    sd = ctx->my_sd;
-    if (global_ctx[sd] == ctx)
-        global_ctx[sd] = 0;
+    /* created by an application call racing myclose() */
+    if (ctx->read_eventfd >= 0)
+        close(ctx->read_eventfd);
+    if (ctx->write_eventfd >= 0)
+        close(ctx->write_eventfd);
+
+    _mysock_reset_context(ctx);
+    PTHREAD_CALL(pthread_mutex_lock(&context_cache_lock));
+    if (context_cache_len < MYSOCK_CONTEXT_CACHE_MAX)
+    {
+        ctx->next_retired = context_cache;
+        context_cache = ctx;
+        ++context_cache_len;
+        cached = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&context_cache_lock));
+
+    if (cached)
+        return;
+
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->network_recv_queue.ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->network_recv_queue.space_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->app_send_queue.ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->app_recv_queue.ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->event_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
 
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
 }
 
+/* clear everything in a context but its locks and condition variables, as
+ * if it had just come from calloc().  this must be kept in step with
+ * mysock_context_t.
+ */
+static void _mysock_reset_context(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    ctx->is_active  = 0;
+    ctx->stcp_state = NULL;
+    memset(&ctx->network_state, 0, sizeof(ctx->network_state));
+    ctx->bound      = FALSE;
+    ctx->listening  = FALSE;
+    ctx->my_sd      = 0;
+    ctx->listen_sd  = 0;
+
+    ctx->blocking   = FALSE;
+    ctx->stcp_errno = 0;
+
+    ctx->transport_thread_started = FALSE;
+    ctx->pooled           = FALSE;
+    ctx->transport_opened = FALSE;
+    ctx->transport_done   = FALSE;
+    ctx->sched_state      = 0;
+    ctx->sched_next       = NULL;
+    ctx->wait_flags       = 0;
+    ctx->wait_timed       = FALSE;
+    memset(&ctx->wait_timer, 0, sizeof(ctx->wait_timer));
+    ctx->coro             = NULL;
+    ctx->shard            = NULL;
+
+    ctx->event_waiting   = FALSE;
+    ctx->close_requested = FALSE;
+    ctx->eof             = FALSE;
+    ctx->loaned_buf      = NULL;
+    memset(ctx->stcp_options, 0, sizeof(ctx->stcp_options));
+    ctx->stcp_options_set = 0;
+    ctx->checksum_errors  = 0;
+    ctx->read_eventfd    = 0;
+    ctx->write_eventfd   = 0;
+
+    memset(ctx->network_recv_queue.slots, 0,
+           sizeof(ctx->network_recv_queue.slots));
+    ctx->network_recv_queue.head             = 0;
+    ctx->network_recv_queue.tail             = 0;
+    ctx->network_recv_queue.consumer_waiting = FALSE;
+    ctx->network_recv_queue.producer_waiting = FALSE;
+    ctx->network_recv_queue.closed           = FALSE;
+    ctx->app_send_queue.head = ctx->app_send_queue.tail = NULL;
+    ctx->app_recv_queue.head = ctx->app_recv_queue.tail = NULL;
+
+    ctx->users        = 0;
+    ctx->closed       = FALSE;
+    ctx->retire_epoch = 0;
+    ctx->next_retired = NULL;
+}
+
 /* transport layer thread; transport_init() should not return until the
- * transport layer finishes (i.e. the connection is over).
+ * transport layer finishes (i.e. the connection is over).  the thread then
+ * parks, and runs the next connection it's handed, if any.
  */
 static void *transport_thread_func(void *arg_ptr)
 {
-    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
+    transport_thread_t *t = (transport_thread_t *) arg_ptr;
+    mysock_context_t *ctx;
+
+    assert(t && t->ctx);
+    ctx = t->ctx;
+    t->ctx = NULL;
 
+    while (ctx)
+    {
+        struct timespec deadline;
+
+        ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
+
+        /* enter the STCP control loop.  transport_init() doesn't return
+         * until the connection's finished.  that function should first
+         * signal establishment of the connection after SYN/SYN-ACK (or an
+         * error condition if the connection couldn't be established) to the
+         * application by using stcp_unblock_application(); as the name
+         * suggests, this unblocks the calling code.  transport_init() then
+         * handles the connection, returning only after the connection is
+         * closed.
+         *
+         * a failed connection is reported through errno (see
+         * _mysock_transport_finished()), so clear whatever the previous
+         * connection on this thread left there first.
+         */
+        errno = 0;
+        transport_init(ctx->my_sd, ctx->is_active);
+
+        /* transport_init() has returned; both sides have closed the
+         * connection, do some final cleanup here...
+         */
+        _mysock_transport_finished(ctx);
+        _mysock_transport_done(ctx);
+        ctx = NULL;
+
+        /* wait for another connection, unless enough threads are idle */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TRANSPORT_THREAD_IDLE_SECS;
+
+        PTHREAD_CALL(pthread_mutex_lock(&idle_thread_lock));
+        if (idle_thread_count < TRANSPORT_THREAD_CACHE_MAX)
+        {
+            int rc = 0;
+
+            t->next = idle_threads;
+            idle_threads = t;
+            ++idle_thread_count;
+
+            while (!t->ctx && rc != ETIMEDOUT)
+            {
+                rc = pthread_cond_timedwait(&t->cond, &idle_thread_lock,
+                                            &deadline);
+                assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+            }
+
+            if (!t->ctx)
+            {
+                transport_thread_t **prev;
+
+                /* timed out; nobody has taken us off the list */
+                for (prev = &idle_threads; *prev != t; prev = &(*prev)->next)
+                    assert(*prev);
+                *prev = t->next;
+                --idle_thread_count;
+            }
+
+            ctx = t->ctx;
+            t->ctx = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&idle_thread_lock));
+    }
+
+    PTHREAD_CALL(pthread_cond_destroy(&t->cond));
+    free(t);
+    return NULL;
+}
+
+/* the transport layer is done with the given connection, and myclose() may
+ * now free it; the caller mustn't touch the context afterwards.
+ */
+void _mysock_transport_done(mysock_context_t *ctx)
+{
     assert(ctx);
-    ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
-
-    /* enter the STCP control loop.  transport_init() doesn't return until the
-     * connection's finished.  that function should first signal establishment
-     * of the connection after SYN/SYN-ACK (or an error condition if the
-     * connection couldn't be established) to the application by using
-     * stcp_unblock_application(); as the name suggests, this unblocks the
-     * calling code.  transport_init() then handles the connection,
-     * returning only after the connection is closed.
-     */
-    transport_init(ctx->my_sd, ctx->is_active);
 
-    /* transport_init() has returned; both sides have closed the connection,
-     * do some final cleanup here...
-     */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    ctx->transport_done = TRUE;
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->blocking_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+}
+
+/* final cleanup once the transport layer is done with a connection, on
+ * whichever thread ran it.  errno is still as the transport layer left it.
+ */
+void _mysock_transport_finished(mysock_context_t *ctx)
+{
+    char eof_packet;
+
+    assert(ctx);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     if (ctx->blocking)
@@ -382,11 +1590,16 @@ static void *transport_thread_func(void *arg_ptr)
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     }
 
+    /* in case the transport layer left anything corked */
+    (void) _network_send_flush(ctx->my_sd);
+
+    /* nobody is left to drain the network receive ring */
+    _mysock_ring_close(ctx, &ctx->network_recv_queue);
+
     /* force final myread() to return 0 bytes (this should have been done
      * by the transport layer already in response to the peer's FIN).
      */
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
 }
 
 
@@ -399,8 +1612,8 @@ static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
 {
     mysock_context_t *ctx;
 
-    assert(my_sd >= 0 && my_sd < (int)ARRAY_DIM(global_ctx));
-    ctx = global_ctx[my_sd];
+    assert(my_sd >= 0 && my_sd < table_len);
+    ctx = TABLE_SLOT(my_sd);
 
     assert(ctx);
     assert(ctx->my_sd == my_sd);
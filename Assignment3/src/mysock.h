@@ -27,8 +27,12 @@ typedef int bool_t;
 typedef int mysocket_t;     /* mysocket descriptor */
 
 
-/* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+/* default maximum number of mysockets per process.  this may be changed
+ * at run time by setting MYSOCK_MAX_CONNECTIONS in the environment, up to
+ * MYSOCK_DESCRIPTOR_LIMIT.
+ */
+#define MAX_NUM_CONNECTIONS     65536
+#define MYSOCK_DESCRIPTOR_LIMIT (1 << 20)
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
@@ -43,11 +47,93 @@ extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+
+/* like myread(), but with recv()-style flags:  MSG_PEEK returns data
+ * without removing it, MSG_WAITALL blocks until length bytes have arrived
+ * (or the peer closes the connection), and MSG_DONTWAIT fails with EAGAIN
+ * instead of blocking.
+ */
+extern int myrecv(mysocket_t sd, void *buffer, size_t length, int flags);
+
+/* like myread(), but blocks until the delimiter delim has arrived (or
+ * length bytes are available, or the peer closes the connection), then
+ * returns everything up to and including the delimiter at once.  the
+ * result is not NUL-terminated.
+ */
+extern int myreadline(mysocket_t sd, void *buffer, size_t length, int delim);
+
+/* zero-copy counterpart to myread().  rather than copying into a buffer
+ * supplied by the caller, myread_zc() points *data at up to length bytes of
+ * received data, still in the mysocket layer's own buffer, and returns the
+ * number of bytes there (or 0 at EOF, or -1 on error).  the data may be
+ * used in place until myread_release() is called; only one such loan may
+ * be outstanding at a time.
+ */
+extern int myread_zc(mysocket_t sd, const void **data, size_t length);
+extern int myread_release(mysocket_t sd);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 
+/* per-mysocket options.  at level SOL_STCP, these tune the STCP layer
+ * itself; each takes an int.  until an option is set, it has its default
+ * (see STCP_DEFAULT_* in stcp_api.h), which mygetsockopt() reports.
+ * connections accepted on a listening mysocket inherit its options.
+ *
+ * any other level (SOL_SOCKET, IPPROTO_TCP, ...) is passed through to the
+ * network layer's own socket, e.g. for SO_SNDBUF, SO_RCVBUF or
+ * TCP_NODELAY.  (with the UDP network layer, connections accepted on a
+ * mysocket share its socket.)
+ */
+#define SOL_STCP    0x5354
+
+enum
+{
+    STCP_RCVWND = 1,    /* receive window advertised to the peer, bytes */
+    STCP_MAXSEG,        /* largest payload per segment sent, bytes */
+    STCP_ACK_DELAY,     /* longest an ACK is held back, seconds */
+    STCP_FIN_TIMEOUT,   /* longest to wait for our FIN to be ACKed, seconds */
+    STCP_CHECKSUM,      /* verify the checksum of each segment received */
+    STCP_CHECKSUM_ERRORS, /* segments dropped for a bad checksum; read-only */
+    STCP_OPTION_MAX
+};
+
+extern int mysetsockopt(mysocket_t sd, int level, int option_name,
+                        const void *option_value, socklen_t option_len);
+extern int mygetsockopt(mysocket_t sd, int level, int option_name,
+                        void *option_value, socklen_t *option_len);
+
+/* return a descriptor that becomes readable when myread() (or mywrite(),
+ * respectively) on the given mysocket would not block, so a mysocket can be
+ * waited on from an application's own poll()/select()/epoll loop.  the
+ * descriptor is owned by the mysocket and is closed by myclose(); it must
+ * only be waited on, never read from or written to.  returns -1 on error.
+ */
+extern int mysock_get_eventfd(mysocket_t sd);
+extern int mysock_get_write_eventfd(mysocket_t sd);
+
+/* scheduling statistics for each transport worker, when connections are
+ * run by a worker pool (see MYSOCK_TRANSPORT_WORKERS in mysock_pool.c).
+ * mysock_get_worker_stats() fills in stats for up to max_workers workers,
+ * and returns the number of workers in the pool (0 if there is none).
+ * with MYSOCK_SHARDS (mysock_shard.c), there is one entry per shard;
+ * shards never steal, and injected counts connections handed over through
+ * the shard's mailbox.
+ */
+typedef struct
+{
+    unsigned long runs;             /* turns this worker has run */
+    unsigned long steals;           /* taken from other workers' queues */
+    unsigned long stolen;           /* taken from this worker's queue */
+    unsigned long injected;         /* taken from the shared queue */
+    unsigned int  queue_len;        /* waiting in its queue right now */
+    unsigned int  max_queue_len;
+} mysock_worker_stats_t;
+
+extern int mysock_get_worker_stats(mysock_worker_stats_t *stats,
+                                   int max_workers);
+
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
  */
@@ -12,12 +12,26 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "connection_demux.h"
+#include "stcp_api.h"   /* for the STCP_DEFAULT_* option values */
+#include "transport.h"  /* for STCP_MSS */
 
 
-/* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
+/* each call looks up its mysocket with _mysock_acquire_context(), which
+ * keeps the context alive even if another thread closes it meanwhile, and
+ * must leave through MYSOCK_RETURN to let go of it again.  this relies on
+ * the context being in a local variable named ctx.
+ *
+ * MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
  * 'rc' is indicated to the caller.
  */
-#define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
+#define MYSOCK_RETURN(val) \
+    { \
+        int rc_ = (val), errno_ = errno; \
+        _mysock_release_context(ctx); \
+        errno = errno_; \
+        return rc_; \
+    }
+#define MYSOCK_ERROR_EXIT(rc) { errno = rc; MYSOCK_RETURN(-1); }
 #define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
 
 
@@ -30,7 +44,7 @@ mysocket_t mysocket()
 /* simply a wrapper around bind() */
 int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
     assert(addr);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
@@ -40,13 +54,13 @@ int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen)
     assert(!ctx->listening);
     ctx->bound = TRUE;
     ctx->network_state.local_addr = *addr;
-    return _network_bind(&ctx->network_state, addr, addrlen);
+    MYSOCK_RETURN(_network_bind(&ctx->network_state, addr, addrlen));
 }
 
 /* connect to the address specified in name on the mysocket sd */
 int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
     MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
@@ -58,9 +72,8 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     fflush(stderr);
 #endif  /*DEBUG*/
 
-    ctx->network_state.peer_addr       = *name;
-    ctx->network_state.peer_addr_len   = namelen;
-    ctx->network_state.peer_addr_valid = TRUE;
+    MYSOCK_CHECK(name->sa_family == AF_INET, EAFNOSUPPORT);
+    _network_set_peer_addr(&ctx->network_state, name, namelen);
 
     /* record connection setup for demultiplexing */
     if (!ctx->bound)
@@ -74,62 +87,63 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
          * general).
          */
         if ((rc = _mysock_bind_ephemeral(ctx)) < 0)
-            return rc;
+            MYSOCK_RETURN(rc);
     }
 
     /* time for kick off */
     _mysock_transport_init(sd, TRUE);
 
     /* block until connection is established, or we hit an error */
-    return _mysock_wait_for_connection(ctx);
+    MYSOCK_RETURN(_mysock_wait_for_connection(ctx));
 }
 
 mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 {
-    mysock_context_t *accept_ctx = _mysock_get_context(sd);
-    mysock_context_t *ctx;
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+    mysock_context_t *new_ctx;
 
-    MYSOCK_CHECK(accept_ctx != NULL, EBADF);
-    MYSOCK_CHECK(accept_ctx->listening, EINVAL);
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(ctx->listening, EINVAL);
 
 #ifdef DEBUG
     fprintf(stderr, "\n####Accepting a new connection at port# %hu#### "
             "(sd=%d)\n",
-            ntohs(_network_get_port(&accept_ctx->network_state)), sd);
+            ntohs(_network_get_port(&ctx->network_state)), sd);
     fflush(stderr);
 #endif  /*DEBUG*/
 
     /* the new socket is created on an incoming SYN.  block here until we
      * establish a connection, or STCP indicates an error condition.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
-    assert(ctx);
+    _mysock_dequeue_connection(ctx, &new_ctx);
+    assert(new_ctx);
 
-    if (!ctx->stcp_errno)
+    if (!new_ctx->stcp_errno)
     {
         /* fill in addr, addrlen with address of peer */
-        assert(ctx->network_state.peer_addr_len > 0);
+        assert(new_ctx->network_state.peer_addr_len > 0);
 
         if (addr && addrlen)
         {
-            *addr    = ctx->network_state.peer_addr;
-            *addrlen = ctx->network_state.peer_addr_len;
+            *addr    = new_ctx->network_state.peer_addr;
+            *addrlen = new_ctx->network_state.peer_addr_len;
         }
     }
 
-    assert(ctx->listen_sd == sd);
-    DEBUG_LOG(("***myaccept(%d) returning new sd %d***\n", sd, ctx->my_sd));
-    return (errno = ctx->stcp_errno) ? -1 : ctx->my_sd;
+    assert(new_ctx->listen_sd == sd);
+    DEBUG_LOG(("***myaccept(%d) returning new sd %d***\n",
+               sd, new_ctx->my_sd));
+    MYSOCK_RETURN((errno = new_ctx->stcp_errno) ? -1 : new_ctx->my_sd);
 }
 
 /* in this implementation, mylisten() is assumed to follow mybind() */
 int mylisten(mysocket_t sd, int backlog)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-
-    assert(ctx->bound);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    assert(ctx->bound);
     MYSOCK_CHECK(ctx->bound, EINVAL);
 
     /* set up the socket for demultiplexing */
@@ -137,7 +151,7 @@ int mylisten(mysocket_t sd, int backlog)
     _mysock_set_backlog(ctx, backlog);
 
     if (_network_listen(&ctx->network_state, backlog) < 0)
-        return -1;
+        MYSOCK_RETURN(-1);
 
     /* since we don't spawn an STCP worker thread for passive sockets
      * (there's no transport layer related work to do, so
@@ -147,10 +161,10 @@ int mylisten(mysocket_t sd, int backlog)
     if (_network_start_recv_thread(ctx) < 0)
     {
         assert(0);
-        return -1;
+        MYSOCK_RETURN(-1);
     }
 
-    return 0;
+    MYSOCK_RETURN(0);
 }
 
 /* close the given mysocket.  note that the semantics of myclose() differ
@@ -160,23 +174,27 @@ int mylisten(mysocket_t sd, int backlog)
  */
 int myclose(mysocket_t sd)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
 
     DEBUG_LOG(("***myclose(%d)***\n", sd));
     MYSOCK_CHECK(ctx != NULL, EBADF);
 
+    /* only one thread gets to close a given mysocket */
+    MYSOCK_CHECK(!__atomic_exchange_n(&ctx->closed, TRUE, __ATOMIC_ACQ_REL),
+                 EBADF);
+
     /* stcp_wait_for_event() needs to wake up on a socket close request */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    _mysock_wake_transport(ctx);
 
-    /* block until STCP thread exits */
+    /* block until STCP thread exits (or the worker pool is done with it) */
     if (ctx->transport_thread_started)
     {
         assert(!ctx->listening);
         assert(ctx->is_active || ctx->listen_sd != -1);
-        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
+        _mysock_transport_join(ctx);
         ctx->transport_thread_started = FALSE;
     }
 
@@ -192,44 +210,147 @@ int myclose(mysocket_t sd)
     _mysock_free_context(ctx);
 
     DEBUG_LOG(("myclose(%d) returning...\n", sd));
-    return 0;
+    MYSOCK_RETURN(0);
 }
 
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
+
+    /* this is the only copy of the data on its way out: the transport
+     * layer sends (and holds on to) these buffers by reference.
+     */
+    _mysock_enqueue_segments(ctx, &ctx->app_recv_queue, buf, buf_len,
+                             _mysock_get_option(ctx, STCP_MAXSEG, STCP_MSS));
 
     /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    MYSOCK_RETURN(buf_len);
 }
 
 int myread(mysocket_t sd, void *buf, size_t buf_len)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    return myrecv(sd, buf, buf_len, 0);
+}
+
+int myrecv(mysocket_t sd, void *buf, size_t buf_len, int flags)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
     int len;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL || buf_len == 0, EFAULT);
+    MYSOCK_CHECK(!(flags & ~(MSG_PEEK | MSG_WAITALL | MSG_DONTWAIT)),
+                 EOPNOTSUPP);
 
     assert(!ctx->close_requested);
 
-    if (ctx->eof)
-        return 0;
+    if (ctx->eof || buf_len == 0)
+        MYSOCK_RETURN(0);
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    if ((len = _mysock_dequeue_stream(ctx, &ctx->app_send_queue,
+                                      buf, buf_len, flags)) == 0 &&
+        !(flags & MSG_PEEK))
     {
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
     }
 
-    return len;
+    MYSOCK_RETURN(len);
+}
+
+int myread_zc(mysocket_t sd, const void **data, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+    mysock_buf_t *buf;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(data != NULL, EFAULT);
+    MYSOCK_CHECK(ctx->loaned_buf == NULL, EBUSY);
+
+    assert(!ctx->close_requested);
+
+    *data = NULL;
+    if (ctx->eof || buf_len == 0)
+        MYSOCK_RETURN(0);
+
+    /* the app gets the queue's own handle to the buffer if it takes all of
+     * it, or a clone sharing the same storage otherwise.
+     */
+    buf = _mysock_dequeue_buf(ctx, &ctx->app_send_queue, buf_len);
+    if (buf->data_len == 0)
+    {
+        /* EOF marker; make sure repeated calls return 0 */
+        _mysock_buf_release(buf);
+        ctx->eof = TRUE;
+        MYSOCK_RETURN(0);
+    }
+
+    ctx->loaned_buf = buf;
+    *data = buf->data;
+    MYSOCK_RETURN(buf->data_len);
+}
+
+int myread_release(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(ctx->loaned_buf != NULL, EINVAL);
+
+    _mysock_buf_release(ctx->loaned_buf);
+    ctx->loaned_buf = NULL;
+    MYSOCK_RETURN(0);
+}
+
+int mysock_get_eventfd(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    MYSOCK_RETURN(_mysock_get_eventfd(ctx, FALSE));
+}
+
+int mysock_get_write_eventfd(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    MYSOCK_RETURN(_mysock_get_eventfd(ctx, TRUE));
+}
+
+int myreadline(mysocket_t sd, void *buf, size_t buf_len, int delim)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+    int len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL || buf_len == 0, EFAULT);
+
+    assert(!ctx->close_requested);
+
+    if (ctx->eof || buf_len == 0)
+        MYSOCK_RETURN(0);
+
+    if ((len = _mysock_dequeue_until(ctx, &ctx->app_send_queue,
+                                     buf, buf_len, delim)) == 0)
+    {
+        /* make sure repeated calls return 0 on EOF */
+        ctx->eof = TRUE;
+    }
+
+    MYSOCK_RETURN(len);
 }
 
 /* fills in addr with current port associated with the mysocket descriptor.
@@ -238,7 +359,7 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
  */
 int mygetsockname(mysocket_t sd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
 
     assert(addr && addrlen);
 
@@ -262,12 +383,14 @@ int mygetsockname(mysocket_t sd, struct sockaddr *addr, socklen_t *addrlen)
             _network_get_local_addr(&ctx->network_state);
     }
 
-    return 0;
+    MYSOCK_RETURN(0);
 }
 
 int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
 
     assert(name && namelen);
     MYSOCK_CHECK(name != NULL && namelen != NULL, EFAULT);
@@ -276,7 +399,120 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
            MIN(*namelen, (socklen_t)ctx->network_state.peer_addr_len));
 
     MYSOCK_CHECK((*namelen = ctx->network_state.peer_addr_len) > 0, ENOTCONN);
-    return 0;
+    MYSOCK_RETURN(0);
+}
+
+/* set an option on the mysocket; see mysock.h.  SOL_STCP options are kept
+ * in the context for the transport layer to look up with stcp_get_option(),
+ * while anything else goes to the network layer's socket.
+ */
+int mysetsockopt(mysocket_t sd, int level, int option_name,
+                 const void *option_value, socklen_t option_len)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(option_value != NULL, EFAULT);
+
+    if (level != SOL_STCP)
+    {
+        MYSOCK_RETURN(_network_setsockopt(&ctx->network_state, level,
+                                          option_name, option_value,
+                                          option_len));
+    }
+
+    MYSOCK_CHECK(option_name > 0 && option_name < STCP_OPTION_MAX &&
+                 option_name != STCP_CHECKSUM_ERRORS, ENOPROTOOPT);
+    MYSOCK_CHECK(option_len == sizeof(int), EINVAL);
+    memcpy(&value, option_value, sizeof(value));
+
+    switch (option_name)
+    {
+    case STCP_RCVWND:
+        MYSOCK_CHECK(value > 0 && value <= 0xffff, EINVAL);
+        break;
+
+    case STCP_MAXSEG:
+        MYSOCK_CHECK(value > 0 &&
+                     value <= (int) (MAX_IP_PAYLOAD_LEN -
+                                     sizeof(struct tcphdr)), EINVAL);
+        break;
+
+    case STCP_CHECKSUM:
+        value = (value != 0);
+        break;
+
+    default:
+        MYSOCK_CHECK(value >= 0, EINVAL);
+        break;
+    }
+
+    __atomic_store_n(&ctx->stcp_options[option_name], value,
+                     __ATOMIC_RELAXED);
+    __atomic_or_fetch(&ctx->stcp_options_set, 1U << option_name,
+                      __ATOMIC_RELEASE);
+    MYSOCK_RETURN(0);
+}
+
+int mygetsockopt(mysocket_t sd, int level, int option_name,
+                 void *option_value, socklen_t *option_len)
+{
+    mysock_context_t *ctx = _mysock_acquire_context(sd);
+    int value;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(option_value != NULL && option_len != NULL, EFAULT);
+
+    if (level != SOL_STCP)
+    {
+        MYSOCK_RETURN(_network_getsockopt(&ctx->network_state, level,
+                                          option_name, option_value,
+                                          option_len));
+    }
+
+    MYSOCK_CHECK(option_name > 0 && option_name < STCP_OPTION_MAX,
+                 ENOPROTOOPT);
+    MYSOCK_CHECK(*option_len >= sizeof(int), EINVAL);
+
+    switch (option_name)
+    {
+    case STCP_MAXSEG:
+        value = _mysock_get_option(ctx, option_name, STCP_MSS);
+        break;
+
+    case STCP_CHECKSUM:
+        value = _mysock_get_option(ctx, option_name, TRUE);
+        break;
+
+    case STCP_CHECKSUM_ERRORS:
+        value = (int) __atomic_load_n(&ctx->checksum_errors,
+                                      __ATOMIC_RELAXED);
+        break;
+
+    case STCP_RCVWND:
+        value = _mysock_get_option(ctx, option_name, STCP_DEFAULT_RCVWND);
+        break;
+
+    case STCP_ACK_DELAY:
+        value = _mysock_get_option(ctx, option_name,
+                                   STCP_DEFAULT_ACK_DELAY);
+        break;
+
+    case STCP_FIN_TIMEOUT:
+        value = _mysock_get_option(ctx, option_name,
+                                   STCP_DEFAULT_FIN_TIMEOUT);
+        break;
+
+    default:
+        assert(0);
+        value = 0;
+        break;
+    }
+
+    memcpy(option_value, &value, sizeof(value));
+    *option_len = sizeof(value);
+    MYSOCK_RETURN(0);
 }
 
 /* returns IP address of interface on which packets to/from network address
@@ -0,0 +1,145 @@
+/* mysock_buf.c--reference-counted packet buffers */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "mysock_buf.h"
+
+
+/* buffers big enough for any packet are recycled through a free list
+ * rather than going back to malloc() each time; larger (application
+ * write) buffers are always freed.
+ */
+#define MYSOCK_BUF_POOL_SIZE    MAX_IP_PAYLOAD_LEN
+#define MYSOCK_BUF_POOL_MAX     1024
+
+static mysock_buf_t    *buf_pool;
+static unsigned int     buf_pool_len;
+static pthread_mutex_t  buf_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+mysock_buf_t *_mysock_buf_alloc(size_t len)
+{
+    mysock_buf_t *buf = NULL;
+    size_t capacity;
+
+    capacity = MYSOCK_BUF_HEADROOM +
+        ((len <= MYSOCK_BUF_POOL_SIZE) ? MYSOCK_BUF_POOL_SIZE : len);
+
+    if (len <= MYSOCK_BUF_POOL_SIZE)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&buf_pool_lock));
+        if ((buf = buf_pool) != NULL)
+        {
+            buf_pool = buf->next_free;
+            --buf_pool_len;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&buf_pool_lock));
+    }
+
+    if (!buf)
+    {
+        buf = (mysock_buf_t *) malloc(sizeof(mysock_buf_t) + capacity);
+        assert(buf);
+    }
+
+    buf->refcount  = 1;
+    buf->capacity  = capacity;
+    buf->data      = MYSOCK_BUF_HEAD(buf) + MYSOCK_BUF_HEADROOM;
+    buf->data_len  = 0;
+    buf->next_free = NULL;
+    buf->parent    = NULL;
+    return buf;
+}
+
+mysock_buf_t *_mysock_buf_copy(const void *src, size_t len)
+{
+    mysock_buf_t *buf = _mysock_buf_alloc(len);
+
+    assert(src || !len);
+    if (len > 0)
+        memcpy(buf->data, src, len);
+    buf->data_len = len;
+    return buf;
+}
+
+mysock_buf_t *_mysock_buf_clone(mysock_buf_t *buf, const char *src, size_t len)
+{
+    mysock_buf_t *clone;
+
+    assert(buf && src >= buf->data && src + len <= buf->data + buf->data_len);
+
+    /* always clone the owner of the storage, so chains stay one deep */
+    if (buf->parent)
+        buf = buf->parent;
+
+    clone = (mysock_buf_t *) malloc(sizeof(mysock_buf_t));
+    assert(clone);
+
+    _mysock_buf_hold(buf);
+    clone->refcount  = 1;
+    clone->capacity  = 0;
+    clone->data      = (char *) src;
+    clone->data_len  = len;
+    clone->next_free = NULL;
+    clone->parent    = buf;
+    return clone;
+}
+
+void _mysock_buf_hold(mysock_buf_t *buf)
+{
+    assert(buf && buf->refcount > 0);
+    (void) __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void _mysock_buf_release(mysock_buf_t *buf)
+{
+    assert(buf && buf->refcount > 0);
+    if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (buf->parent)
+    {
+        _mysock_buf_release(buf->parent);
+        free(buf);
+        return;
+    }
+
+    if (buf->capacity == MYSOCK_BUF_HEADROOM + MYSOCK_BUF_POOL_SIZE)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&buf_pool_lock));
+        if (buf_pool_len < MYSOCK_BUF_POOL_MAX)
+        {
+            buf->next_free = buf_pool;
+            buf_pool = buf;
+            ++buf_pool_len;
+            buf = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&buf_pool_lock));
+    }
+
+    free(buf);
+}
+
+void _mysock_buf_pull(mysock_buf_t *buf, size_t len)
+{
+    assert(buf && len <= buf->data_len);
+    buf->data     += len;
+    buf->data_len -= len;
+}
+
+void *_mysock_buf_push(mysock_buf_t *buf, size_t len)
+{
+    assert(buf && _mysock_buf_headroom(buf) >= len);
+    buf->data     -= len;
+    buf->data_len += len;
+    return buf->data;
+}
+
+size_t _mysock_buf_headroom(const mysock_buf_t *buf)
+{
+    assert(buf);
+    return buf->parent ? 0 : (size_t) (buf->data - MYSOCK_BUF_HEAD(buf));
+}
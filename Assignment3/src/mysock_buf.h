@@ -0,0 +1,67 @@
+/* mysock_buf.h--reference-counted packet buffers.
+ * this is an internal header, used only by the mysocket and network layers;
+ * the transport layer sees these buffers only through the opaque
+ * stcp_buf_t handles in stcp_api.h.
+ */
+
+#ifndef __MYSOCK_BUF_H__
+#define __MYSOCK_BUF_H__
+
+#include <stddef.h>
+#include "mysock.h"
+#include "network_io.h"
+
+/* bytes reserved in front of every buffer's data, so that lower layers can
+ * prepend headers without copying the payload.  this comfortably holds an
+ * STCP header plus options.
+ */
+#define MYSOCK_BUF_HEADROOM 64
+
+/* a buffer is passed by handle from one stage to the next (network receive
+ * thread -> transport -> application, or application -> transport ->
+ * network).  each holder of a handle owns one reference; the buffer is
+ * recycled once the last reference is released.  stages strip or prepend
+ * headers by moving data/data_len rather than copying the contents.
+ */
+typedef struct mysock_buf
+{
+    int                refcount;
+    size_t             capacity;    /* bytes of storage following this */
+    char              *data;        /* first valid byte */
+    size_t             data_len;    /* number of valid bytes */
+    struct mysock_buf *next_free;   /* buffer pool linkage */
+    struct mysock_buf *parent;      /* owner of the storage, for clones */
+} mysock_buf_t;
+
+/* start of the buffer's storage (and hence of its headroom) */
+#define MYSOCK_BUF_HEAD(b)      ((char *) ((b) + 1))
+
+/* allocate a buffer with room for len bytes of data after the headroom.
+ * the buffer is returned with one reference and no valid data.
+ */
+mysock_buf_t *_mysock_buf_alloc(size_t len);
+
+/* allocate a buffer holding a copy of the given data */
+mysock_buf_t *_mysock_buf_copy(const void *src, size_t len);
+
+/* allocate a new handle to len bytes of an existing buffer's data, starting
+ * at src, without copying them.  the clone holds a reference to the
+ * original buffer's storage, and has no headroom of its own.
+ */
+mysock_buf_t *_mysock_buf_clone(mysock_buf_t *buf, const char *src, size_t len);
+
+void _mysock_buf_hold(mysock_buf_t *buf);
+void _mysock_buf_release(mysock_buf_t *buf);
+
+/* strip len bytes from the front of the buffer's data */
+void _mysock_buf_pull(mysock_buf_t *buf, size_t len);
+
+/* prepend len bytes to the front of the buffer's data, using headroom.
+ * returns a pointer to the new start of data.
+ */
+void *_mysock_buf_push(mysock_buf_t *buf, size_t len);
+
+/* number of bytes that may be prepended with _mysock_buf_push() */
+size_t _mysock_buf_headroom(const mysock_buf_t *buf);
+
+#endif  /* __MYSOCK_BUF_H__ */
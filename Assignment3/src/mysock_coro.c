@@ -0,0 +1,235 @@
+/* mysock_coro.c--run a blocking transport layer as coroutines on the
+ * shards
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "stcp_api.h"
+#include "transport.h"
+
+
+/* with MYSOCK_TRANSPORT_COROUTINES set, the shards (mysock_shard.c) run
+ * each connection's transport_init() as it stands, as a coroutine with its
+ * own small stack, rather than driving transport_open() and
+ * transport_dispatch().  when the transport layer would block--in
+ * stcp_wait_for_event(), or in stcp_network_recv()/stcp_app_recv() with
+ * nothing queued--the coroutine records what it's waiting for, exactly as
+ * stcp_set_wait() does, and switches back to the shard.  the shard resumes
+ * it once one of those events comes up, handing it the events as the
+ * return value of stcp_wait_for_event().
+ *
+ * a coroutine always runs on the thread that created it.  the compiler is
+ * free to work out the address of a thread-local variable (current here,
+ * or errno in the transport layer, since glibc declares __errno_location()
+ * const) once, and reuse it across swapcontext(), so a coroutine resumed
+ * on another thread could use the last one's.  a connection never leaves
+ * its shard, but the worker pool moves connections between workers, so it
+ * won't run coroutines:  MYSOCK_TRANSPORT_COROUTINES is ignored unless
+ * MYSOCK_SHARDS is set too (see _mysock_pool_config()).
+ *
+ * switching isn't free:  swapcontext() saves and restores the signal mask,
+ * which is a sigprocmask() system call on every switch, i.e. two for each
+ * wait and resume.  that's still far cheaper than the futex wait and
+ * wakeup of a thread blocking in stcp_wait_for_event(), but it's the bulk
+ * of what a coroutine switch costs.
+ */
+
+#define CORO_STACK_DEFAULT  (64 * 1024)
+#define CORO_STACK_MIN      (16 * 1024)
+
+struct mysock_coro
+{
+    ucontext_t    uc;           /* the coroutine */
+    ucontext_t    caller;       /* the shard that resumed it */
+    char         *stack;        /* mapping, including a guard page */
+    size_t        stack_len;
+    unsigned int  event;        /* handed over by _mysock_coro_resume() */
+    bool_t        finished;     /* transport_init() has returned */
+};
+
+static size_t          coro_stack_size;
+static pthread_once_t  coro_config_once = PTHREAD_ONCE_INIT;
+
+/* the context whose coroutine is running on this thread, if any */
+static __thread mysock_context_t *current;
+
+
+static void _mysock_coro_config(void);
+static void _mysock_coro_main(unsigned int hi, unsigned int lo);
+
+
+static void _mysock_coro_config(void)
+{
+    const char *env = getenv("MYSOCK_COROUTINE_STACK");
+    long page = sysconf(_SC_PAGESIZE);
+    long len = CORO_STACK_DEFAULT;
+
+    if (env && strtol(env, NULL, 10) > 0)
+        len = MAX(strtol(env, NULL, 10), (long) CORO_STACK_MIN);
+    coro_stack_size = (size_t) ((len + page - 1) / page * page);
+}
+
+/* TRUE if the shards should run transport_init() as coroutines */
+bool_t _mysock_coro_enabled(void)
+{
+    const char *env = getenv("MYSOCK_TRANSPORT_COROUTINES");
+
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+/* set up a coroutine to run transport_init() for the given connection.
+ * nothing runs until the first _mysock_coro_resume().
+ */
+void _mysock_coro_create(mysock_context_t *ctx)
+{
+    mysock_coro_t *coro;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t arg = (uintptr_t) ctx;
+
+    assert(ctx && !ctx->coro);
+    PTHREAD_CALL(pthread_once(&coro_config_once, _mysock_coro_config));
+
+    coro = (mysock_coro_t *) calloc(1, sizeof(*coro));
+    assert(coro);
+
+    /* the lowest page of the stack is left inaccessible, so an overflow
+     * faults rather than trampling the heap
+     */
+    coro->stack_len = coro_stack_size + page;
+    coro->stack = (char *) mmap(NULL, coro->stack_len,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+                                -1, 0);
+    if (coro->stack == MAP_FAILED || mprotect(coro->stack, page, PROT_NONE))
+    {
+        perror("coroutine stack");
+        assert(0);
+        abort();
+    }
+
+    if (getcontext(&coro->uc) < 0)
+    {
+        perror("getcontext");
+        assert(0);
+        abort();
+    }
+    coro->uc.uc_stack.ss_sp   = coro->stack + page;
+    coro->uc.uc_stack.ss_size = coro_stack_size;
+    coro->uc.uc_link          = &coro->caller;
+
+    /* makecontext() only passes ints */
+    makecontext(&coro->uc, (void (*)(void)) _mysock_coro_main, 2,
+                (unsigned int) ((uint64_t) arg >> 32),
+                (unsigned int) (arg & 0xffffffffu));
+
+    ctx->coro = coro;
+}
+
+static void _mysock_coro_main(unsigned int hi, unsigned int lo)
+{
+    mysock_context_t *ctx =
+        (mysock_context_t *) (uintptr_t) (((uint64_t) hi << 32) | lo);
+
+    assert(ctx && ctx->coro && current == ctx);
+    transport_init(ctx->my_sd, ctx->is_active);
+
+    /* returning switches back to coro->caller, via uc_link */
+    ctx->coro->finished = TRUE;
+}
+
+/* run the connection's coroutine until it next waits, passing it the
+ * given events.  returns TRUE once transport_init() has returned, at which
+ * point the coroutine is freed.
+ */
+bool_t _mysock_coro_resume(mysock_context_t *ctx, unsigned int event)
+{
+    mysock_coro_t    *coro;
+    mysock_context_t *prev = current;
+
+    assert(ctx && (coro = ctx->coro) != NULL && !coro->finished);
+
+    coro->event = event;
+    current = ctx;
+    if (swapcontext(&coro->caller, &coro->uc) < 0)
+    {
+        perror("swapcontext");
+        assert(0);
+        abort();
+    }
+    current = prev;
+
+    if (!coro->finished)
+        return FALSE;
+
+    (void) munmap(coro->stack, coro->stack_len);
+    free(coro);
+    ctx->coro = NULL;
+    return TRUE;
+}
+
+/* TRUE if called from the given connection's coroutine */
+bool_t _mysock_coro_running(mysock_context_t *ctx)
+{
+    return ctx && current == ctx;
+}
+
+/* stcp_wait_for_event() on a coroutine:  note what we're waiting for,
+ * switch back to the shard, and return the events we're resumed with
+ * (0 if the timeout expired).
+ */
+unsigned int _mysock_coro_wait(mysock_context_t      *ctx,
+                               unsigned int           flags,
+                               const struct timespec *abstime)
+{
+    mysock_coro_t *coro;
+
+    assert(_mysock_coro_running(ctx));
+    coro = ctx->coro;
+
+    ctx->wait_flags = flags;
+    if ((ctx->wait_timed = (abstime != NULL)) != FALSE)
+        ctx->wait_timer.deadline = *abstime;
+
+    if (swapcontext(&coro->uc, &coro->caller) < 0)
+    {
+        perror("swapcontext");
+        assert(0);
+        abort();
+    }
+
+    assert(current == ctx);
+    return coro->event;
+}
+
+/* wait until one of the given events (APP_DATA or NETWORK_DATA) is
+ * pending, so a transport layer call that would block on an empty queue
+ * yields instead.  this does nothing unless called from the connection's
+ * own coroutine.  a close request stays pending for the next
+ * stcp_wait_for_event().
+ */
+void _mysock_coro_block(mysock_context_t *ctx, unsigned int flags)
+{
+    if (!_mysock_coro_running(ctx))
+        return;
+
+    flags |= MYSOCK_EVENT_KEEP_CLOSE;
+    for (;;)
+    {
+        unsigned int ready;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        ready = _mysock_take_events(ctx, flags);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        if (ready)
+            return;
+        (void) _mysock_coro_wait(ctx, flags, NULL);
+    }
+}
@@ -26,6 +26,11 @@
  * absence from the table.  (if the key exists, it behaves identically to
  * HASH_LOOKUP).
  *
+ * the size given to HASH_TABLE_DECLARE is the initial number of buckets;
+ * the table is allocated on first insertion, and doubles in size whenever
+ * it holds as many entries as buckets, so there is no fixed limit on the
+ * number of entries.  the hash function is passed the current size.
+ *
  * example usage, to map uint16_t -> mysock_context_t * using a hash
  * function unsigned int port_hash(uint16_t key, unsigned int table_size):
  *
@@ -60,27 +65,68 @@ typedef struct tbl##_entry \
     datatype            data; \
     struct tbl##_entry *next; \
 } __##tbl##_entry_t; \
-static __##tbl##_entry_t *tbl[size]; \
+static __##tbl##_entry_t **tbl; \
+static unsigned int tbl##_size;     /* # of buckets */ \
+static unsigned int tbl##_count;    /* # of entries */ \
 \
 static __##tbl##_entry_t *_hash_get_entry_##tbl(keytype key) \
 { \
     __##tbl##_entry_t *e; \
     unsigned int ndx; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!tbl) \
+        return NULL; \
+    \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     \
     for (e = tbl[ndx]; e && !keyequal(e->key, key); e = e->next) ; \
     return (e && keyequal(e->key, key)) ? e : NULL; \
 } \
 \
+/* (re)allocate the bucket array with new_size buckets, moving any \
+ * existing entries across. \
+ */ \
+static void _hash_resize_##tbl(unsigned int new_size) \
+{ \
+    __##tbl##_entry_t **new_tbl, *e, *next; \
+    unsigned int k; \
+    \
+    new_tbl = (__##tbl##_entry_t **) \
+        calloc(new_size, sizeof(__##tbl##_entry_t *)); \
+    assert(new_tbl); \
+    \
+    for (k = 0; k < tbl##_size; ++k) \
+    { \
+        for (e = tbl[k]; e; e = next) \
+        { \
+            unsigned int ndx = hashfn(e->key, new_size); \
+            \
+            assert(ndx < new_size); \
+            next = e->next; \
+            e->next = new_tbl[ndx]; \
+            new_tbl[ndx] = e; \
+        } \
+    } \
+    \
+    free(tbl); \
+    tbl = new_tbl; \
+    tbl##_size = new_size; \
+} \
+\
 static void _hash_insert_##tbl(keytype key, datatype data) \
 { \
     unsigned int ndx; \
     __##tbl##_entry_t *old_head; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    /* keep the load factor at or below one */ \
+    if (!tbl) \
+        _hash_resize_##tbl(size); \
+    else if (tbl##_count >= tbl##_size) \
+        _hash_resize_##tbl(2 * tbl##_size); \
+    \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     old_head = tbl[ndx]; \
     \
     tbl[ndx] = (__##tbl##_entry_t *) malloc(sizeof(__##tbl##_entry_t)); \
@@ -89,6 +135,7 @@ static void _hash_insert_##tbl(keytype key, datatype data) \
     tbl[ndx]->key  = key; \
     tbl[ndx]->data = data; \
     tbl[ndx]->next = old_head; \
+    ++tbl##_count; \
     \
     assert(_hash_get_entry_##tbl(key) == tbl[ndx]); \
 } \
@@ -126,14 +173,19 @@ static void _hash_delete_##tbl(keytype key) \
     __##tbl##_entry_t *prev = 0, *e; \
     unsigned int ndx; \
     \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
+    if (!tbl) \
+        return; \
+    \
+    ndx = hashfn(key, tbl##_size); \
+    assert(ndx < tbl##_size); \
     \
     for (e = tbl[ndx]; e; e = e->next) \
     { \
         if (keyequal(e->key, key)) \
         { \
             *((e == tbl[ndx]) ? &tbl[ndx] : &prev->next) = e->next; \
+            assert(tbl##_count > 0); \
+            --tbl##_count; \
             break; \
         } \
         prev = e; \
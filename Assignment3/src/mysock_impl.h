@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <pthread.h>
 #include "mysock.h"
+#include "mysock_buf.h"
 #include "network_io.h"
 
 #ifdef __GNUC__
@@ -48,11 +49,14 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
+/* packet/buffer queue.  each node holds a reference to a buffer; data and
+ * data_len describe the part of it that hasn't been read yet.
+ */
 typedef struct packet_queue_node
 {
-    char                     *data;
-    size_t                    data_len;
+    mysock_buf_t             *buf;
+    char                     *data;     /* first unread byte in buf */
+    size_t                    data_len; /* number of unread bytes */
     struct packet_queue_node *next;
 } packet_queue_node_t;
 
@@ -60,12 +64,82 @@ typedef struct
 {
     packet_queue_node_t *head;
     packet_queue_node_t *tail;
+
+    /* signaled when a buffer is added to the queue.  each queue has exactly
+     * one consuming party (the transport layer or the application), so only
+     * that party is woken by an enqueue.
+     */
+    pthread_cond_t       ready_cond;
 } packet_queue_t;
 
+/* bounded single-producer/single-consumer packet ring.  this hands packets
+ * from the network receive thread (the only producer) to the transport
+ * thread (the only consumer) by buffer handle, without taking a lock or
+ * copying.  head and tail are free-running counters; each is written
+ * only by its owning side.  the consumer sleeps only when the ring is
+ * empty, and the producer only when it is full; the *_waiting flags let
+ * the other side skip the lock and condition variable entirely unless
+ * somebody is actually asleep.  a producer that mustn't sleep (the network
+ * reactor) stops reading instead, and is restarted by the consumer once
+ * there is room (see _mysock_ring_pause()).
+ */
+#define PACKET_RING_SIZE 32
+
+#if (PACKET_RING_SIZE & (PACKET_RING_SIZE - 1)) != 0
+    #error PACKET_RING_SIZE should be a power of two
+#endif
+
+typedef struct
+{
+    mysock_buf_t *slots[PACKET_RING_SIZE];
+
+    unsigned int head __attribute__ ((aligned(64)));   /* consumer */
+    unsigned int tail __attribute__ ((aligned(64)));   /* producer */
+
+    /* the remaining fields are protected by the context's data_ready_lock */
+    bool_t         consumer_waiting __attribute__ ((aligned(64)));
+    bool_t         producer_waiting;
+    bool_t         producer_paused; /* see _mysock_ring_pause() */
+    bool_t         closed;          /* consumer has gone away */
+    pthread_cond_t ready_cond;      /* consumer waits for a packet */
+    pthread_cond_t space_cond;      /* producer waits for a free slot */
+} packet_ring_t;
+
+/* transport layer coroutine; see mysock_coro.c */
+typedef struct mysock_coro mysock_coro_t;
+
+/* CPU-pinned thread owning a set of mysockets; see mysock_shard.c */
+typedef struct mysock_shard mysock_shard_t;
+
+/* binary min-heap of deadlines (see mysock_sched.c).  the heap holds
+ * pointers to mysock_timer_t entries, each embedded in whatever it times
+ * (owner points back at that); storage is grown as needed.
+ */
+typedef struct mysock_timer
+{
+    struct timespec deadline;
+    unsigned long   seq;    /* keeps entries due together in order */
+    int             index;  /* position in its heap, or -1 */
+    void           *owner;
+} mysock_timer_t;
+
+typedef struct
+{
+    mysock_timer_t **entry;
+    int              count, size;
+    unsigned long    seq;
+} mysock_timer_heap_t;
+
+/* internal flag for _mysock_take_events():  don't report (or consume) a
+ * pending close request.  this lies outside the stcp_event_type_t bits.
+ */
+#define MYSOCK_EVENT_KEEP_CLOSE 0x100
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
- * of this structure per mysocket.
+ * of this structure per mysocket.  contexts are recycled; a new field must
+ * also be cleared in _mysock_reset_context().
  */
 typedef struct mysock_context
 {
@@ -94,24 +168,70 @@ typedef struct mysock_context
     bool_t          blocking;
     int             stcp_errno;
 
-    /* STCP thread */
-    pthread_t       transport_thread;
+    /* set once the transport layer has been started, whether on its own
+     * (possibly recycled) thread, by the worker pool (pooled; see
+     * mysock_pool.c), or by a shard.
+     */
     bool_t          transport_thread_started;
 
-    /* is data ready from either network or the app? */
-    pthread_cond_t  data_ready_cond;
+    /* worker pool scheduling state, protected by the pool's lock.
+     * transport_done is protected by blocking_lock, and signaled on
+     * blocking_cond.  wait_* are set by stcp_set_wait(), from whichever
+     * thread is running the transport layer.
+     */
+    bool_t                  pooled;
+    bool_t                  transport_opened;
+    bool_t                  transport_done;
+    int                     sched_state;
+    struct mysock_context  *sched_next;     /* run queue link */
+    unsigned int            wait_flags;
+    bool_t                  wait_timed;
+    mysock_timer_t          wait_timer;     /* deadline, if wait_timed */
+    mysock_coro_t          *coro;   /* if run as a coroutine */
+    mysock_shard_t         *shard;  /* owner, if MYSOCK_SHARDS is set */
+
+    /* is data ready from either network or the app?  data_ready_lock
+     * protects the two app queues below, and the sleep/wakeup state of the
+     * network receive ring; each has its own wait channel (see
+     * packet_queue_t and packet_ring_t).  event_cond is signaled for any
+     * event of interest to stcp_wait_for_event(), but only while the
+     * transport layer is actually waiting there (event_waiting).
+     */
     pthread_mutex_t data_ready_lock;
+    pthread_cond_t  event_cond;
+    bool_t          event_waiting;
     bool_t          close_requested;    /* myclose() called by app? */
     bool_t          eof;                /* true once peer finishes writing */
+    mysock_buf_t   *loaned_buf;         /* lent to app by myread_zc() */
+
+    /* SOL_STCP options set with mysetsockopt(), indexed by option; bit n
+     * of stcp_options_set is set once option n has been.  see
+     * stcp_get_option().
+     */
+    int             stcp_options[STCP_OPTION_MAX];
+    unsigned int    stcp_options_set;
+    unsigned int    checksum_errors;    /* see _mysock_segment_ok() */
+
+    /* readable when myread()/mywrite() would not block, or -1 if the app
+     * hasn't asked for them.  protected by data_ready_lock.
+     */
+    int             read_eventfd;
+    int             write_eventfd;
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
      * coming from the app via mywrite().
      */
-    packet_queue_t  network_recv_queue; /* data coming from peer */
+    packet_ring_t   network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
     packet_queue_t  app_recv_queue; /* data coming from app */
+
+    /* deferred reclamation; see _mysock_acquire_context() */
+    int                     users;      /* app calls in progress */
+    bool_t                  closed;     /* set once by myclose() */
+    unsigned long           retire_epoch;
+    struct mysock_context  *next_retired;
 } mysock_context_t;
 
 
@@ -120,8 +240,21 @@ mysocket_t _mysock_new_mysocket();
 
 mysock_context_t *_mysock_get_context(mysocket_t sd);
 
+mysock_context_t *_mysock_acquire_context(mysocket_t sd);
+void _mysock_release_context(mysock_context_t *ctx);
+
 void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
+void _mysock_transport_finished(mysock_context_t *ctx);
+
+void _mysock_transport_done(mysock_context_t *ctx);
+
+void _mysock_transport_join(mysock_context_t *ctx);
+
+unsigned int _mysock_take_events(mysock_context_t *ctx, unsigned int flags);
+
+void _mysock_wake_transport(mysock_context_t *ctx);
+
 int _mysock_wait_for_connection(mysock_context_t *ctx);
 
 void _mysock_free_context(mysock_context_t *ctx);
@@ -131,15 +264,151 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
+void _mysock_enqueue_segments(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              const void       *src,
+                              size_t            len,
+                              size_t            seg_len);
+
+void _mysock_enqueue_buf(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         mysock_buf_t     *buf);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+mysock_buf_t *_mysock_dequeue_buf(mysock_context_t *ctx,
+                                  packet_queue_t   *pq,
+                                  size_t            max_len);
+
+ssize_t _mysock_dequeue_stream(mysock_context_t *ctx,
+                               packet_queue_t   *pq,
+                               void             *dst,
+                               size_t            max_len,
+                               int               flags);
+
+size_t _mysock_dequeue_until(mysock_context_t *ctx,
+                             packet_queue_t   *pq,
+                             void             *dst,
+                             size_t            max_len,
+                             int               delim);
+
+void _mysock_ring_push(mysock_context_t *ctx,
+                       packet_ring_t    *ring,
+                       mysock_buf_t     *buf);
+
+bool_t _mysock_ring_pause(mysock_context_t *ctx, packet_ring_t *ring);
+
+bool_t _mysock_segment_ok(mysock_context_t      *ctx,
+                          const struct sockaddr *peer_addr,
+                          const void            *packet,
+                          size_t                 len);
+
+mysock_buf_t *_mysock_ring_pop(mysock_context_t *ctx, packet_ring_t *ring);
+
+void _mysock_ring_close(mysock_context_t *ctx, packet_ring_t *ring);
+
+static INLINE bool_t _mysock_ring_empty(const packet_ring_t *ring)
+{
+    return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* TRUE if _mysock_ring_push() would block; called by the producer */
+static INLINE bool_t _mysock_ring_full(const packet_ring_t *ring)
+{
+    return (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+            PACKET_RING_SIZE) &&
+           !__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+}
+
+/* the value of a SOL_STCP option, or default_value if it hasn't been set.
+ * the app may set options from its own thread, so the value is published
+ * before its bit in stcp_options_set (see mysetsockopt()).
+ */
+static INLINE int _mysock_get_option(const mysock_context_t *ctx,
+                                     int option, int default_value)
+{
+    assert(option > 0 && option < STCP_OPTION_MAX);
+
+    if (!(__atomic_load_n(&ctx->stcp_options_set, __ATOMIC_ACQUIRE) &
+          (1U << option)))
+        return default_value;
+    return __atomic_load_n(&ctx->stcp_options[option], __ATOMIC_RELAXED);
+}
+
+int _mysock_get_eventfd(mysock_context_t *ctx, bool_t is_write);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
+/* mysock_pool.c */
+bool_t _mysock_pool_enabled(void);
+
+void _mysock_pool_start(mysock_context_t *ctx);
+
+void _mysock_pool_wake(mysock_context_t *ctx);
+
+/* mysock_sched.c */
+bool_t _mysock_timespec_before(const struct timespec *a,
+                               const struct timespec *b);
+
+bool_t _mysock_timer_insert(mysock_timer_heap_t *heap, mysock_timer_t *timer);
+
+void _mysock_timer_remove(mysock_timer_heap_t *heap, mysock_timer_t *timer);
+
+mysock_timer_t *_mysock_timer_expired(mysock_timer_heap_t   *heap,
+                                      const struct timespec *now);
+
+/* what the caller of _mysock_sched_run() should do with the connection */
+enum
+{
+    MYSOCK_SCHED_PARK,      /* nothing to do until an event or its timer */
+    MYSOCK_SCHED_YIELD,     /* used up its batch; queue it at the back */
+    MYSOCK_SCHED_DONE       /* transport layer has finished */
+};
+
+int _mysock_sched_run(mysock_context_t *ctx, bool_t coroutines, int batch);
+
+/* mysock_coro.c */
+bool_t _mysock_coro_enabled(void);
+
+void _mysock_coro_create(mysock_context_t *ctx);
+
+bool_t _mysock_coro_resume(mysock_context_t *ctx, unsigned int event);
+
+bool_t _mysock_coro_running(mysock_context_t *ctx);
+
+unsigned int _mysock_coro_wait(mysock_context_t      *ctx,
+                               unsigned int           flags,
+                               const struct timespec *abstime);
+
+void _mysock_coro_block(mysock_context_t *ctx, unsigned int flags);
+
+/* mysock_pcap.c */
+void _mysock_pcap_capture(mysock_context_t *ctx, bool_t outgoing,
+                          const void *packet, size_t len);
+
+void _mysock_pcap_capturev(mysock_context_t *ctx, bool_t outgoing,
+                           const struct iovec *iov, int iovcnt);
+
+/* mysock_shard.c */
+bool_t _mysock_shard_enabled(void);
+
+void _mysock_shard_assign(mysock_context_t *ctx);
+
+int _mysock_shard_epoll_fd(mysock_context_t *ctx);
+
+void _mysock_shard_sync(mysock_context_t *ctx);
+
+void _mysock_shard_start(mysock_context_t *ctx);
+
+void _mysock_shard_wake(mysock_context_t *ctx);
+
+int _mysock_shard_get_stats(mysock_worker_stats_t *stats, int max_shards);
+
 #endif  /* __MYSOCK_INTERNAL_H__ */
 
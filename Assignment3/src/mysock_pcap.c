@@ -0,0 +1,317 @@
+/* mysock_pcap.c--capture STCP segments to a pcap file */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "network_io.h"
+
+
+/* if MYSOCK_PCAP names a file, every segment passing through
+ * stcp_network_send() and stcp_network_recv() (and their _buf variants) is
+ * written to it in pcap format, behind a synthesized IPv4 header, so that
+ * the connection can be followed in Wireshark or tcpdump whichever network
+ * layer carries it--the TCP network layer's framing never shows up.
+ *
+ * the transport layer mustn't be held up by this, so the segment is only
+ * copied into a ring of slots, and a thread of its own writes the file.
+ * the ring is a bounded multi-producer queue:  a producer claims a slot by
+ * advancing pcap_tail, fills it, and publishes it by storing the slot's
+ * sequence number, so producers never block one another, or wait on the
+ * writer.  if the writer falls behind and the ring is full, the segment is
+ * dropped from the capture (and counted), rather than held up.  the writer
+ * sleeps once it has caught up; producers only take its lock to wake it.
+ */
+#define PCAP_RING_SIZE  1024    /* slots; a power of two */
+#define PCAP_SNAPLEN    (sizeof(struct ip) + MAX_IP_PAYLOAD_LEN)
+
+/* pcap file header, with nanosecond timestamps */
+#define PCAP_MAGIC          0xa1b23c4d
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+#define LINKTYPE_RAW        101     /* the packet begins with its IP header */
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_file_header_t;
+
+typedef struct
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header_t;
+
+typedef struct
+{
+    unsigned long   seq;    /* position it's next free for, + 1 once full */
+    struct timespec stamp;
+    size_t          len;    /* of the packet, as seen on the wire */
+    char            packet[PCAP_SNAPLEN];
+} pcap_slot_t;
+
+static pthread_once_t   pcap_once = PTHREAD_ONCE_INIT;
+static FILE            *pcap_file;
+static pcap_slot_t     *pcap_ring;
+
+/* producers' and writer's positions in the ring.  pcap_head belongs to
+ * whoever holds pcap_write_lock.
+ */
+static unsigned long    pcap_tail __attribute__ ((aligned(64)));
+static unsigned long    pcap_head __attribute__ ((aligned(64)));
+static unsigned long    pcap_dropped;
+static uint16_t         pcap_ip_id;
+
+static pthread_mutex_t  pcap_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  pcap_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pcap_cond = PTHREAD_COND_INITIALIZER;
+static bool_t           pcap_writer_waiting;
+
+static void _mysock_pcap_init(void);
+static void _mysock_pcap_exit(void);
+static void *_mysock_pcap_writer(void *arg_ptr);
+static bool_t _mysock_pcap_ready(void);
+static void _mysock_pcap_drain(void);
+static uint16_t _mysock_pcap_ip_sum(const struct ip *header);
+
+
+static void _mysock_pcap_init(void)
+{
+    const char *path = getenv("MYSOCK_PCAP");
+    pcap_file_header_t header;
+    unsigned long k;
+
+    if (!path || !*path)
+        return;
+
+    if (!(pcap_file = fopen(path, "wb")))
+    {
+        perror(path);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic         = PCAP_MAGIC;
+    header.version_major = PCAP_VERSION_MAJOR;
+    header.version_minor = PCAP_VERSION_MINOR;
+    header.snaplen       = PCAP_SNAPLEN;
+    header.linktype      = LINKTYPE_RAW;
+    if (fwrite(&header, sizeof(header), 1, pcap_file) != 1)
+    {
+        perror(path);
+        fclose(pcap_file);
+        pcap_file = NULL;
+        return;
+    }
+
+    pcap_ring = (pcap_slot_t *) calloc(PCAP_RING_SIZE, sizeof(*pcap_ring));
+    assert(pcap_ring);
+    for (k = 0; k < PCAP_RING_SIZE; ++k)
+        pcap_ring[k].seq = k;
+
+    (void) atexit(_mysock_pcap_exit);
+    (void) _mysock_create_thread(_mysock_pcap_writer, NULL, TRUE);
+}
+
+/* write out whatever the writer hasn't got to yet */
+static void _mysock_pcap_exit(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&pcap_write_lock));
+    _mysock_pcap_drain();
+    PTHREAD_CALL(pthread_mutex_unlock(&pcap_write_lock));
+
+    if (pcap_dropped > 0)
+    {
+        fprintf(stderr, "pcap: %lu segments not captured (ring full)\n",
+                pcap_dropped);
+    }
+}
+
+/* capture the segment the given mysocket is sending (or has received) */
+void _mysock_pcap_capture(mysock_context_t *ctx, bool_t outgoing,
+                          const void *packet, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = len;
+    _mysock_pcap_capturev(ctx, outgoing, &iov, 1);
+}
+
+/* as above, for a segment gathered from an iovec */
+void _mysock_pcap_capturev(mysock_context_t *ctx, bool_t outgoing,
+                           const struct iovec *iov, int iovcnt)
+{
+    pcap_slot_t *slot;
+    struct ip *header;
+    unsigned long pos;
+    uint32_t local_addr, peer_addr;
+    size_t len = 0, copied;
+    int k;
+
+    assert(ctx && iov);
+
+    PTHREAD_CALL(pthread_once(&pcap_once, _mysock_pcap_init));
+    if (!pcap_file)
+        return;
+
+    /* claim a slot */
+    pos = __atomic_load_n(&pcap_tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        long diff;
+
+        slot = &pcap_ring[pos & (PCAP_RING_SIZE - 1)];
+        diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&pcap_tail, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            /* the writer hasn't emptied this slot since the last lap */
+            __atomic_add_fetch(&pcap_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&pcap_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->stamp);
+
+    copied = sizeof(struct ip);
+    for (k = 0; k < iovcnt; ++k)
+    {
+        size_t n = MIN(iov[k].iov_len, PCAP_SNAPLEN - copied);
+
+        memcpy(slot->packet + copied, iov[k].iov_base, n);
+        copied += n;
+        len    += iov[k].iov_len;
+    }
+    slot->len = sizeof(struct ip) + len;
+
+    local_addr = _network_get_local_addr(&ctx->network_state);
+    peer_addr  = ((struct sockaddr_in *) &ctx->network_state.peer_addr)->
+                     sin_addr.s_addr;
+
+    header = (struct ip *) slot->packet;
+    memset(header, 0, sizeof(*header));
+    header->ip_v   = 4;
+    header->ip_hl  = sizeof(*header) >> 2;
+    header->ip_len = htons(MIN(slot->len, 0xffff));
+    header->ip_id  = htons(__atomic_add_fetch(&pcap_ip_id, 1,
+                                              __ATOMIC_RELAXED));
+    header->ip_off = htons(IP_DF);
+    header->ip_ttl = 64;
+    header->ip_p   = IPPROTO_TCP;
+    header->ip_src.s_addr = outgoing ? local_addr : peer_addr;
+    header->ip_dst.s_addr = outgoing ? peer_addr : local_addr;
+    header->ip_sum = _mysock_pcap_ip_sum(header);
+
+    /* publish it, and wake the writer if it's asleep.  (the store and the
+     * load are both sequentially consistent, so either the writer sees the
+     * slot before it sleeps, or we see it waiting.)
+     */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pcap_writer_waiting, __ATOMIC_SEQ_CST))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pcap_wait_lock));
+        PTHREAD_CALL(pthread_cond_signal(&pcap_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&pcap_wait_lock));
+    }
+}
+
+/* write segments out as they're captured, flushing the file whenever it
+ * catches up
+ */
+static void *_mysock_pcap_writer(void *arg_ptr)
+{
+    for (;;)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pcap_write_lock));
+        _mysock_pcap_drain();
+        PTHREAD_CALL(pthread_mutex_unlock(&pcap_write_lock));
+
+        PTHREAD_CALL(pthread_mutex_lock(&pcap_wait_lock));
+        __atomic_store_n(&pcap_writer_waiting, TRUE, __ATOMIC_SEQ_CST);
+        if (!_mysock_pcap_ready())
+            PTHREAD_CALL(pthread_cond_wait(&pcap_cond, &pcap_wait_lock));
+        __atomic_store_n(&pcap_writer_waiting, FALSE, __ATOMIC_RELAXED);
+        PTHREAD_CALL(pthread_mutex_unlock(&pcap_wait_lock));
+    }
+    return NULL;
+}
+
+/* TRUE if the next slot has been published */
+static bool_t _mysock_pcap_ready(void)
+{
+    unsigned long pos = __atomic_load_n(&pcap_head, __ATOMIC_RELAXED);
+    pcap_slot_t *slot = &pcap_ring[pos & (PCAP_RING_SIZE - 1)];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+/* write every published slot to the file.  the caller holds
+ * pcap_write_lock.
+ */
+static void _mysock_pcap_drain(void)
+{
+    while (_mysock_pcap_ready())
+    {
+        pcap_slot_t *slot = &pcap_ring[pcap_head & (PCAP_RING_SIZE - 1)];
+        pcap_record_header_t record;
+
+        record.ts_sec   = (uint32_t) slot->stamp.tv_sec;
+        record.ts_nsec  = (uint32_t) slot->stamp.tv_nsec;
+        record.incl_len = (uint32_t) MIN(slot->len, PCAP_SNAPLEN);
+        record.orig_len = (uint32_t) slot->len;
+
+        if (fwrite(&record, sizeof(record), 1, pcap_file) != 1 ||
+            fwrite(slot->packet, record.incl_len, 1, pcap_file) != 1)
+        {
+            __atomic_add_fetch(&pcap_dropped, 1, __ATOMIC_RELAXED);
+        }
+
+        /* hand the slot back to the producers for their next lap */
+        __atomic_store_n(&slot->seq, pcap_head + PCAP_RING_SIZE,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&pcap_head, pcap_head + 1, __ATOMIC_RELAXED);
+    }
+    (void) fflush(pcap_file);
+}
+
+/* the IPv4 header checksum (RFC 791) */
+static uint16_t _mysock_pcap_ip_sum(const struct ip *header)
+{
+    const uint16_t *word = (const uint16_t *) header;
+    uint32_t sum = 0;
+    unsigned int k;
+
+    for (k = 0; k < sizeof(*header) / sizeof(uint16_t); ++k)
+        sum += word[k];
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return (uint16_t) ~sum;
+}
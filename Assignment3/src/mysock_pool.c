@@ -0,0 +1,667 @@
+/* mysock_pool.c--run STCP connections on a fixed pool of worker threads */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "stcp_api.h"
+#include "transport.h"
+
+
+/* by default each connection's transport layer gets its own thread, which
+ * blocks in stcp_wait_for_event().  if MYSOCK_TRANSPORT_WORKERS is set,
+ * connections are instead run by that many worker threads (or one per
+ * online CPU, if it's zero), using the event-driven transport interface
+ * (transport_open()/transport_dispatch()).  a connection is queued when
+ * one of the events it asked for with stcp_set_wait() comes up, or its
+ * timeout expires; a worker then calls transport_dispatch() until the
+ * connection has nothing more to do, and parks it again.
+ *
+ * each worker has its own run queue, a Chase-Lev work-stealing deque:
+ * the worker pushes and pops at the bottom, and idle workers steal from
+ * the top.  connections woken from outside the pool (by the network
+ * reactor, or the app), those whose timer expires, and those that have
+ * used up their batch go on a shared injection queue instead, which
+ * workers check when their own queue is empty, and every
+ * POOL_INJECT_INTERVAL runs regardless.
+ *
+ * each connection is in exactly one of the following states.  moving a
+ * connection onto a queue takes a compare-and-swap on its state, and only
+ * the worker that then takes it off a queue runs it, so the transport
+ * layer is single-threaded per connection.
+ */
+enum
+{
+    POOL_IDLE,          /* parked, waiting for an event or its timer */
+    POOL_QUEUED,        /* on a run queue */
+    POOL_RUNNING,       /* being run by a worker */
+    POOL_NOTIFIED,      /* running, and woken again meanwhile */
+    POOL_DONE           /* transport layer has finished */
+};
+
+/* most transport_dispatch() calls per turn on a worker, before the
+ * connection goes to the back of the injection queue
+ */
+#define POOL_BATCH 16
+
+/* a worker with a busy queue of its own still checks the injection queue
+ * (and expired timers) this often
+ */
+#define POOL_INJECT_INTERVAL 31
+
+#define POOL_DEQUE_INITIAL_SIZE 64
+
+
+/* deque storage.  when a deque grows, thieves may still be reading the
+ * old array, so it's kept (chained through prev) for the life of the
+ * deque.
+ */
+typedef struct pool_array
+{
+    long                size;       /* power of two */
+    struct pool_array  *prev;
+    mysock_context_t   *slot[1];
+} pool_array_t;
+
+typedef struct
+{
+    long          top __attribute__ ((aligned(64)));    /* thieves */
+    long          bottom __attribute__ ((aligned(64))); /* owner */
+    pool_array_t *array;
+} pool_deque_t;
+
+typedef struct
+{
+    pool_deque_t          deque;
+    unsigned int          seed;     /* for choosing steal victims */
+    mysock_worker_stats_t stats;    /* stolen is updated by thieves */
+} pool_worker_t;
+
+static int              pool_workers;       /* -1 if no pool */
+static pool_worker_t   *workers;
+static __thread pool_worker_t *self;        /* NULL off the pool */
+static int              idle_workers;       /* asleep on pool_cond */
+static pthread_once_t   pool_config_once = PTHREAD_ONCE_INIT;
+static pthread_once_t   pool_start_once = PTHREAD_ONCE_INIT;
+
+/* pool_lock protects the injection queue, the timer heap, and sleeping */
+static pthread_mutex_t  pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* injection queue */
+static mysock_context_t *run_head, *run_tail;
+
+/* parked connections with a timeout, by deadline (see mysock_sched.c) */
+static mysock_timer_heap_t timer_heap;
+
+
+static void _mysock_pool_config(void);
+static void _mysock_pool_init(void);
+static void *_mysock_pool_worker(void *arg_ptr);
+static mysock_context_t *_mysock_pool_next(pool_worker_t *w,
+                                           bool_t inject_first);
+static mysock_context_t *_mysock_pool_take_shared(pool_worker_t *w);
+static mysock_context_t *_mysock_pool_steal(pool_worker_t *w);
+static bool_t _mysock_pool_any_queued(void);
+static void _mysock_pool_sleep(void);
+static void _mysock_pool_run(mysock_context_t *ctx);
+static void _mysock_pool_park(mysock_context_t *ctx);
+static void _mysock_pool_queue(mysock_context_t *ctx);
+static void _mysock_pool_inject(mysock_context_t *ctx);
+static void _mysock_pool_done(mysock_context_t *ctx);
+static void _deque_init(pool_deque_t *d);
+static void _deque_push(pool_deque_t *d, mysock_context_t *ctx);
+static mysock_context_t *_deque_take(pool_deque_t *d);
+static mysock_context_t *_deque_steal(pool_deque_t *d);
+static long _deque_len(pool_deque_t *d);
+static void _timer_expire(void);
+
+
+static void _mysock_pool_config(void)
+{
+    const char *env = getenv("MYSOCK_TRANSPORT_WORKERS");
+    long n;
+
+    pool_workers = -1;
+
+    /* coroutines would move between workers; see mysock_coro.c */
+    if (_mysock_coro_enabled())
+    {
+        fprintf(stderr, "MYSOCK_TRANSPORT_COROUTINES is ignored without "
+                        "MYSOCK_SHARDS\n");
+    }
+    if (!env || !*env)
+        return;
+
+    if (!env || (n = strtol(env, NULL, 10)) <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_workers = (int) MIN(MAX(n, 1L), 1024L);
+}
+
+/* TRUE if connections should be run by the worker pool */
+bool_t _mysock_pool_enabled(void)
+{
+    PTHREAD_CALL(pthread_once(&pool_config_once, _mysock_pool_config));
+    return pool_workers > 0;
+}
+
+static void _mysock_pool_init(void)
+{
+    int k;
+
+    assert(pool_workers > 0);
+    workers = (pool_worker_t *) calloc(pool_workers, sizeof(*workers));
+    assert(workers);
+
+    for (k = 0; k < pool_workers; ++k)
+    {
+        _deque_init(&workers[k].deque);
+        workers[k].seed = k + 1;
+    }
+    for (k = 0; k < pool_workers; ++k)
+        (void) _mysock_create_thread(_mysock_pool_worker, &workers[k], TRUE);
+}
+
+/* hand a new connection to the pool.  transport_open() is called by
+ * whichever worker picks it up first.
+ */
+void _mysock_pool_start(mysock_context_t *ctx)
+{
+    assert(ctx && !ctx->pooled);
+    PTHREAD_CALL(pthread_once(&pool_start_once, _mysock_pool_init));
+
+    ctx->pooled           = TRUE;
+    ctx->wait_timer.index = -1;
+    ctx->wait_timer.owner = ctx;
+    ctx->sched_state      = POOL_QUEUED;
+    _mysock_pool_queue(ctx);
+}
+
+/* called (via _mysock_wake_transport()) when an event arrives for a parked
+ * connection, i.e. one with event_waiting set.
+ */
+void _mysock_pool_wake(mysock_context_t *ctx)
+{
+    int state;
+
+    assert(ctx && ctx->pooled);
+
+    state = __atomic_load_n(&ctx->sched_state, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        if (state == POOL_IDLE)
+        {
+            if (!__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                             POOL_QUEUED, FALSE,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                continue;
+
+            /* we own it now.  an expiring timer may have beaten us to the
+             * heap entry, but not to the state.
+             */
+            if (ctx->wait_timed)
+            {
+                PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+                if (ctx->wait_timer.index >= 0)
+                    _mysock_timer_remove(&timer_heap, &ctx->wait_timer);
+                PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+            }
+            _mysock_pool_queue(ctx);
+            return;
+        }
+
+        if (state == POOL_RUNNING)
+        {
+            /* the worker running it re-queues it when it's parked */
+            if (__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                            POOL_NOTIFIED, FALSE,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return;
+            continue;
+        }
+
+        return; /* already queued or notified, or finished */
+    }
+}
+
+/* queue a connection we've just moved to POOL_QUEUED:  on a worker, onto
+ * its own deque; elsewhere, onto the injection queue.
+ */
+static void _mysock_pool_queue(mysock_context_t *ctx)
+{
+    pool_worker_t *w = self;
+    long len;
+
+    if (!w)
+    {
+        _mysock_pool_inject(ctx);
+        return;
+    }
+
+    _deque_push(&w->deque, ctx);
+    if ((len = _deque_len(&w->deque)) > (long) w->stats.max_queue_len)
+        w->stats.max_queue_len = (unsigned int) len;
+
+    /* pairs with the fence in _mysock_pool_sleep():  either a sleeping
+     * worker sees the new entry, or we see that it's asleep
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_workers, __ATOMIC_RELAXED) > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+        PTHREAD_CALL(pthread_cond_signal(&pool_cond));
+        PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+    }
+}
+
+/* append to the injection queue */
+static void _mysock_pool_inject(mysock_context_t *ctx)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    ctx->sched_next = NULL;
+    if (run_tail)
+        run_tail->sched_next = ctx;
+    else
+        __atomic_store_n(&run_head, ctx, __ATOMIC_RELAXED);
+    run_tail = ctx;
+    PTHREAD_CALL(pthread_cond_signal(&pool_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+}
+
+static void *_mysock_pool_worker(void *arg_ptr)
+{
+    pool_worker_t *w = (pool_worker_t *) arg_ptr;
+    unsigned long  ticks = 0;
+
+    assert(w);
+    self = w;
+
+    for (;;)
+    {
+        mysock_context_t *ctx =
+            _mysock_pool_next(w, (++ticks % POOL_INJECT_INTERVAL) == 0);
+
+        if (!ctx)
+        {
+            _mysock_pool_sleep();
+            continue;
+        }
+
+        assert(ctx->sched_state == POOL_QUEUED);
+        __atomic_store_n(&ctx->sched_state, POOL_RUNNING, __ATOMIC_RELEASE);
+        ++w->stats.runs;
+        _mysock_pool_run(ctx);
+    }
+
+    return NULL;
+}
+
+/* find the next connection to run:  from our own deque, then the
+ * injection queue (with any expired timers), then another worker's deque
+ */
+static mysock_context_t *_mysock_pool_next(pool_worker_t *w,
+                                           bool_t inject_first)
+{
+    mysock_context_t *ctx;
+
+    if (inject_first && (ctx = _mysock_pool_take_shared(w)) != NULL)
+        return ctx;
+    if ((ctx = _deque_take(&w->deque)) != NULL)
+        return ctx;
+    if ((ctx = _mysock_pool_take_shared(w)) != NULL)
+        return ctx;
+    return _mysock_pool_steal(w);
+}
+
+static mysock_context_t *_mysock_pool_take_shared(pool_worker_t *w)
+{
+    mysock_context_t *ctx;
+
+    if (!__atomic_load_n(&run_head, __ATOMIC_RELAXED) &&
+        !__atomic_load_n(&timer_heap.count, __ATOMIC_RELAXED))
+        return NULL;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    _timer_expire();
+    if ((ctx = run_head) != NULL)
+    {
+        __atomic_store_n(&run_head, ctx->sched_next, __ATOMIC_RELAXED);
+        if (!run_head)
+            run_tail = NULL;
+        ++w->stats.injected;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+
+    return ctx;
+}
+
+/* try each other worker's deque once, starting at a random one */
+static mysock_context_t *_mysock_pool_steal(pool_worker_t *w)
+{
+    int start, k;
+
+    if (pool_workers < 2)
+        return NULL;
+
+    start = (int) (rand_r(&w->seed) % pool_workers);
+    for (k = 0; k < pool_workers; ++k)
+    {
+        pool_worker_t    *victim = &workers[(start + k) % pool_workers];
+        mysock_context_t *ctx;
+
+        if (victim == w)
+            continue;
+        if ((ctx = _deque_steal(&victim->deque)) != NULL)
+        {
+            ++w->stats.steals;
+            (void) __atomic_add_fetch(&victim->stats.stolen, 1,
+                                      __ATOMIC_RELAXED);
+            return ctx;
+        }
+    }
+
+    return NULL;
+}
+
+static bool_t _mysock_pool_any_queued(void)
+{
+    int k;
+
+    if (run_head)
+        return TRUE;
+    for (k = 0; k < pool_workers; ++k)
+    {
+        if (_deque_len(&workers[k].deque) > 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* nothing to run anywhere; wait for work, or for the next timer */
+static void _mysock_pool_sleep(void)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+    _timer_expire();
+
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!_mysock_pool_any_queued())
+    {
+        if (timer_heap.count > 0)
+        {
+            int rc = pthread_cond_timedwait(&pool_cond, &pool_lock,
+                                            &timer_heap.entry[0]->deadline);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+        }
+        else
+        {
+            PTHREAD_CALL(pthread_cond_wait(&pool_cond, &pool_lock));
+        }
+    }
+    __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+}
+
+/* run the transport layer for a connection we've taken off the run queue
+ * (see _mysock_sched_run()), then park it, send it to the back of the
+ * injection queue, or finish it off.
+ */
+static void _mysock_pool_run(mysock_context_t *ctx)
+{
+    /* the transport layer reports a failed connection through errno (see
+     * _mysock_transport_finished()), so don't let it see what the last
+     * connection run on this worker left there
+     */
+    errno = 0;
+
+    switch (_mysock_sched_run(ctx, FALSE, POOL_BATCH))
+    {
+    case MYSOCK_SCHED_PARK:
+        _mysock_pool_park(ctx);
+        break;
+
+    case MYSOCK_SCHED_YIELD:
+        /* give the others a turn.  nobody else can queue it while it's
+         * running, and a wakeup meanwhile makes no difference now.
+         */
+        __atomic_store_n(&ctx->sched_state, POOL_QUEUED, __ATOMIC_RELEASE);
+        _mysock_pool_inject(ctx);
+        break;
+
+    default:
+        _mysock_pool_done(ctx);
+        break;
+    }
+}
+
+/* a running connection has nothing more to do for now.  a timed park
+ * holds pool_lock from the state change until the connection is in the
+ * timer heap, so a concurrent _mysock_pool_wake() finds it there.
+ */
+static void _mysock_pool_park(mysock_context_t *ctx)
+{
+    int state = POOL_RUNNING;
+
+    if (ctx->wait_timed)
+        PTHREAD_CALL(pthread_mutex_lock(&pool_lock));
+
+    if (__atomic_compare_exchange_n(&ctx->sched_state, &state, POOL_IDLE,
+                                    FALSE, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+    {
+        if (ctx->wait_timed)
+        {
+            /* a worker may be sleeping until a later deadline */
+            if (_mysock_timer_insert(&timer_heap, &ctx->wait_timer))
+                PTHREAD_CALL(pthread_cond_signal(&pool_cond));
+            PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+        }
+        return;
+    }
+
+    if (ctx->wait_timed)
+        PTHREAD_CALL(pthread_mutex_unlock(&pool_lock));
+
+    /* woken while it was running */
+    assert(state == POOL_NOTIFIED);
+    __atomic_store_n(&ctx->sched_state, POOL_QUEUED, __ATOMIC_RELEASE);
+    _mysock_pool_queue(ctx);
+}
+
+/* the transport layer has finished with a connection.  myclose() may free
+ * the context as soon as transport_done is set.
+ */
+static void _mysock_pool_done(mysock_context_t *ctx)
+{
+    _mysock_transport_finished(ctx);
+    __atomic_store_n(&ctx->sched_state, POOL_DONE, __ATOMIC_RELEASE);
+    _mysock_transport_done(ctx);
+}
+
+
+/* fill in scheduling stats for up to max_workers workers; see mysock.h */
+int mysock_get_worker_stats(mysock_worker_stats_t *stats, int max_workers)
+{
+    int k, n;
+
+    if (_mysock_shard_enabled())
+        return _mysock_shard_get_stats(stats, max_workers);
+    if (!_mysock_pool_enabled())
+        return 0;
+    PTHREAD_CALL(pthread_once(&pool_start_once, _mysock_pool_init));
+
+    n = MIN(pool_workers, MAX(max_workers, 0));
+    for (k = 0; k < n; ++k)
+    {
+        pool_worker_t *w = &workers[k];
+
+        assert(stats);
+        stats[k].runs          = __atomic_load_n(&w->stats.runs,
+                                                 __ATOMIC_RELAXED);
+        stats[k].steals        = __atomic_load_n(&w->stats.steals,
+                                                 __ATOMIC_RELAXED);
+        stats[k].stolen        = __atomic_load_n(&w->stats.stolen,
+                                                 __ATOMIC_RELAXED);
+        stats[k].injected      = __atomic_load_n(&w->stats.injected,
+                                                 __ATOMIC_RELAXED);
+        stats[k].queue_len     = (unsigned int) MAX(_deque_len(&w->deque),
+                                                    0L);
+        stats[k].max_queue_len = __atomic_load_n(&w->stats.max_queue_len,
+                                                 __ATOMIC_RELAXED);
+    }
+
+    return pool_workers;
+}
+
+
+/* Chase-Lev deque, with the memory orderings of Le et al., "Correct and
+ * efficient work-stealing for weak memory models" (PPoPP '13).  only the
+ * owning worker calls _deque_push() and _deque_take().
+ */
+static void _deque_init(pool_deque_t *d)
+{
+    pool_array_t *a = (pool_array_t *)
+        calloc(1, sizeof(pool_array_t) +
+                  (POOL_DEQUE_INITIAL_SIZE - 1) * sizeof(mysock_context_t *));
+
+    assert(a);
+    a->size   = POOL_DEQUE_INITIAL_SIZE;
+    d->top    = d->bottom = 0;
+    d->array  = a;
+}
+
+static void _deque_push(pool_deque_t *d, mysock_context_t *ctx)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    pool_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (b - t > a->size - 1)
+    {
+        /* full; double it */
+        pool_array_t *bigger = (pool_array_t *)
+            malloc(sizeof(pool_array_t) +
+                   (2 * a->size - 1) * sizeof(mysock_context_t *));
+        long k;
+
+        assert(bigger);
+        bigger->size = 2 * a->size;
+        bigger->prev = a;
+        for (k = t; k < b; ++k)
+        {
+            bigger->slot[k & (bigger->size - 1)] =
+                __atomic_load_n(&a->slot[k & (a->size - 1)],
+                                __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+
+    __atomic_store_n(&a->slot[b & (a->size - 1)], ctx, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static mysock_context_t *_deque_take(pool_deque_t *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    pool_array_t *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    mysock_context_t *ctx = NULL;
+    long t;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t <= b)
+    {
+        ctx = __atomic_load_n(&a->slot[b & (a->size - 1)], __ATOMIC_RELAXED);
+        if (t == b)
+        {
+            /* last one; race any thieves for it */
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, FALSE,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED))
+                ctx = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return ctx;
+}
+
+/* returns NULL if the deque is empty, or another thief (or the owner) won
+ * the race for the top entry
+ */
+static mysock_context_t *_deque_steal(pool_deque_t *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long b;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (t < b)
+    {
+        pool_array_t *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+        mysock_context_t *ctx =
+            __atomic_load_n(&a->slot[t & (a->size - 1)], __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&d->top, &t, t + 1, FALSE,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return ctx;
+    }
+
+    return NULL;
+}
+
+static long _deque_len(pool_deque_t *d)
+{
+    return __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) -
+           __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+}
+
+
+/* queue any connections whose timeout has expired; the caller holds
+ * pool_lock
+ */
+static void _timer_expire(void)
+{
+    struct timespec now;
+    mysock_timer_t *timer;
+
+    if (!timer_heap.count)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    while ((timer = _mysock_timer_expired(&timer_heap, &now)) != NULL)
+    {
+        mysock_context_t *ctx = (mysock_context_t *) timer->owner;
+        int state = POOL_IDLE;
+
+        /* unless an event got there first */
+        if (__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                        POOL_QUEUED, FALSE,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            ctx->sched_next = NULL;
+            if (run_tail)
+                run_tail->sched_next = ctx;
+            else
+                __atomic_store_n(&run_head, ctx, __ATOMIC_RELAXED);
+            run_tail = ctx;
+        }
+    }
+}
@@ -0,0 +1,218 @@
+/* mysock_sched.c--scheduling pieces shared by the worker pool and shards */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "stcp_api.h"
+#include "transport.h"
+
+
+/* the worker pool (mysock_pool.c) and the shards (mysock_shard.c) differ
+ * in how they queue connections, and what they lock, but run a connection
+ * the same way once they've taken it off a queue, and park those with a
+ * timeout in a deadline heap of their own.  both of those live here.  the
+ * network impairment simulator's link (network.c) uses the heap as well.
+ *
+ * the heap functions do no locking; whoever owns the heap does that.
+ */
+
+
+static bool_t _mysock_timer_before(const mysock_timer_t *a,
+                                   const mysock_timer_t *b);
+static void _mysock_timer_place(mysock_timer_heap_t *heap, int k,
+                                mysock_timer_t *timer);
+static void _mysock_timer_sift(mysock_timer_heap_t *heap, int k);
+
+
+bool_t _mysock_timespec_before(const struct timespec *a,
+                               const struct timespec *b)
+{
+    return (a->tv_sec < b->tv_sec ||
+            (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+/* add an entry, with its deadline already set.  returns TRUE if it's now
+ * the first due, so anyone sleeping until the old first deadline can be
+ * woken.
+ */
+bool_t _mysock_timer_insert(mysock_timer_heap_t *heap, mysock_timer_t *timer)
+{
+    assert(heap && timer && timer->index < 0);
+
+    if (heap->count == heap->size)
+    {
+        heap->size  = heap->size ? 2 * heap->size : 64;
+        heap->entry = (mysock_timer_t **)
+            realloc(heap->entry, heap->size * sizeof(*heap->entry));
+        assert(heap->entry);
+    }
+
+    timer->seq = heap->seq++;
+    _mysock_timer_place(heap, heap->count++, timer);
+    _mysock_timer_sift(heap, timer->index);
+    return timer->index == 0;
+}
+
+void _mysock_timer_remove(mysock_timer_heap_t *heap, mysock_timer_t *timer)
+{
+    int k = timer->index;
+
+    assert(k >= 0 && k < heap->count && heap->entry[k] == timer);
+
+    if (k < --heap->count)
+    {
+        _mysock_timer_place(heap, k, heap->entry[heap->count]);
+        _mysock_timer_sift(heap, k);
+    }
+    timer->index = -1;
+}
+
+/* take the first entry off the heap if it's due by now, or return NULL */
+mysock_timer_t *_mysock_timer_expired(mysock_timer_heap_t   *heap,
+                                      const struct timespec *now)
+{
+    mysock_timer_t *timer;
+
+    if (!heap->count ||
+        _mysock_timespec_before(now, &heap->entry[0]->deadline))
+        return NULL;
+
+    timer = heap->entry[0];
+    _mysock_timer_remove(heap, timer);
+    return timer;
+}
+
+static bool_t _mysock_timer_before(const mysock_timer_t *a,
+                                   const mysock_timer_t *b)
+{
+    if (a->deadline.tv_sec != b->deadline.tv_sec ||
+        a->deadline.tv_nsec != b->deadline.tv_nsec)
+        return _mysock_timespec_before(&a->deadline, &b->deadline);
+    return (long) (a->seq - b->seq) < 0;
+}
+
+static void _mysock_timer_place(mysock_timer_heap_t *heap, int k,
+                                mysock_timer_t *timer)
+{
+    heap->entry[k] = timer;
+    timer->index = k;
+}
+
+/* move the entry at position k up or down to where it belongs */
+static void _mysock_timer_sift(mysock_timer_heap_t *heap, int k)
+{
+    mysock_timer_t **entry = heap->entry;
+    mysock_timer_t *timer = entry[k];
+
+    while (k > 0 && _mysock_timer_before(timer, entry[(k - 1) / 2]))
+    {
+        _mysock_timer_place(heap, k, entry[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+
+    for (;;)
+    {
+        int child = 2 * k + 1;
+
+        if (child >= heap->count)
+            break;
+        if (child + 1 < heap->count &&
+            _mysock_timer_before(entry[child + 1], entry[child]))
+        {
+            ++child;
+        }
+        if (!_mysock_timer_before(entry[child], timer))
+            break;
+        _mysock_timer_place(heap, k, entry[child]);
+        k = child;
+    }
+
+    _mysock_timer_place(heap, k, timer);
+}
+
+
+/* run the transport layer for a connection the caller has taken off its
+ * run queue, until it has no events left, its batch is used up, or it's
+ * finished, and say which (MYSOCK_SCHED_*).  with coroutines, a new
+ * connection runs transport_init() itself, as a coroutine (see
+ * mysock_coro.c); otherwise it's opened with transport_open(), and
+ * driven with transport_dispatch().
+ */
+int _mysock_sched_run(mysock_context_t *ctx, bool_t coroutines, int batch)
+{
+    int budget;
+
+    assert(ctx);
+    __atomic_store_n(&ctx->event_waiting, FALSE, __ATOMIC_RELAXED);
+
+    if (!ctx->transport_opened)
+    {
+        bool_t finished;
+
+        ctx->transport_opened = TRUE;
+        if (coroutines)
+        {
+            /* runs transport_init() up to its first wait */
+            _mysock_coro_create(ctx);
+            finished = _mysock_coro_resume(ctx, 0);
+        }
+        else
+        {
+            finished = transport_open(ctx->my_sd, ctx->is_active);
+        }
+
+        if (finished)
+            return MYSOCK_SCHED_DONE;
+    }
+
+    for (budget = batch; budget > 0; --budget)
+    {
+        unsigned int event;
+
+        /* on a shard, input already read that didn't fit in the ring
+         * last time (see _mysock_shard_input())
+         */
+        if (ctx->shard && _network_input_pending(&ctx->network_state) &&
+            !_mysock_ring_full(&ctx->network_recv_queue))
+            _network_handle_input(ctx);
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        event = _mysock_take_events(ctx, ctx->wait_flags);
+        if (!event)
+        {
+            struct timespec now;
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (!ctx->wait_timed ||
+                _mysock_timespec_before(&now, &ctx->wait_timer.deadline))
+            {
+                /* nothing to do.  as in stcp_wait_for_event(), announce
+                 * that we're waiting before the final look at the queues,
+                 * so anything arriving from here on goes through
+                 * _mysock_wake_transport().
+                 */
+                __atomic_store_n(&ctx->event_waiting, TRUE,
+                                 __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (!(event = _mysock_take_events(ctx, ctx->wait_flags)))
+                {
+                    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+                    return MYSOCK_SCHED_PARK;
+                }
+                __atomic_store_n(&ctx->event_waiting, FALSE,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        if (ctx->coro ? _mysock_coro_resume(ctx, event) :
+                        transport_dispatch(ctx->my_sd, event))
+            return MYSOCK_SCHED_DONE;
+    }
+
+    return MYSOCK_SCHED_YIELD;
+}
@@ -0,0 +1,649 @@
+/* mysock_shard.c--run each STCP connection entirely on one CPU-pinned
+ * shard thread
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "stcp_api.h"
+#include "transport.h"
+
+
+/* if MYSOCK_SHARDS is set, the mysocket layer runs shared-nothing:  there
+ * are that many shard threads (or one per CPU we're allowed to run on, if
+ * it's zero), each pinned to its own CPU.  every connection is assigned to
+ * a shard by hashing its address 4-tuple, and that shard does all of the
+ * connection's work--it waits on the connection's socket with its own
+ * epoll set, reads its network input, runs its transport layer (with
+ * transport_open()/transport_dispatch(), or as a coroutine if
+ * MYSOCK_TRANSPORT_COROUTINES is also set), and keeps its timer.  so the
+ * connection's state stays in that CPU's cache, and nothing is handed
+ * between threads except at the application boundary:  mywrite() and
+ * myclose() post the connection to its shard's mailbox, and kick the
+ * shard's eventfd if the mailbox was empty.  the worker pool isn't used,
+ * and the network reactor is left with only the listening sockets.
+ *
+ * the scheduling states follow the worker pool's (mysock_pool.c), except
+ * that only the shard itself ever moves a connection onto its run list, or
+ * touches its timer heap; other threads go through the mailbox.
+ */
+enum
+{
+    SHARD_UNUSED,       /* not started yet */
+    SHARD_IDLE,         /* parked, waiting for an event or its timer */
+    SHARD_QUEUED,       /* on the run list, or in the mailbox */
+    SHARD_RUNNING,      /* being run by its shard */
+    SHARD_NOTIFIED,     /* running, and woken again meanwhile */
+    SHARD_DONE          /* transport layer has finished */
+};
+
+/* most transport_dispatch() calls per turn, before the connection goes to
+ * the back of the run list
+ */
+#define SHARD_BATCH 16
+
+/* most epoll events handled per epoll_wait() */
+#define SHARD_MAX_EVENTS 64
+
+struct mysock_shard
+{
+    int                     index;
+    int                     cpu;        /* pinned to this CPU, or -1 */
+    int                     epfd;       /* sockets, and wakefd (NULL ptr) */
+    int                     wakefd;
+
+    /* run list; only the shard touches this */
+    mysock_context_t       *run_head, *run_tail;
+    unsigned int            run_len;
+
+    /* parked connections with a timeout, by deadline (see
+     * mysock_sched.c); only the shard touches this either
+     */
+    mysock_timer_heap_t     timer_heap;
+
+    /* lock protects the mailbox, and cycle, which counts the rounds of
+     * epoll events the shard has finished dispatching (signaled on
+     * cycle_cond).
+     */
+    pthread_mutex_t         lock;
+    pthread_cond_t          cycle_cond;
+    mysock_context_t       *mail_head, *mail_tail;
+    unsigned long           cycle;
+
+    mysock_worker_stats_t   stats;  /* injected counts mailbox deliveries */
+};
+
+static int              shard_count;        /* -1 if not sharded */
+static bool_t           shard_coroutines;   /* see mysock_coro.c */
+static int             *shard_cpus;         /* CPUs we may run on */
+static int              shard_ncpus;
+static mysock_shard_t  *shards;
+static __thread mysock_shard_t *self;       /* NULL off the shards */
+static pthread_once_t   shard_config_once = PTHREAD_ONCE_INIT;
+static pthread_once_t   shard_start_once = PTHREAD_ONCE_INIT;
+
+
+static void _mysock_shard_config(void);
+static void _mysock_shard_init(void);
+static void *_mysock_shard_thread(void *arg_ptr);
+static void _mysock_shard_pin(mysock_shard_t *shard);
+static int _mysock_shard_timeout(mysock_shard_t *shard);
+static void _mysock_shard_collect_mail(mysock_shard_t *shard);
+static void _mysock_shard_input(mysock_shard_t *shard,
+                                mysock_context_t *ctx);
+static void _mysock_shard_run(mysock_shard_t *shard, mysock_context_t *ctx);
+static void _mysock_shard_park(mysock_shard_t *shard, mysock_context_t *ctx);
+static void _mysock_shard_done(mysock_context_t *ctx);
+static void _mysock_shard_append(mysock_shard_t *shard,
+                                 mysock_context_t *ctx);
+static void _mysock_shard_post(mysock_shard_t *shard,
+                               mysock_context_t *ctx);
+static void _mysock_shard_kick(mysock_shard_t *shard);
+static uint32_t _mysock_shard_mix(uint32_t h);
+static void _timer_expire(mysock_shard_t *shard);
+
+
+static void _mysock_shard_config(void)
+{
+    const char *env = getenv("MYSOCK_SHARDS");
+    cpu_set_t allowed;
+    long n;
+    int k;
+
+    shard_count = -1;
+    if (!env || !*env)
+        return;
+
+    /* shards are pinned, round robin, to the CPUs we're allowed on */
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        perror("sched_getaffinity");
+        CPU_ZERO(&allowed);
+    }
+    shard_cpus = (int *) calloc(CPU_SETSIZE, sizeof(*shard_cpus));
+    assert(shard_cpus);
+    for (k = 0; k < CPU_SETSIZE; ++k)
+    {
+        if (CPU_ISSET(k, &allowed))
+            shard_cpus[shard_ncpus++] = k;
+    }
+
+    if ((n = strtol(env, NULL, 10)) <= 0)
+        n = shard_ncpus ? shard_ncpus : sysconf(_SC_NPROCESSORS_ONLN);
+    shard_count = (int) MIN(MAX(n, 1L), 1024L);
+    shard_coroutines = _mysock_coro_enabled();
+}
+
+/* TRUE if mysockets should be run by shards */
+bool_t _mysock_shard_enabled(void)
+{
+    PTHREAD_CALL(pthread_once(&shard_config_once, _mysock_shard_config));
+    return shard_count > 0;
+}
+
+static void _mysock_shard_init(void)
+{
+    int k;
+
+    assert(shard_count > 0);
+    shards = (mysock_shard_t *) calloc(shard_count, sizeof(*shards));
+    assert(shards);
+
+    for (k = 0; k < shard_count; ++k)
+    {
+        mysock_shard_t *shard = &shards[k];
+        struct epoll_event ev;
+
+        shard->index = k;
+        shard->cpu   = shard_ncpus ? shard_cpus[k % shard_ncpus] : -1;
+        PTHREAD_CALL(pthread_mutex_init(&shard->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&shard->cycle_cond, NULL));
+
+        if ((shard->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (shard->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+            perror("mysock shard");
+            assert(0);
+            abort();
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->wakefd, &ev) < 0)
+        {
+            perror("epoll_ctl(wakefd)");
+            assert(0);
+            abort();
+        }
+    }
+
+    for (k = 0; k < shard_count; ++k)
+        (void) _mysock_create_thread(_mysock_shard_thread, &shards[k], TRUE);
+}
+
+/* choose the shard for a connection from its local and peer addresses and
+ * ports, before its network input starts.  listening sockets stay with the
+ * network reactor:  the TCP network layer reads a new connection's SYN
+ * with a blocking read, which mustn't hold up the shard that may have to
+ * send it.
+ */
+void _mysock_shard_assign(mysock_context_t *ctx)
+{
+    const struct sockaddr_in *local, *peer;
+    uint32_t h;
+
+    assert(ctx && !ctx->shard && !ctx->listening);
+    assert(_mysock_shard_enabled());
+    PTHREAD_CALL(pthread_once(&shard_start_once, _mysock_shard_init));
+
+    assert(ctx->network_state.peer_addr_len > 0);
+    local = (const struct sockaddr_in *) &ctx->network_state.local_addr;
+    peer  = (const struct sockaddr_in *) &ctx->network_state.peer_addr;
+
+    h = _mysock_shard_mix(((uint32_t) ntohs(
+                               _network_get_port(&ctx->network_state)) << 16) |
+                          ntohs(peer->sin_port));
+    h = _mysock_shard_mix(h ^ ntohl(peer->sin_addr.s_addr));
+    if (local->sin_family == AF_INET)
+        h = _mysock_shard_mix(h ^ ntohl(local->sin_addr.s_addr));
+
+    ctx->shard = &shards[h % (uint32_t) shard_count];
+}
+
+/* the epoll set the network layer should register the mysocket's socket
+ * with; readiness is reported with data.ptr pointing at the context.
+ */
+int _mysock_shard_epoll_fd(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->shard);
+    return ctx->shard->epfd;
+}
+
+/* return once the mysocket's shard has finished the round of epoll events
+ * it's handling (if any), so an event collected for a socket just removed
+ * from its epoll set has been dealt with.  this must not be called on the
+ * shard itself.
+ */
+void _mysock_shard_sync(mysock_context_t *ctx)
+{
+    mysock_shard_t *shard;
+    unsigned long target;
+
+    assert(ctx && (shard = ctx->shard) != NULL && shard != self);
+
+    PTHREAD_CALL(pthread_mutex_lock(&shard->lock));
+    target = shard->cycle + 1;
+    while ((long) (shard->cycle - target) < 0)
+    {
+        _mysock_shard_kick(shard);
+        PTHREAD_CALL(pthread_cond_wait(&shard->cycle_cond, &shard->lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&shard->lock));
+}
+
+/* hand a new connection's transport layer to its shard */
+void _mysock_shard_start(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->shard);
+    assert(ctx->sched_state == SHARD_UNUSED);
+
+    ctx->wait_timer.index = -1;
+    ctx->wait_timer.owner = ctx;
+    __atomic_store_n(&ctx->sched_state, SHARD_QUEUED, __ATOMIC_RELEASE);
+    if (ctx->shard == self)
+        _mysock_shard_append(self, ctx);
+    else
+        _mysock_shard_post(ctx->shard, ctx);
+}
+
+/* called (via _mysock_wake_transport()) when an event arrives for a parked
+ * connection.  on the connection's own shard (i.e. for network input), it
+ * just goes on the run list; from anywhere else, through the mailbox.
+ */
+void _mysock_shard_wake(mysock_context_t *ctx)
+{
+    int state;
+
+    assert(ctx && ctx->shard);
+
+    state = __atomic_load_n(&ctx->sched_state, __ATOMIC_ACQUIRE);
+    for (;;)
+    {
+        if (state == SHARD_IDLE)
+        {
+            if (!__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                             SHARD_QUEUED, FALSE,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                continue;
+
+            if (ctx->shard == self)
+            {
+                if (ctx->wait_timer.index >= 0)
+                    _mysock_timer_remove(&self->timer_heap,
+                                         &ctx->wait_timer);
+                _mysock_shard_append(self, ctx);
+            }
+            else
+            {
+                /* the shard drops any timer when it collects the mail */
+                _mysock_shard_post(ctx->shard, ctx);
+            }
+            return;
+        }
+
+        if (state == SHARD_RUNNING)
+        {
+            if (__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                            SHARD_NOTIFIED, FALSE,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return;
+            continue;
+        }
+
+        return; /* queued, notified, finished, or not started */
+    }
+}
+
+/* add a queued connection to the tail of our own run list */
+static void _mysock_shard_append(mysock_shard_t *shard,
+                                 mysock_context_t *ctx)
+{
+    assert(shard == self);
+
+    ctx->sched_next = NULL;
+    if (shard->run_tail)
+        shard->run_tail->sched_next = ctx;
+    else
+        shard->run_head = ctx;
+    shard->run_tail = ctx;
+
+    if (++shard->run_len > shard->stats.max_queue_len)
+        shard->stats.max_queue_len = shard->run_len;
+}
+
+/* post a queued connection to another thread's shard */
+static void _mysock_shard_post(mysock_shard_t *shard, mysock_context_t *ctx)
+{
+    bool_t was_empty;
+
+    PTHREAD_CALL(pthread_mutex_lock(&shard->lock));
+    ctx->sched_next = NULL;
+    was_empty = (shard->mail_head == NULL);
+    if (shard->mail_tail)
+        shard->mail_tail->sched_next = ctx;
+    else
+        shard->mail_head = ctx;
+    shard->mail_tail = ctx;
+    PTHREAD_CALL(pthread_mutex_unlock(&shard->lock));
+
+    /* the shard takes the whole mailbox after reading the eventfd, so one
+     * kick covers everything posted until then
+     */
+    if (was_empty)
+        _mysock_shard_kick(shard);
+}
+
+static void _mysock_shard_kick(mysock_shard_t *shard)
+{
+    uint64_t one = 1;
+
+    if (write(shard->wakefd, &one, sizeof(one)) < 0)
+        assert(errno == EAGAIN);
+}
+
+static void *_mysock_shard_thread(void *arg_ptr)
+{
+    mysock_shard_t *shard = (mysock_shard_t *) arg_ptr;
+    struct epoll_event events[SHARD_MAX_EVENTS];
+
+    assert(shard);
+    self = shard;
+    _mysock_shard_pin(shard);
+
+    DEBUG_LOG(("started shard %d on CPU %d\n", shard->index, shard->cpu));
+
+    for (;;)
+    {
+        unsigned int k, n_run;
+        int n;
+
+        if ((n = epoll_wait(shard->epfd, events, SHARD_MAX_EVENTS,
+                            _mysock_shard_timeout(shard))) < 0)
+        {
+            assert(errno == EINTR);
+            n = 0;
+        }
+
+        for (k = 0; k < (unsigned int) n; ++k)
+        {
+            if (!events[k].data.ptr)
+            {
+                uint64_t count;
+
+                (void) read(shard->wakefd, &count, sizeof(count));
+                _mysock_shard_collect_mail(shard);
+                continue;
+            }
+
+            _mysock_shard_input(shard,
+                                (mysock_context_t *) events[k].data.ptr);
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&shard->lock));
+        ++shard->cycle;
+        PTHREAD_CALL(pthread_mutex_unlock(&shard->lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&shard->cycle_cond));
+
+        _timer_expire(shard);
+
+        /* run what's queued now; anything queued from here on waits until
+         * after the next (non-blocking) look at the sockets
+         */
+        for (n_run = shard->run_len; n_run > 0; --n_run)
+        {
+            mysock_context_t *ctx = shard->run_head;
+
+            assert(ctx);
+            if (!(shard->run_head = ctx->sched_next))
+                shard->run_tail = NULL;
+            --shard->run_len;
+
+            assert(ctx->sched_state == SHARD_QUEUED);
+            __atomic_store_n(&ctx->sched_state, SHARD_RUNNING,
+                             __ATOMIC_RELEASE);
+            ++shard->stats.runs;
+            _mysock_shard_run(shard, ctx);
+        }
+    }
+
+    return NULL;
+}
+
+/* pin the calling shard thread to its CPU.  a failure here only costs us
+ * locality, so we carry on regardless.
+ */
+static void _mysock_shard_pin(mysock_shard_t *shard)
+{
+    cpu_set_t cpus;
+    int rc;
+
+    if (shard->cpu < 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                     &cpus)) != 0)
+    {
+        fprintf(stderr, "shard %d: can't pin to CPU %d: %s\n",
+                shard->index, shard->cpu, strerror(rc));
+        shard->cpu = -1;
+    }
+}
+
+/* how long epoll_wait() may block:  not at all if there's something to
+ * run, otherwise until the earliest timer (rounded up to the next
+ * millisecond), or indefinitely
+ */
+static int _mysock_shard_timeout(mysock_shard_t *shard)
+{
+    struct timespec now;
+    const struct timespec *deadline;
+    long ms;
+
+    if (shard->run_head)
+        return 0;
+    if (!shard->timer_heap.count)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    deadline = &shard->timer_heap.entry[0]->deadline;
+    if (!_mysock_timespec_before(&now, deadline))
+        return 0;
+
+    ms = (deadline->tv_sec - now.tv_sec) * 1000L +
+         (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+    return (int) MIN(MAX(ms, 1L), 60L * 1000L);
+}
+
+/* move everything in the mailbox onto the run list */
+static void _mysock_shard_collect_mail(mysock_shard_t *shard)
+{
+    mysock_context_t *ctx;
+
+    PTHREAD_CALL(pthread_mutex_lock(&shard->lock));
+    ctx = shard->mail_head;
+    shard->mail_head = shard->mail_tail = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&shard->lock));
+
+    while (ctx)
+    {
+        mysock_context_t *next = ctx->sched_next;
+
+        assert(ctx->sched_state == SHARD_QUEUED);
+        if (ctx->wait_timer.index >= 0)
+            _mysock_timer_remove(&shard->timer_heap, &ctx->wait_timer);
+        ++shard->stats.injected;
+        _mysock_shard_append(shard, ctx);
+        ctx = next;
+    }
+}
+
+/* a mysocket's socket is readable.  we can't block in
+ * _mysock_ring_push(), since the transport layer that would make room runs
+ * on this same thread, so once the ring is full _network_handle_input()
+ * leaves the rest until the connection has had its turn (see
+ * _mysock_sched_run()); epoll keeps reporting the socket meanwhile.
+ */
+static void _mysock_shard_input(mysock_shard_t *shard, mysock_context_t *ctx)
+{
+    assert(ctx && ctx->shard == shard);
+    _network_handle_input(ctx);
+}
+
+/* run the transport layer for a connection we've taken off the run list
+ * (see _mysock_sched_run()), then park it, send it to the back of the run
+ * list, or finish it off.
+ */
+static void _mysock_shard_run(mysock_shard_t *shard, mysock_context_t *ctx)
+{
+    /* as in _mysock_pool_run(), errno starts out clear for each run */
+    errno = 0;
+
+    switch (_mysock_sched_run(ctx, shard_coroutines, SHARD_BATCH))
+    {
+    case MYSOCK_SCHED_PARK:
+        _mysock_shard_park(shard, ctx);
+        break;
+
+    case MYSOCK_SCHED_YIELD:
+        /* give the others a turn */
+        __atomic_store_n(&ctx->sched_state, SHARD_QUEUED, __ATOMIC_RELEASE);
+        _mysock_shard_append(shard, ctx);
+        break;
+
+    default:
+        _mysock_shard_done(ctx);
+        break;
+    }
+}
+
+/* a running connection has nothing more to do for now.  its timer goes in
+ * the heap before anyone else can queue it, so whoever does finds it
+ * there; since only this thread touches the heap, no lock is needed.
+ */
+static void _mysock_shard_park(mysock_shard_t *shard, mysock_context_t *ctx)
+{
+    int state = SHARD_RUNNING;
+
+    if (ctx->wait_timed)
+        (void) _mysock_timer_insert(&shard->timer_heap, &ctx->wait_timer);
+
+    if (__atomic_compare_exchange_n(&ctx->sched_state, &state, SHARD_IDLE,
+                                    FALSE, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+        return;
+
+    /* woken while it was running */
+    assert(state == SHARD_NOTIFIED);
+    if (ctx->wait_timer.index >= 0)
+        _mysock_timer_remove(&shard->timer_heap, &ctx->wait_timer);
+    __atomic_store_n(&ctx->sched_state, SHARD_QUEUED, __ATOMIC_RELEASE);
+    _mysock_shard_append(shard, ctx);
+}
+
+/* the transport layer has finished with a connection.  myclose() may free
+ * the context as soon as transport_done is set.
+ */
+static void _mysock_shard_done(mysock_context_t *ctx)
+{
+    assert(ctx->wait_timer.index < 0);
+
+    _mysock_transport_finished(ctx);
+    __atomic_store_n(&ctx->sched_state, SHARD_DONE, __ATOMIC_RELEASE);
+    _mysock_transport_done(ctx);
+}
+
+
+/* fill in stats for up to max_shards shards; see
+ * mysock_get_worker_stats()
+ */
+int _mysock_shard_get_stats(mysock_worker_stats_t *stats, int max_shards)
+{
+    int k, n;
+
+    assert(_mysock_shard_enabled());
+    PTHREAD_CALL(pthread_once(&shard_start_once, _mysock_shard_init));
+
+    n = MIN(shard_count, MAX(max_shards, 0));
+    for (k = 0; k < n; ++k)
+    {
+        mysock_shard_t *shard = &shards[k];
+
+        assert(stats);
+        memset(&stats[k], 0, sizeof(stats[k]));
+        stats[k].runs          = __atomic_load_n(&shard->stats.runs,
+                                                 __ATOMIC_RELAXED);
+        stats[k].injected      = __atomic_load_n(&shard->stats.injected,
+                                                 __ATOMIC_RELAXED);
+        stats[k].queue_len     = __atomic_load_n(&shard->run_len,
+                                                 __ATOMIC_RELAXED);
+        stats[k].max_queue_len = __atomic_load_n(&shard->stats.max_queue_len,
+                                                 __ATOMIC_RELAXED);
+    }
+
+    return shard_count;
+}
+
+
+/* murmur3's 32-bit finaliser */
+static uint32_t _mysock_shard_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/* queue any connections whose timeout has expired; only called on the
+ * shard's own thread
+ */
+static void _timer_expire(mysock_shard_t *shard)
+{
+    struct timespec now;
+    mysock_timer_t *timer;
+
+    if (!shard->timer_heap.count)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    while ((timer = _mysock_timer_expired(&shard->timer_heap, &now)) != NULL)
+    {
+        mysock_context_t *ctx = (mysock_context_t *) timer->owner;
+        int state = SHARD_IDLE;
+
+        /* unless it's sitting in the mailbox already */
+        if (__atomic_compare_exchange_n(&ctx->sched_state, &state,
+                                        SHARD_QUEUED, FALSE,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            _mysock_shard_append(shard, ctx);
+    }
+}
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -16,6 +17,85 @@
 #include "transport.h"  /* for dprintf() */
 
 
+/* network impairment simulation.
+ *
+ * with MYSOCK_IMPAIR set, every segment the transport layer sends passes
+ * through a simulated link on its way to the network layer, which can lose,
+ * duplicate, reorder, delay, and rate limit it.  the variable holds
+ * comma-separated options, e.g. MYSOCK_IMPAIR=loss=0.01,delay=40,jitter=5:
+ *
+ *   loss=P             lose each segment with probability P
+ *   ge_p=P, ge_r=R     Gilbert-Elliott burst loss:  the link goes bad with
+ *                      probability P per segment, and good again with
+ *                      probability R
+ *   ge_bad=P, ge_good=P    loss probability while bad (default 1) and
+ *                      while good (default 0)
+ *   dup=P              send a segment twice with probability P
+ *   reorder=P          send a segment out of order with probability P
+ *   reorder_depth=N    ...behind the next N segments (default 1).  on a
+ *                      delayed or rate limited link, such a segment goes
+ *                      ahead of the last N still waiting on it instead.
+ *   delay=MS           delay each segment by MS milliseconds
+ *   jitter=MS          ...give or take up to MS (segments may then overtake
+ *                      each other)
+ *   rate=BYTES         limit the link to BYTES bytes per second
+ *   queue=N            drop segments once N are waiting on the link
+ *                      (default 1000)
+ *   seed=N             seed for the connections' random number generators
+ *
+ * each connection draws from its own generator, seeded from the seed and
+ * its mysocket descriptor, so a run can be repeated exactly.  delayed (or
+ * rate limited) segments are sent by a thread of their own, which is then
+ * the only one to send on such a connection; whatever it still holds when
+ * the connection goes away is sent first (see _network_send_drain()).
+ */
+typedef struct
+{
+    bool_t   enabled;
+    bool_t   scheduled;     /* segments go through impair_thread_func() */
+    double   loss;
+    double   ge_p, ge_r, ge_bad, ge_good;
+    double   dup;
+    double   reorder;
+    int      reorder_depth;
+    long     delay_us, jitter_us;
+    double   rate;          /* bytes per second, or 0 */
+    int      queue;
+    unsigned seed;
+} impair_config_t;
+
+/* a segment waiting on the simulated link, until timer.deadline */
+typedef struct
+{
+    mysock_timer_t    timer;
+    mysock_context_t *ctx;
+    mysock_buf_t     *buf;
+} impair_packet_t;
+
+static impair_config_t impair;
+static pthread_once_t  impair_once = PTHREAD_ONCE_INIT;
+
+/* impair_lock protects the heap of segments by due time (see
+ * mysock_sched.c) and every context's link_queued.  impair_cond wakes the
+ * link thread; impair_sent_cond is signaled once it has sent a segment.
+ */
+static pthread_mutex_t   impair_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    impair_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t    impair_sent_cond = PTHREAD_COND_INITIALIZER;
+static mysock_timer_heap_t impair_heap;
+
+static void _impair_init(void);
+static int _impair_send(mysock_context_t *sock_ctx,
+                        const void *packet, size_t len);
+static int _impair_transmit(mysock_context_t *sock_ctx,
+                            const void *packet, size_t len, bool_t early);
+static void _impair_overtake(mysock_context_t *sock_ctx,
+                             struct timespec *deadline);
+static int _impair_deadline_cmp(const void *a, const void *b);
+static bool_t _impair_lose(network_context_t *ctx);
+static double _impair_random(network_context_t *ctx);
+static void *impair_thread_func(void *arg_ptr);
+
 
 
 /* helper function for stcp_network_send(); */
@@ -27,19 +107,449 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
     assert(sock_ctx && buf);
     ctx = &sock_ctx->network_state;
 
+    PTHREAD_CALL(pthread_once(&impair_once, _impair_init));
+    if (impair.enabled)
+        return _impair_send(sock_ctx, buf, len);
+
     return _network_send_packet(ctx, buf, len);
 }
 
+/* helper function for stcp_network_send_buf() */
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+    network_context_t *ctx;
+
+    assert(sock_ctx && iov);
+    ctx = &sock_ctx->network_state;
+
+    PTHREAD_CALL(pthread_once(&impair_once, _impair_init));
+    if (impair.enabled)
+    {
+        char packet[MAX_IP_PAYLOAD_LEN];
+        size_t len = 0;
+        int k;
+
+        for (k = 0; k < iovcnt; ++k)
+        {
+            assert(len + iov[k].iov_len <= sizeof(packet));
+            memcpy(packet + len, iov[k].iov_base, iov[k].iov_len);
+            len += iov[k].iov_len;
+        }
+        return _impair_send(sock_ctx, packet, len);
+    }
+
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+/* helper function for stcp_network_cork().  a link thread sends on the
+ * connection's behalf, so corking would only get in its way.
+ */
+void _network_send_cork(mysocket_t sd)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+
+    assert(sock_ctx);
+
+    PTHREAD_CALL(pthread_once(&impair_once, _impair_init));
+    if (!impair.scheduled)
+        _network_cork(&sock_ctx->network_state);
+}
+
+/* helper function for stcp_network_uncork(), and for whenever the
+ * transport layer is about to wait.  this also lets out a segment held
+ * back for reordering, so that it can't be held up indefinitely.
+ */
+int _network_send_flush(mysocket_t sd)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+    network_context_t *ctx;
+    int rc = 0;
+
+    assert(sock_ctx);
+    ctx = &sock_ctx->network_state;
+
+    if (ctx->copied)
+    {
+        ctx->copied = FALSE;
+        rc = _network_send_packet(ctx, ctx->copy_buffer, ctx->copy_buf_len);
+    }
+
+    if (_network_flush(ctx) < 0)
+        rc = -1;
+    return rc;
+}
+
+/* wait until the simulated link has sent everything it holds for the
+ * given mysocket
+ */
+void _network_send_drain(mysock_context_t *sock_ctx)
+{
+    assert(sock_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&impair_lock));
+    while (sock_ctx->network_state.link_queued > 0)
+        PTHREAD_CALL(pthread_cond_wait(&impair_sent_cond, &impair_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&impair_lock));
+}
+
 /* helper function for stcp_network_recv() */
 int _network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     int len;
+    mysock_buf_t *packet = _network_recv_buf(sd);
+
+    assert(dst);
+    len = packet->data_len;
+    memcpy(dst, packet->data, MIN(max_len, packet->data_len));
+    _mysock_buf_release(packet);
+
+    return len;
+}
+
+/* helper function for stcp_network_recv_buf() */
+mysock_buf_t *_network_recv_buf(mysocket_t sd)
+{
     mysock_context_t *ctx = _mysock_get_context(sd);
 
-    assert(ctx && dst);
-    len = _mysock_dequeue_buffer(ctx, &ctx->network_recv_queue,
-                                 dst, max_len, FALSE);
+    assert(ctx);
+    return _mysock_ring_pop(ctx, &ctx->network_recv_queue);
+}
+
+
+
+/* read the MYSOCK_IMPAIR options, and start the link thread if need be */
+static void _impair_init(void)
+{
+    const char *env = getenv("MYSOCK_IMPAIR");
+    char *options, *option, *save;
+
+    impair.ge_bad        = 1.0;
+    impair.reorder_depth = 1;
+    impair.queue         = 1000;
+
+    if (!env || !*env)
+        return;
+
+    options = strdup(env);
+    assert(options);
+    for (option = strtok_r(options, ",", &save); option;
+         option = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(option, '=');
+        double v;
+
+        if (!value)
+        {
+            fprintf(stderr, "MYSOCK_IMPAIR: ignoring '%s'\n", option);
+            continue;
+        }
+        *value++ = '\0';
+        v = atof(value);
+
+        if (!strcmp(option, "loss"))
+            impair.loss = v;
+        else if (!strcmp(option, "ge_p"))
+            impair.ge_p = v;
+        else if (!strcmp(option, "ge_r"))
+            impair.ge_r = v;
+        else if (!strcmp(option, "ge_bad"))
+            impair.ge_bad = v;
+        else if (!strcmp(option, "ge_good"))
+            impair.ge_good = v;
+        else if (!strcmp(option, "dup"))
+            impair.dup = v;
+        else if (!strcmp(option, "reorder"))
+            impair.reorder = v;
+        else if (!strcmp(option, "reorder_depth"))
+            impair.reorder_depth = (int) v;
+        else if (!strcmp(option, "delay"))
+            impair.delay_us = (long) (v * 1000);
+        else if (!strcmp(option, "jitter"))
+            impair.jitter_us = (long) (v * 1000);
+        else if (!strcmp(option, "rate"))
+            impair.rate = v;
+        else if (!strcmp(option, "queue"))
+            impair.queue = (int) v;
+        else if (!strcmp(option, "seed"))
+            impair.seed = (unsigned) strtoul(value, NULL, 0);
+        else
+            fprintf(stderr, "MYSOCK_IMPAIR: unknown option '%s'\n", option);
+    }
+    free(options);
 
+    if (impair.reorder_depth < 1)
+        impair.reorder_depth = 1;
+    if (impair.jitter_us > impair.delay_us)
+        impair.jitter_us = impair.delay_us;
+
+    impair.enabled   = TRUE;
+    impair.scheduled = (impair.delay_us > 0 || impair.rate > 0);
+    if (impair.scheduled)
+        (void) _mysock_create_thread(impair_thread_func, NULL, TRUE);
+}
+
+/* put a segment from the transport layer on the simulated link.  lost
+ * segments are reported as sent, as they would be by a real network.
+ */
+static int _impair_send(mysock_context_t *sock_ctx,
+                        const void *packet, size_t len)
+{
+    network_context_t *ctx = &sock_ctx->network_state;
+    int copies;
+    bool_t early;
+
+    if (!ctx->random_seeded)
+    {
+        ctx->random_seed   = impair.seed ^
+                             ((unsigned) sock_ctx->my_sd * 2654435761U);
+        ctx->random_seeded = TRUE;
+    }
+
+    if (_impair_lose(ctx))
+        return len;
+
+    copies = (_impair_random(ctx) < impair.dup) ? 2 : 1;
+    early  = (_impair_random(ctx) < impair.reorder);
+
+    while (copies-- > 0)
+    {
+        if (_impair_transmit(sock_ctx, packet, len, early) < 0)
+            return -1;
+        early = FALSE;
+    }
     return len;
 }
 
+/* send a segment, or queue it for the link thread.  an early segment is
+ * sent out of order:  without a delay or rate, it is held back in the
+ * context's copy buffer until reorder_depth others have gone; with either,
+ * it goes ahead of up to reorder_depth of those still waiting on the link.
+ */
+static int _impair_transmit(mysock_context_t *sock_ctx,
+                            const void *packet, size_t len, bool_t early)
+{
+    network_context_t *ctx = &sock_ctx->network_state;
+    impair_packet_t *entry;
+    struct timespec now, start;
+    long delay_us;
+
+    if (!impair.scheduled)
+    {
+        if (early && !ctx->copied)
+        {
+            memcpy(ctx->copy_buffer, packet, len);
+            ctx->copy_buf_len   = len;
+            ctx->copy_countdown = impair.reorder_depth;
+            ctx->copied         = TRUE;
+            return 0;
+        }
+
+        if (_network_send_packet(ctx, packet, len) < 0)
+            return -1;
+
+        if (ctx->copied && --ctx->copy_countdown <= 0)
+        {
+            ctx->copied = FALSE;
+            return _network_send_packet(ctx, ctx->copy_buffer,
+                                        ctx->copy_buf_len);
+        }
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    PTHREAD_CALL(pthread_mutex_lock(&impair_lock));
+    if (ctx->link_queued >= impair.queue)
+    {
+        /* tail drop */
+        PTHREAD_CALL(pthread_mutex_unlock(&impair_lock));
+        return 0;
+    }
+
+    /* the segment goes onto the link once it's idle, and takes its length
+     * over the rate to get off it; then it's delayed.
+     */
+    start = now;
+    if (impair.rate > 0)
+    {
+        long long idle_ns, tx_ns;
+
+        if (_mysock_timespec_before(&now, &ctx->link_idle))
+            start = ctx->link_idle;
+
+        tx_ns   = (long long) (len * 1e9 / impair.rate);
+        idle_ns = start.tv_nsec + tx_ns;
+        ctx->link_idle.tv_sec  = start.tv_sec + idle_ns / 1000000000;
+        ctx->link_idle.tv_nsec = idle_ns % 1000000000;
+        start = ctx->link_idle;
+    }
+
+    delay_us = impair.delay_us;
+    if (impair.jitter_us > 0)
+        delay_us += (long) ((2 * _impair_random(ctx) - 1) * impair.jitter_us);
+
+    entry = (impair_packet_t *) malloc(sizeof(*entry));
+    assert(entry);
+    entry->timer.deadline.tv_sec  = start.tv_sec + delay_us / 1000000;
+    entry->timer.deadline.tv_nsec = start.tv_nsec +
+                                    (delay_us % 1000000) * 1000;
+    if (entry->timer.deadline.tv_nsec >= 1000000000)
+    {
+        entry->timer.deadline.tv_sec  += 1;
+        entry->timer.deadline.tv_nsec -= 1000000000;
+    }
+    if (early)
+        _impair_overtake(sock_ctx, &entry->timer.deadline);
+    entry->timer.index = -1;
+    entry->timer.owner = entry;
+    entry->ctx = sock_ctx;
+    entry->buf = _mysock_buf_copy(packet, len);
+
+    ++ctx->link_queued;
+    /* wake the link thread if it's now the first due */
+    if (_mysock_timer_insert(&impair_heap, &entry->timer))
+        PTHREAD_CALL(pthread_cond_signal(&impair_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&impair_lock));
+    return 0;
+}
+
+/* bring an early segment's deadline forward, so that it's sent just ahead
+ * of the reorder_depth-th latest of the given mysocket's segments already
+ * waiting on the link (or of the first, if fewer are).  called with
+ * impair_lock held.
+ */
+static void _impair_overtake(mysock_context_t *sock_ctx,
+                             struct timespec *deadline)
+{
+    struct timespec *queued;
+    int k, n = 0;
+
+    if (sock_ctx->network_state.link_queued <= 0)
+        return;     /* nothing to overtake */
+
+    queued = (struct timespec *)
+        malloc(sock_ctx->network_state.link_queued * sizeof(*queued));
+    assert(queued);
+
+    for (k = 0; k < impair_heap.count; ++k)
+    {
+        impair_packet_t *packet = (impair_packet_t *)
+            impair_heap.entry[k]->owner;
+
+        if (packet->ctx == sock_ctx)
+            queued[n++] = impair_heap.entry[k]->deadline;
+    }
+    /* the link thread may have one off the heap, still being sent */
+    assert(n <= sock_ctx->network_state.link_queued);
+    if (n == 0)
+    {
+        free(queued);
+        return;
+    }
+
+    /* latest first */
+    qsort(queued, n, sizeof(*queued), _impair_deadline_cmp);
+    k = MIN(impair.reorder_depth, n) - 1;
+
+    /* segments due together go in the order they were queued, so it has
+     * to be due a moment before
+     */
+    if (queued[k].tv_nsec > 0)
+    {
+        --queued[k].tv_nsec;
+    }
+    else
+    {
+        --queued[k].tv_sec;
+        queued[k].tv_nsec = 999999999;
+    }
+
+    if (_mysock_timespec_before(&queued[k], deadline))
+        *deadline = queued[k];
+    free(queued);
+}
+
+/* qsort() comparison, ordering deadlines from latest to earliest */
+static int _impair_deadline_cmp(const void *a, const void *b)
+{
+    const struct timespec *ta = (const struct timespec *) a;
+    const struct timespec *tb = (const struct timespec *) b;
+
+    if (_mysock_timespec_before(tb, ta))
+        return -1;
+    return _mysock_timespec_before(ta, tb) ? 1 : 0;
+}
+
+/* decide whether the next segment is lost, stepping the Gilbert-Elliott
+ * model along
+ */
+static bool_t _impair_lose(network_context_t *ctx)
+{
+    bool_t lost = (impair.loss > 0 && _impair_random(ctx) < impair.loss);
+
+    if (impair.ge_p > 0)
+    {
+        if (ctx->loss_burst)
+            ctx->loss_burst = !(_impair_random(ctx) < impair.ge_r);
+        else
+            ctx->loss_burst = (_impair_random(ctx) < impair.ge_p);
+
+        if (_impair_random(ctx) <
+            (ctx->loss_burst ? impair.ge_bad : impair.ge_good))
+            lost = TRUE;
+    }
+    return lost;
+}
+
+/* uniformly distributed in [0, 1), from the connection's own generator */
+static double _impair_random(network_context_t *ctx)
+{
+    return rand_r(&ctx->random_seed) / (RAND_MAX + 1.0);
+}
+
+/* send each segment on the simulated link once it's due */
+static void *impair_thread_func(void *arg_ptr)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&impair_lock));
+    for (;;)
+    {
+        impair_packet_t *packet;
+        mysock_timer_t *timer;
+        mysock_context_t *sock_ctx;
+        struct timespec now;
+        int rc;
+
+        if (!impair_heap.count)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&impair_cond, &impair_lock));
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (!(timer = _mysock_timer_expired(&impair_heap, &now)))
+        {
+            rc = pthread_cond_timedwait(&impair_cond, &impair_lock,
+                                        &impair_heap.entry[0]->deadline);
+            assert(rc == 0 || rc == ETIMEDOUT);
+            continue;
+        }
+
+        packet   = (impair_packet_t *) timer->owner;
+        sock_ctx = packet->ctx;
+        PTHREAD_CALL(pthread_mutex_unlock(&impair_lock));
+
+        /* a failure is a lost segment, just as it would be uncorked */
+        (void) _network_send_packet(&sock_ctx->network_state,
+                                    packet->buf->data, packet->buf->data_len);
+        _mysock_buf_release(packet->buf);
+        free(packet);
+
+        PTHREAD_CALL(pthread_mutex_lock(&impair_lock));
+        --sock_ctx->network_state.link_queued;
+        PTHREAD_CALL(pthread_cond_broadcast(&impair_sent_cond));
+    }
+
+    PTHREAD_CALL(pthread_mutex_unlock(&impair_lock));
+    return NULL;
+}
@@ -5,10 +5,18 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
+struct mysock_context;
+
 int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+void _network_send_cork(mysocket_t sd);
+int _network_send_flush(mysocket_t sd);
+void _network_send_drain(struct mysock_context *ctx);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
+struct mysock_buf *_network_recv_buf(mysocket_t sd);
 
 #endif  /* __NETWORK_H__ */
 
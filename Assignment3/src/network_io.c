@@ -6,6 +6,24 @@
 #include "network_io.h"
 
 
+/* set the peer address of the given mysocket, when it connects (or its
+ * SYN arrives).  the local address is looked up now, once, rather than on
+ * every segment it's needed for (the checksum, and packet capture), since
+ * that means a trip to the resolver.
+ */
+void _network_set_peer_addr(network_context_t *ctx,
+                            const struct sockaddr *addr, socklen_t addr_len)
+{
+    assert(ctx && addr);
+    assert(addr->sa_family == AF_INET);
+
+    ctx->peer_addr       = *addr;
+    ctx->peer_addr_len   = addr_len;
+    ctx->local_ip        = _network_get_interface_ip(
+        ((const struct sockaddr_in *) addr)->sin_addr.s_addr);
+    ctx->peer_addr_valid = TRUE;
+}
+
 /* return local IP address associated with the given mysocket.
  *
  * this requires that the peer address be known; on the active side,
@@ -13,8 +31,8 @@
  * has been called, while on the passive side, it must not be called
  * until the first packet arrives from the peer.  (this is not too
  * onerous a restriction, as this interface is used only in the TCP
- * checksum calculation, which satisfies the aforementioned
- * requirements).
+ * checksum calculation and packet capture, which satisfy the
+ * aforementioned requirements).
  */
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
@@ -25,7 +43,6 @@ uint32_t _network_get_local_addr(network_context_t *ctx)
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    return ctx->local_ip;
 }
 
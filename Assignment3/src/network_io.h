@@ -9,10 +9,15 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
+#include <time.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* most iovec entries accepted by _network_send_packetv() */
+#define NETWORK_MAX_IOV    4
+
 
 struct mysock_context;
 
@@ -22,19 +27,25 @@ typedef struct
     /* local address, if known */
     struct sockaddr local_addr;
 
-    /* address of peer */
+    /* address of peer, set with _network_set_peer_addr() */
     struct sockaddr peer_addr;
     socklen_t       peer_addr_len;
     bool_t          peer_addr_valid;
+    uint32_t        local_ip;   /* ours, as seen by the peer */
 
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
-    /* packet reordering/duplication simulation */
+    /* packet loss/reordering/duplication/delay simulation; see network.c */
     unsigned int random_seed;
-    bool_t       copied;
+    bool_t       random_seeded;
+    bool_t       copied;        /* copy_buffer holds a packet held back */
     char         copy_buffer[MAX_IP_PAYLOAD_LEN];
     size_t       copy_buf_len;
+    int          copy_countdown;    /* packets to be sent ahead of it */
+    bool_t       loss_burst;    /* Gilbert-Elliott loss is in its bad state */
+    struct timespec link_idle;  /* when the simulated link next goes idle */
+    int          link_queued;   /* packets waiting on it (network.c's lock) */
 } network_context_t;
 
 
@@ -48,9 +59,19 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 /* specify backlog for passive socket */
 int _network_listen(network_context_t *ctx, int backlog);
 
+/* get or set an option on the network layer's own socket */
+int _network_setsockopt(network_context_t *ctx, int level, int option_name,
+                        const void *option_value, socklen_t option_len);
+int _network_getsockopt(network_context_t *ctx, int level, int option_name,
+                        void *option_value, socklen_t *option_len);
+
 /* returns local port associated with mysocket, in network byte order */
 int _network_get_port(network_context_t *ctx);
 
+/* record the peer's address, and look up the local address it goes with */
+void _network_set_peer_addr(network_context_t *ctx,
+                            const struct sockaddr *addr, socklen_t addr_len);
+
 /* returns local address associated with mysocket, in network byte order.
  * this is only valid once the peer is known.
  */
@@ -65,12 +86,44 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr);
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
 
-/* start/stop per-mysocket network receive thread.  the stop() interface
- * must not return until the network receive thread has exited.
+/* as above, but gathers the packet from up to NETWORK_MAX_IOV pieces */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt);
+
+/* cork/uncork output.  once corked, packets sent are held back (or sent
+ * in batches, as space requires) until _network_flush(), which uncorks
+ * and writes out everything held back.  it returns -1 if that failed
+ * (with errno set), or 0; errno is left alone if there was nothing to do.
+ */
+void _network_cork(network_context_t *ctx);
+int _network_flush(network_context_t *ctx);
+
+/* start/stop delivering network input for a mysocket.  the stop()
+ * interface must not return until the network layer can no longer touch
+ * the mysocket's context.
  */
 int _network_start_recv_thread(struct mysock_context *ctx);
 void _network_stop_recv_thread(struct mysock_context *ctx);
 
+/* read the input waiting for a mysocket and pass it up, as many packets
+ * as have arrived.  the network layer's own reactor calls this, as does
+ * the mysocket's shard (see mysock_shard.c), whose epoll set the socket is
+ * registered with instead.  neither can wait for room in the network
+ * receive ring, so anything that doesn't fit is kept back: a shard
+ * handles it on its next call, while the reactor stops watching the
+ * socket until _network_resume_input() is called.
+ */
+void _network_handle_input(struct mysock_context *ctx);
+
+/* the transport layer has made room in a mysocket's network receive ring
+ * after the reactor stopped reading its input (see _mysock_ring_pause());
+ * have the reactor start again.  this doesn't block.
+ */
+void _network_resume_input(struct mysock_context *ctx);
+
+/* TRUE if input has been read from the socket but not yet passed up */
+bool_t _network_input_pending(network_context_t *ctx);
+
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
  */
@@ -0,0 +1,663 @@
+/* network_io_shm.c: shared memory instantiation of the underlying
+ * datagram service, for peers on the same host (or in the same process).
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* packets each ring holds.  STCP's window keeps only a handful in flight,
+ * so a sender should never find the ring full for long.
+ */
+#define SHM_RING_SLOTS  128
+
+#if (SHM_RING_SLOTS & (SHM_RING_SLOTS - 1)) != 0
+    #error SHM_RING_SLOTS should be a power of two
+#endif
+
+/* a few words about the shared memory network layer...
+ *
+ * each connection has a shared memory segment holding two single-producer,
+ * single-consumer packet rings, one for each direction.  a packet is sent
+ * by copying it into the next slot of the outgoing ring, and received by
+ * copying it out of the incoming one; neither takes a lock or a system
+ * call.
+ *
+ * the mysocket still has a TCP socket, set up just as in the TCP version
+ * (see network_io_tcp.c).  it provides addressing, and the listener
+ * accepts connections on it as usual, but after the name of the segment
+ * (sent by the active side as the first frame) all that goes over it is
+ * wakeups:  a consumer that finds its ring empty sets consumer_waiting
+ * before going back to sleep on the socket, and the producer that next
+ * finds the flag set clears it and writes a single byte.  the socket is
+ * thus what the reactor (or shard) waits on, and while packets keep coming
+ * no byte is written at all.  closing the socket marks the end of the
+ * connection, as it does for TCP.
+ *
+ * the segment is created with shm_open(), so the peers may be in separate
+ * processes; the passive side unlinks it once it has mapped it.
+ */
+typedef struct
+{
+    uint16_t len;
+    char     data[MAX_IP_PAYLOAD_LEN];
+} shm_slot_t;
+
+struct shm_ring
+{
+    unsigned int head __attribute__ ((aligned(64)));   /* consumer */
+    unsigned int tail __attribute__ ((aligned(64)));   /* producer */
+
+    unsigned int consumer_waiting __attribute__ ((aligned(64)));
+    unsigned int closed;        /* producer has gone away */
+
+    shm_slot_t   slots[SHM_RING_SLOTS];
+};
+
+struct shm_segment
+{
+    struct shm_ring ring[2];    /* active to passive, and back */
+};
+
+static int _shm_connect(network_context_t *ctx);
+static struct shm_segment *_shm_create(char *name);
+static struct shm_segment *_shm_open(socket_t sd);
+static void _shm_attach(network_context_socket_shm_t *shm_io_ctx,
+                        struct shm_segment *seg, bool_t is_active);
+static ssize_t _shm_pop(struct shm_ring *ring, void *dst, size_t max_len);
+static int _shm_wake(network_context_t *ctx);
+static int _shm_read(socket_t sd, void *buf, size_t count);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_STREAM,
+                                   sizeof(network_context_socket_shm_t))) < 0)
+        return rc;
+
+    shm_io_ctx = (network_context_socket_shm_t *) net_ctx->impl_data;
+    assert(shm_io_ctx);
+
+    /* the rest was zeroed by _network_init_socket() */
+    shm_io_ctx->sock_ctx = sock_ctx;
+    shm_io_ctx->new_socket = -1;
+
+    PTHREAD_CALL(pthread_mutex_init(&shm_io_ctx->connect_lock, NULL));
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    (void) _network_flush(ctx);
+    if (shm_io_ctx->seg)
+    {
+        __atomic_store_n(&shm_io_ctx->out->closed, 1, __ATOMIC_RELEASE);
+        (void) munmap(shm_io_ctx->seg, sizeof(struct shm_segment));
+    }
+
+    /* in case the peer never got as far as opening it */
+    if (shm_io_ctx->shm_name[0])
+        (void) shm_unlink(shm_io_ctx->shm_name);
+
+    if (shm_io_ctx->new_socket != -1)
+    {
+        closesocket(shm_io_ctx->new_socket);
+        (void) munmap(shm_io_ctx->new_seg, sizeof(struct shm_segment));
+    }
+
+    PTHREAD_CALL(pthread_mutex_destroy(&shm_io_ctx->connect_lock));
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* the listening socket is non-blocking, so that the reactor can accept
+ * every pending connection in one go.
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    int flags;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    if ((flags = fcntl(GET_SOCKET(ctx), F_GETFL)) < 0 ||
+        fcntl(GET_SOCKET(ctx), F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return listen(GET_SOCKET(ctx), backlog);
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_shm_t *new_shm_ctx;
+    network_context_socket_shm_t *accept_shm_ctx;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+
+    new_shm_ctx = (network_context_socket_shm_t *) new_ctx->impl_data;
+    accept_shm_ctx = (network_context_socket_shm_t *) accept_ctx->impl_data;
+
+    assert(new_shm_ctx && accept_shm_ctx);
+    assert(!new_shm_ctx->sock_ctx->listening);
+    assert(!new_shm_ctx->sock_ctx->is_active);
+    assert(new_shm_ctx->base.socket < 0);
+
+    /* the accepted connection and its segment now belong to the new
+     * context.
+     */
+    new_shm_ctx->base.socket = accept_shm_ctx->new_socket;
+    _shm_attach(new_shm_ctx, accept_shm_ctx->new_seg, FALSE);
+    new_shm_ctx->connected = TRUE;
+    accept_shm_ctx->new_socket = -1;
+    accept_shm_ctx->new_seg = NULL;
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* copy the packet gathered from the given iovec into the outgoing ring,
+ * and wake the peer if it's waiting for it.  while corked, the wakeup is
+ * left to _network_flush().  fails with EPIPE once the peer has closed.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    struct shm_ring *ring;
+    shm_slot_t *slot;
+    unsigned int tail;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= NETWORK_MAX_IOV);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+
+    if (_shm_connect(ctx) < 0)
+        return -1;
+
+    ring = shm_io_ctx->out;
+    tail = ring->tail;
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+           SHM_RING_SLOTS)
+    {
+        if (__atomic_load_n(&shm_io_ctx->in->closed, __ATOMIC_ACQUIRE))
+            break;
+        (void) sched_yield();
+    }
+
+    if (__atomic_load_n(&shm_io_ctx->in->closed, __ATOMIC_ACQUIRE))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    slot = &ring->slots[tail & (SHM_RING_SLOTS - 1)];
+    for (k = 0; k < iovcnt; ++k)
+    {
+        assert(len + iov[k].iov_len <= MAX_IP_PAYLOAD_LEN);
+        memcpy(slot->data + len, iov[k].iov_base, iov[k].iov_len);
+        len += iov[k].iov_len;
+    }
+    slot->len = (uint16_t) len;
+
+    /* the store and the check of consumer_waiting in _shm_wake() must not
+     * be reordered; see _network_recv_packet().
+     */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (shm_io_ctx->corked)
+    {
+        shm_io_ctx->out_pushed = TRUE;
+        return len;
+    }
+
+    if (_shm_wake(ctx) < 0)
+        return -1;
+    return len;
+}
+
+void _network_cork(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    shm_io_ctx->corked = TRUE;
+}
+
+int _network_flush(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    shm_io_ctx->corked = FALSE;
+    if (!shm_io_ctx->out_pushed)
+        return 0;
+
+    shm_io_ctx->out_pushed = FALSE;
+    return _shm_wake(ctx);
+}
+
+/* connect an active socket before the reactor starts watching it */
+int _network_prepare_recv(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx && shm_io_ctx->sock_ctx);
+
+    if (shm_io_ctx->sock_ctx->is_active)
+        return _shm_connect(ctx);
+    return 0;
+}
+
+/* each mysocket has its own rings, so there's nothing to undo */
+void _network_release_recv(network_context_t *ctx)
+{
+    assert(ctx);
+}
+
+/* the io_uring reactor only ever hands us wakeup bytes, which are of no
+ * interest in themselves, or the end of the connection.
+ */
+int _network_feed_input(network_context_t *ctx, const void *data, size_t len)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    if (len == 0)
+        shm_io_ctx->in_eof = TRUE;
+    return 0;
+}
+
+bool_t _network_input_pending(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+
+    assert(ctx);
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    return shm_io_ctx->in &&
+           shm_io_ctx->in->head !=
+           __atomic_load_n(&shm_io_ctx->in->tail, __ATOMIC_ACQUIRE);
+}
+
+/* read a packet from the peer.  on a connected socket this doesn't block;
+ * it returns -1 with errno set to EAGAIN once the incoming ring is empty,
+ * having first asked to be woken when it isn't.  on a listening socket,
+ * the next connection is accepted and its SYN returned.
+ */
+ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    struct shm_segment *seg;
+    struct shm_ring *ring;
+    socket_t tmp_sd;
+    ssize_t rc;
+
+    assert(ctx && dst);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx && shm_io_ctx->sock_ctx);
+
+    VERIFY_SOCKET(ctx);
+
+    if (!shm_io_ctx->sock_ctx->listening)
+    {
+        if (_shm_connect(ctx) < 0)
+            return -1;
+
+        ring = shm_io_ctx->in;
+        for (;;)
+        {
+            char wakeups[64];
+
+            if ((rc = _shm_pop(ring, dst, max_len)) >= 0)
+                return rc;
+
+            /* swallow the wakeups that brought us here (unless the io_uring
+             * reactor already did), noticing if the connection has closed.
+             */
+            if (!shm_io_ctx->base.uring_fed)
+            {
+                while ((rc = recv(GET_SOCKET(ctx), wakeups, sizeof(wakeups),
+                                  MSG_DONTWAIT)) > 0 ||
+                       (rc < 0 && errno == EINTR))
+                    ;
+                if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    shm_io_ctx->in_eof = TRUE;
+            }
+
+            /* either the producer sees that we're waiting, or we see its
+             * packet; see _network_send_packetv().
+             */
+            __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST))
+                continue;
+
+            if (shm_io_ctx->in_eof ||
+                __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+                return 0;
+
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    ctx->peer_addr_len = sizeof(ctx->peer_addr);
+    if ((tmp_sd = accept(GET_SOCKET(ctx),
+                         &ctx->peer_addr,
+                         &ctx->peer_addr_len)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return tmp_sd;
+
+        /* a connection that failed (or that we've no descriptor for)
+         * doesn't stop the listener
+         */
+        perror("accept (network_io_shm)");
+        if (!_network_accept_fatal(errno))
+            errno = EAGAIN;
+        return tmp_sd;
+    }
+
+    DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+
+    if (!(seg = _shm_open(tmp_sd)))
+    {
+        closesocket(tmp_sd);
+        errno = EAGAIN;     /* nothing to pass up; try the next one */
+        return -1;
+    }
+
+    /* wait for the SYN, which follows the segment's name */
+    ring = &seg->ring[0];
+    while ((rc = _shm_pop(ring, dst, max_len)) < 0)
+    {
+        char wakeup;
+
+        if (_shm_read(tmp_sd, &wakeup, sizeof(wakeup)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read SYN\n"));
+            (void) munmap(seg, sizeof(*seg));
+            closesocket(tmp_sd);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    /* the active side sends nothing more until it hears back from the new
+     * context, which is woken by whatever comes after that.
+     */
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    assert(shm_io_ctx->new_socket == -1);
+    shm_io_ctx->new_socket = tmp_sd;
+    shm_io_ctx->new_seg    = seg;
+    return rc;
+}
+
+
+/* connect an active mysocket, and give the peer its segment */
+static int _shm_connect(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx;
+    struct shm_segment *seg;
+    uint16_t name_len;
+    struct iovec iov[2];
+    int one = 1;
+
+    assert(ctx);
+
+    shm_io_ctx = (network_context_socket_shm_t *) ctx->impl_data;
+    assert(shm_io_ctx);
+
+    if (__atomic_load_n(&shm_io_ctx->connected, __ATOMIC_ACQUIRE))
+        return 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_io_ctx->connect_lock));
+    if (!shm_io_ctx->connected)
+    {
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+
+        if (connect(GET_SOCKET(ctx), &ctx->peer_addr,
+                    sizeof(ctx->peer_addr)) < 0)
+        {
+            perror("connect (_shm_connect)");
+            PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->connect_lock));
+            return -1;
+        }
+
+        /* wakeups are single bytes, and mustn't wait for each other */
+        (void) setsockopt(GET_SOCKET(ctx), IPPROTO_TCP, TCP_NODELAY,
+                          &one, sizeof(one));
+
+        if (!(seg = _shm_create(shm_io_ctx->shm_name)))
+        {
+            perror("shared memory (_shm_connect)");
+            PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->connect_lock));
+            return -1;
+        }
+
+        name_len = htons((uint16_t) strlen(shm_io_ctx->shm_name));
+        iov[0].iov_base = &name_len;
+        iov[0].iov_len  = sizeof(name_len);
+        iov[1].iov_base = shm_io_ctx->shm_name;
+        iov[1].iov_len  = strlen(shm_io_ctx->shm_name);
+        if (writev(GET_SOCKET(ctx), iov, 2) !=
+            (ssize_t) (iov[0].iov_len + iov[1].iov_len))
+        {
+            perror("writev (_shm_connect)");
+            (void) munmap(seg, sizeof(*seg));
+            PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->connect_lock));
+            return -1;
+        }
+
+        _shm_attach(shm_io_ctx, seg, TRUE);
+        __atomic_store_n(&shm_io_ctx->connected, TRUE, __ATOMIC_RELEASE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_io_ctx->connect_lock));
+
+    return 0;
+}
+
+/* create and map a new segment, filling in its name.  both consumers start
+ * out waiting, since neither has a reason to look at its ring until woken.
+ */
+static struct shm_segment *_shm_create(char *name)
+{
+    static unsigned long counter;
+    struct shm_segment *seg;
+    int fd;
+
+    snprintf(name, SHM_NAME_LEN, "/mysock-%d-%lu", (int) getpid(),
+             __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+    {
+        name[0] = '\0';
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(*seg)) < 0 ||
+        (seg = (struct shm_segment *) mmap(NULL, sizeof(*seg),
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        (void) close(fd);
+        (void) shm_unlink(name);
+        name[0] = '\0';
+        return NULL;
+    }
+    (void) close(fd);
+
+    /* the rest is zero */
+    seg->ring[0].consumer_waiting = 1;
+    seg->ring[1].consumer_waiting = 1;
+    return seg;
+}
+
+/* map the segment named by the first frame on the accepted connection,
+ * then remove its name; it goes away once both sides have unmapped it.
+ */
+static struct shm_segment *_shm_open(socket_t sd)
+{
+    char name[SHM_NAME_LEN];
+    struct shm_segment *seg;
+    uint16_t name_len;
+    int fd;
+
+    if (_shm_read(sd, &name_len, sizeof(name_len)) <= 0)
+        return NULL;
+
+    name_len = ntohs(name_len);
+    if (name_len == 0 || name_len >= sizeof(name) ||
+        _shm_read(sd, name, name_len) <= 0)
+        return NULL;
+    name[name_len] = '\0';
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+    {
+        perror("shm_open (_shm_open)");
+        return NULL;
+    }
+    (void) shm_unlink(name);
+
+    seg = (struct shm_segment *) mmap(NULL, sizeof(*seg),
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0);
+    (void) close(fd);
+    return (seg == MAP_FAILED) ? NULL : seg;
+}
+
+static void _shm_attach(network_context_socket_shm_t *shm_io_ctx,
+                        struct shm_segment *seg, bool_t is_active)
+{
+    shm_io_ctx->seg = seg;
+    shm_io_ctx->out = &seg->ring[is_active ? 0 : 1];
+    shm_io_ctx->in  = &seg->ring[is_active ? 1 : 0];
+}
+
+/* copy the next packet out of the given ring, or return -1 if it's empty.
+ * packets larger than max_len are truncated.
+ */
+static ssize_t _shm_pop(struct shm_ring *ring, void *dst, size_t max_len)
+{
+    const shm_slot_t *slot;
+    size_t len;
+
+    if (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return -1;
+
+    slot = &ring->slots[ring->head & (SHM_RING_SLOTS - 1)];
+    len  = MIN(slot->len, max_len);
+    memcpy(dst, slot->data, len);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* wake the peer, if it's waiting for the packets just sent */
+static int _shm_wake(network_context_t *ctx)
+{
+    network_context_socket_shm_t *shm_io_ctx =
+        (network_context_socket_shm_t *) ctx->impl_data;
+    struct shm_ring *ring = shm_io_ctx->out;
+
+    if (!__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST) ||
+        !__atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+        return 0;
+
+    if (send(GET_SOCKET(ctx), "", 1, MSG_NOSIGNAL) < 0)
+    {
+        DEBUG_LOG(("_shm_wake: send failed (errno=%d)\n", errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* read exactly count bytes from the given (blocking) socket */
+static int _shm_read(socket_t sd, void *buf, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        ssize_t rc = read(sd, (char *) buf + done, count - done);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return rc;
+        done += rc;
+    }
+    return 1;
+}
+
@@ -7,7 +7,9 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <unistd.h>
-#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <assert.h>
 #include "mysock_impl.h"
 #include "network_io.h"
@@ -21,8 +23,8 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
+/* most events handled per epoll_wait() */
+#define REACTOR_MAX_EVENTS 64
 
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
@@ -36,7 +38,33 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
-static void *network_recv_thread_func(void *arg_ptr);
+static void _network_reactor_init(void);
+static void *network_reactor_func(void *arg_ptr);
+static void _network_reactor_resume(void);
+static bool_t _network_pause_input(mysock_context_t *ctx);
+static bool_t _network_pass_syn(mysock_context_t *ctx, mysock_buf_t *packet);
+
+
+/* all network input is handled by a single reactor thread, which waits on
+ * every mysocket's socket with epoll, reads each packet as it arrives, and
+ * queues it for the right context.  reactor_cycle counts the batches of
+ * events the reactor has finished dispatching; reactor_wakefd (registered
+ * with a NULL pointer) kicks it out of epoll_wait().  the reactor never
+ * waits for a transport layer: a mysocket whose network receive ring is
+ * full has its socket dropped from the epoll set until the transport layer
+ * makes room, and queues itself on reactor_resumed.  with MYSOCK_SHARDS
+ * set, each connection's shard does all of this for it instead, and the
+ * reactor is left with just the listening sockets.  with MYSOCK_IO_URING
+ * set, network_io_uring.c takes the reactor's place for everything but the
+ * listening sockets.
+ */
+static int             reactor_epfd = -1;
+static int             reactor_wakefd = -1;
+static unsigned long   reactor_cycle;
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  reactor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  reactor_once = PTHREAD_ONCE_INIT;
+static mysock_context_t *reactor_resumed;   /* protected by reactor_lock */
 
 
 
@@ -58,8 +86,11 @@ int _network_get_port(network_context_t *ctx)
     struct sockaddr_in sin;
     socklen_t sin_len = sizeof(sin);
 
-    assert(ctx);
-    VERIFY_SOCKET(ctx);
+    assert(ctx && ctx->impl_data);
+
+    /* no socket yet, so nothing bound */
+    if (GET_SOCKET(ctx) < 0)
+        return 0;
 
     if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
     {
@@ -71,6 +102,31 @@ int _network_get_port(network_context_t *ctx)
     return sin.sin_port;
 }
 
+/* socket options are passed straight through to the socket, which is
+ * created now if need be, so that options can be set before connecting
+ */
+int _network_setsockopt(network_context_t *ctx, int level, int option_name,
+                        const void *option_value, socklen_t option_len)
+{
+    assert(ctx && ctx->impl_data);
+
+    if (_network_ensure_socket(ctx) < 0)
+        return -1;
+    return setsockopt(GET_SOCKET(ctx), level, option_name,
+                      option_value, option_len);
+}
+
+int _network_getsockopt(network_context_t *ctx, int level, int option_name,
+                        void *option_value, socklen_t *option_len)
+{
+    assert(ctx && ctx->impl_data);
+
+    if (_network_ensure_socket(ctx) < 0)
+        return -1;
+    return getsockopt(GET_SOCKET(ctx), level, option_name,
+                      option_value, option_len);
+}
+
 /* return the address associated with the interface over which packets
  * to/from the given peer (network byte order) are delivered.  this is
  * completely broken for multi-homed hosts; it should consult the local
@@ -111,12 +167,16 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
+/* begin handing the given mysocket's network input to the reactor */
 int _network_start_recv_thread(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
+    struct epoll_event ev;
+    int epfd;
 
     assert(net_ctx);
+    assert(!net_ctx->registered);
 
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     {
@@ -125,37 +185,143 @@ int _network_start_recv_thread(mysock_context_t *ctx)
         return -1;
     }
 
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
+    /* listeners stay with the epoll reactor, which also watches the
+     * connections they've accepted until their SYNs arrive
+     */
+    net_ctx->hung_up = FALSE;
+    net_ctx->uring   = (!ctx->shard && !ctx->listening &&
+                        _network_uring_enabled());
+    if (ctx->shard)
+    {
+        epfd = _mysock_shard_epoll_fd(ctx);
+    }
+    else if (!net_ctx->uring)
+    {
+        PTHREAD_CALL(pthread_once(&reactor_once, _network_reactor_init));
+        epfd = reactor_epfd;
+    }
+    else
+    {
+        epfd = -1;
+    }
+
+    /* if this fails, so will sending the SYN; no input is coming anyway.
+     * if the input comes in through another mysocket, there's nothing to
+     * watch.
+     */
+    if (_network_prepare_recv(&ctx->network_state) != 0)
+        return 0;
+
+    if (net_ctx->uring)
+    {
+        _network_uring_start(ctx);
+        net_ctx->epfd       = epfd;
+        net_ctx->registered = TRUE;
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = ctx;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, net_ctx->socket, &ev) < 0)
+    {
+        perror("epoll_ctl(EPOLL_CTL_ADD)");
+        assert(0);
+        return -1;
+    }
+
+    net_ctx->epfd       = epfd;
+    net_ctx->registered = TRUE;
     return 0;
 }
 
-/* block until the network receive thread completes */
+/* stop handling the given mysocket's network input.  this doesn't return
+ * until the reactor (or shard) can no longer be touching the context.
+ */
 void _network_stop_recv_thread(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
 
-    DEBUG_LOG(("stopping receive thread\n"));
+    DEBUG_LOG(("stopping network input\n"));
     assert(net_ctx);
 
+    _network_release_recv(&ctx->network_state);
 
-    if (net_ctx->recv_thread_started)
+    if (net_ctx->registered && net_ctx->uring)
+    {
+        _network_uring_stop(ctx);
+        net_ctx->registered = FALSE;
+    }
+    else if (net_ctx->registered)
     {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
+        /* the reactor may already have removed the socket after an error */
+        if (epoll_ctl(net_ctx->epfd, EPOLL_CTL_DEL,
+                      net_ctx->socket, NULL) < 0)
+            assert(errno == ENOENT);
+        net_ctx->registered = FALSE;
+
+        /* an event for this socket can only be outstanding in a batch the
+         * reactor (or shard) had already collected; wait until that batch
+         * (if any) has been dispatched.
+         */
+        if (ctx->shard)
         {
-            assert(0);
-            abort();
+            _mysock_shard_sync(ctx);
         }
+        else
+        {
+            mysock_context_t **link = &reactor_resumed;
+            unsigned long target;
 
+            PTHREAD_CALL(pthread_mutex_lock(&reactor_lock));
+            target = reactor_cycle + 1;
+            while ((long) (reactor_cycle - target) < 0)
+            {
+                uint64_t one = 1;
+
+                if (write(reactor_wakefd, &one, sizeof(one)) < 0)
+                    assert(errno == EAGAIN);
+                PTHREAD_CALL(pthread_cond_wait(&reactor_cond,
+                                               &reactor_lock));
+            }
+
+            /* nor is it to be resumed.  this comes last, as the reactor
+             * may have queued it again while handling that batch.
+             */
+            while (net_ctx->resume_queued)
+            {
+                network_context_socket_t *queued = (network_context_socket_t *)
+                    (*link)->network_state.impl_data;
+
+                if (*link == ctx)
+                {
+                    *link = net_ctx->resume_next;
+                    net_ctx->resume_queued = FALSE;
+                }
+                else
+                {
+                    link = &queued->resume_next;
+                }
+            }
+            PTHREAD_CALL(pthread_mutex_unlock(&reactor_lock));
 
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
+            /* a connection request still waiting for the listen table */
+            if (net_ctx->held_syn)
+            {
+                _mysock_buf_release(net_ctx->held_syn);
+                net_ctx->held_syn = NULL;
+            }
+        }
     }
-    DEBUG_LOG(("stopped receive thread\n"));
+    DEBUG_LOG(("stopped network input\n"));
+}
+
+
+bool_t _network_accept_fatal(int err)
+{
+    return (err == EBADF || err == EINVAL || err == ENOTSOCK ||
+            err == EOPNOTSUPP || err == EFAULT);
 }
 
 
@@ -188,137 +354,348 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen)
 {
     assert(ctx && addr);
-    VERIFY_SOCKET(ctx);
+    if (_network_ensure_socket(ctx) < 0)
+        return -1;
     return bind(GET_SOCKET(ctx), addr, addrlen);
 }
 
+int _network_ensure_socket(network_context_t *ctx)
+{
+    network_context_socket_t *net_ctx;
+
+    assert(ctx && ctx->impl_data);
+    net_ctx = (network_context_socket_t *) ctx->impl_data;
+
+    if (net_ctx->socket >= 0)
+        return 0;
+
+    /* create the actual socket used for communication to the peer */
+    if ((net_ctx->socket = socket(AF_INET, net_ctx->type, 0)) < 0)
+    {
+        perror("socket");
+        assert(0);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* create the epoll set and start the reactor thread; called once */
+static void _network_reactor_init(void)
+{
+    struct epoll_event ev;
+
+    if ((reactor_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (reactor_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("network reactor");
+        assert(0);
+        abort();
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wakefd, &ev) < 0)
+    {
+        perror("epoll_ctl(reactor_wakefd)");
+        assert(0);
+        abort();
+    }
+
+    (void) _mysock_create_thread(network_reactor_func, NULL, TRUE);
+}
 
 /* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
- * this runs in its own thread, mostly because the transport layer needs to
- * wait with a timeout for incoming data from the peer.  [usual mechanisms
- * for I/O with timeouts such as poll(), select(), or asynchronous I/O
- * don't work with all underlying I/O mechanisms we might support (e.g.
- * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
+ * this just loops around, waiting for data to arrive on any mysocket, and
+ * buffering it for later consumption by network_recv().  (outgoing data is
+ * sent immediately via network_send(), and so does not require its own
+ * thread).
+ *
+ * input is handled in its own thread, mostly because the transport layer
+ * needs to wait with a timeout for incoming data from the peer.  [usual
+ * mechanisms for I/O with timeouts such as poll(), select(), or
+ * asynchronous I/O don't work with all underlying I/O mechanisms we might
+ * support (e.g. VNS).  so we implement the timeout in a more generic
+ * (I/O-independent) manner using the pthreads API instead].  one thread
+ * serves every mysocket.
  */
-static void *network_recv_thread_func(void *arg_ptr)
+static void *network_reactor_func(void *arg_ptr)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    DEBUG_LOG(("started network reactor\n"));
+
+    for (;;)
+    {
+        int k, n;
+
+        if ((n = epoll_wait(reactor_epfd, events, REACTOR_MAX_EVENTS, -1)) < 0)
+        {
+            assert(errno == EINTR);
+            n = 0;
+        }
+
+        for (k = 0; k < n; ++k)
+        {
+            if (!events[k].data.ptr)
+            {
+                uint64_t count;
+
+                /* someone is waiting for this cycle to finish, or has
+                 * made room for more input
+                 */
+                (void) read(reactor_wakefd, &count, sizeof(count));
+                _network_reactor_resume();
+                continue;
+            }
+
+            _network_handle_input((mysock_context_t *) events[k].data.ptr);
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&reactor_lock));
+        ++reactor_cycle;
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&reactor_cond));
+    }
+
+    return NULL;
+}
+
+/* read the packets waiting on the given mysocket's socket */
+void _network_handle_input(mysock_context_t *ctx)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
     network_context_socket_t *net_ctx;
+    mysock_buf_t *packet;
+    ssize_t bytes_read;
 
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
     assert(ctx);
-
     net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
     assert(net_ctx);
 
+    /* every packet (or connection request) that has arrived is passed up */
     for (;;)
     {
-        ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
+        if (net_ctx->held_syn)
         {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
-
+            /* this comes first, as the backend may still be holding state
+             * for it (e.g. the accepted socket) until the next packet is
+             * read
+             */
+            if (!_network_pass_syn(ctx, net_ctx->held_syn))
+                return;
+            net_ctx->held_syn = NULL;
+        }
 
-        while (!packet_ready && !done)
+        if (_mysock_ring_full(&ctx->network_recv_queue))
         {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
+            /* the rest waits until the transport layer has made room */
+            if (ctx->shard)
             {
-            case -1:
-                assert(errno == EINTR);
-                break;
-
-            case 0:
-                assert(0);
-                break;
-
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
-
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
+                _mysock_shard_wake(ctx);
+                return;
             }
+            if (_network_pause_input(ctx))
+                return;
         }
 
-        if (done)
-            break;
+        packet = _mysock_buf_alloc(MAX_IP_PAYLOAD_LEN);
+        if ((bytes_read = _network_recv_packet(&ctx->network_state,
+                                               packet->data,
+                                               MAX_IP_PAYLOAD_LEN)) < 0 &&
+            errno == EAGAIN)
+        {
+            /* that's all for now */
+            _mysock_buf_release(packet);
+            return;
+        }
 
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
+        /* a listener's backend drops a connection that fails before its
+         * SYN has arrived, so for a listener, this is the listening socket
+         * itself failing
          */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+        if (bytes_read <= 0)
         {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            //signal an error to the transport layer
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
-            break;
+            DEBUG_LOG(("_network_recv_packet failed, errno=%d\n", errno));
+
+            /* nothing more will arrive on this socket */
+            net_ctx->hung_up = TRUE;
+            if (net_ctx->uring)
+                _network_uring_cancel(ctx);
+            else
+                (void) epoll_ctl(net_ctx->epfd, EPOLL_CTL_DEL,
+                                 net_ctx->socket, NULL);
+
+            //signal an error to the transport layer (there's room for it)
+            _mysock_ring_push(ctx, &ctx->network_recv_queue, packet);
+            return;
         }
 
-        assert(bytes_read <= (int)sizeof(packet_buf));
+        assert(bytes_read <= MAX_IP_PAYLOAD_LEN);
+        packet->data_len = bytes_read;
         if (ctx->listening)
         {
             /* if the socket was accepting new connections, incoming
              * packets need to be demultiplexed and dispatched to the
              * appropriate mysocket context.
              */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
+            if (!_network_pass_syn(ctx, packet))
+            {
+                net_ctx->held_syn = packet;
+                return;
+            }
+        }
+        else if (!_mysock_segment_ok(ctx, NULL, packet->data, bytes_read))
+        {
+            _mysock_buf_release(packet);
         }
         else
         {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            /* enqueue the packet directly for this context.  we're its
+             * only producer, so there's still room.
+             */
+            _mysock_ring_push(ctx, &ctx->network_recv_queue, packet);
         }
     }
+}
 
-    return NULL;
+/* pass a connection request read from the given listener up to the
+ * demultiplexer.  the reactor never waits for the listen table, so if
+ * it's busy, this returns FALSE, and the caller holds on to the request;
+ * the listener is queued to be resumed, and so tries again once the
+ * reactor has seen to everything else.  otherwise the packet is released.
+ */
+static bool_t _network_pass_syn(mysock_context_t *ctx, mysock_buf_t *packet)
+{
+    if (_mysock_enqueue_connection(ctx, packet->data, packet->data_len,
+                                   &ctx->network_state.peer_addr,
+                                   ctx->network_state.peer_addr_len,
+                                   NULL) < 0)
+    {
+        assert(errno == EAGAIN);
+        _network_resume_input(ctx);
+        return FALSE;
+    }
+
+    _mysock_buf_release(packet);
+    return TRUE;
 }
 
-static network_context_socket_t *
-_network_alloc_context_socket(int socket_type, size_t ctx_len)
+/* stop reading the given mysocket's input, which is waiting for room in
+ * its full network receive ring.  returns TRUE if the transport layer will
+ * have it resumed, or FALSE if it has made room already.
+ */
+static bool_t _network_pause_input(mysock_context_t *ctx)
 {
-    network_context_socket_t *ctx =
-        (network_context_socket_t *) calloc(1, ctx_len);
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct epoll_event ev;
 
-    assert(ctx);
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = ctx;
 
+    if (net_ctx->uring)
+        _network_uring_pause(ctx);
+    else if (epoll_ctl(net_ctx->epfd, EPOLL_CTL_MOD, net_ctx->socket, &ev) < 0)
+        assert(errno == ENOENT);
 
-    /* create the actual socket used for communication to the peer */
-    if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
+    if (_mysock_ring_pause(ctx, &ctx->network_recv_queue))
+        return TRUE;
+
+    if (net_ctx->uring)
     {
-        perror("socket");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
+        _network_uring_resume(ctx);
     }
+    else
+    {
+        ev.events = EPOLLIN;
+        if (epoll_ctl(net_ctx->epfd, EPOLL_CTL_MOD, net_ctx->socket, &ev) < 0)
+            assert(errno == ENOENT);
+    }
+    return FALSE;
+}
+
+void _network_resume_input(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx;
+    uint64_t one = 1;
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
+    assert(ctx && !ctx->shard);
+    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
+    assert(net_ctx);
+
+    if (net_ctx->uring)
     {
-        perror("pipe");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
+        _network_uring_resume(ctx);
+        return;
     }
 
+    /* the reactor watches the socket again, and reads whatever it has
+     * already taken from it (see _network_reactor_resume())
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&reactor_lock));
+    if (!net_ctx->resume_queued)
+    {
+        net_ctx->resume_queued = TRUE;
+        net_ctx->resume_next   = reactor_resumed;
+        reactor_resumed        = ctx;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor_lock));
+
+    if (write(reactor_wakefd, &one, sizeof(one)) < 0)
+        assert(errno == EAGAIN);
+}
+
+/* pick up input for the mysockets queued by _network_resume_input().  some
+ * of it may already have been read from the socket, so it's handled
+ * straight away, rather than waiting for epoll to report the socket.
+ */
+static void _network_reactor_resume(void)
+{
+    for (;;)
+    {
+        mysock_context_t *ctx;
+        network_context_socket_t *net_ctx;
+        struct epoll_event ev;
+
+        PTHREAD_CALL(pthread_mutex_lock(&reactor_lock));
+        if ((ctx = reactor_resumed) != NULL)
+        {
+            net_ctx = (network_context_socket_t *)
+                ctx->network_state.impl_data;
+            reactor_resumed        = net_ctx->resume_next;
+            net_ctx->resume_queued = FALSE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor_lock));
+
+        if (!ctx)
+            break;
+
+        /* the socket is gone from the epoll set if input has been stopped
+         * since (or it hung up), in which case we leave it alone
+         */
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = ctx;
+        if (epoll_ctl(net_ctx->epfd, EPOLL_CTL_MOD, net_ctx->socket, &ev) < 0)
+            assert(errno == ENOENT);
+        else
+            _network_handle_input(ctx);
+    }
+}
+
+static network_context_socket_t *
+_network_alloc_context_socket(int socket_type, size_t ctx_len)
+{
+    network_context_socket_t *ctx =
+        (network_context_socket_t *) calloc(1, ctx_len);
+
+    assert(ctx);
+
+    /* the socket itself is created by _network_ensure_socket() */
+    ctx->socket = -1;
+    ctx->type   = socket_type;
     return ctx;
 }
 
@@ -333,18 +710,6 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         ctx->socket = -1;
     }
 
-    if (ctx->exit_pipe[0] >= 0)
-    {
-        close(ctx->exit_pipe[0]);
-        ctx->exit_pipe[0] = -1;
-    }
-
-    if (ctx->exit_pipe[1] >= 0)
-    {
-        close(ctx->exit_pipe[1]);
-        ctx->exit_pipe[1] = -1;
-    }
-
     free(ctx);
 }
 
@@ -21,11 +21,35 @@ typedef int socket_t;
  */
 typedef struct
 {
-    pthread_t          recv_thread;
-    bool_t             recv_thread_started;
+    bool_t             registered;  /* watched by the network reactor? */
+    int                epfd;        /* reactor's epoll set, or a shard's */
+    bool_t             hung_up;     /* nothing more to read */
+
+    /* queued for the reactor by _network_resume_input(); protected by
+     * reactor_lock
+     */
+    bool_t             resume_queued;
+    mysock_context_t  *resume_next;
+
+    /* listener:  connection request waiting for the listen table, which
+     * was busy (see _network_handle_input()).  only the reactor touches
+     * this until input has been stopped.
+     */
+    mysock_buf_t      *held_syn;
+
+    /* io_uring reactor state (see network_io_uring.c).  uring_armed,
+     * uring_stopping, uring_paused and uring_resuming are protected by
+     * its lock.
+     */
+    bool_t             uring;           /* watched by it, not by epoll */
+    bool_t             uring_fed;       /* it reads the socket for us */
+    bool_t             uring_armed;     /* its request is outstanding */
+    bool_t             uring_stopping;  /* ...and isn't to be renewed */
+    bool_t             uring_paused;    /* ...until the ring has room */
+    bool_t             uring_resuming;  /* a resume request is outstanding */
 
     socket_t           socket;  /* socket used for communication to peer */
-    int                exit_pipe[2];    /* used to wake up read thread */
+    int                type;    /* SOCK_STREAM or SOCK_DGRAM */
 } network_context_socket_t;
 
 typedef struct
@@ -36,9 +60,104 @@ typedef struct
     mysock_context_t *sock_ctx;
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
+
+    /* listener:  accepted connections whose SYN hasn't arrived in full
+     * yet (see _tcp_accept()).  a listener never connects, so these are
+     * protected by connect_lock.
+     */
+    struct tcp_pending_syn *pending;
+    bool_t            pending_released;   /* input has been stopped */
+    /* set once, and never cleared.  it's published with a release store
+     * (not always under connect_lock; see _network_update_passive_state())
+     * and read with an acquire load, so a thread that sees it set sees the
+     * connected socket too.
+     */
     bool_t            connected;
+
+    /* frames held back while corked (see _network_cork()).  these are only
+     * touched by whoever runs the transport layer.
+     */
+    bool_t            corked;
+    char             *out_buf;
+    size_t            out_len;
+
+    /* input read ahead from the socket, parsed into frames by
+     * _network_recv_packet().  only the thread handling the mysocket's
+     * network input touches this.
+     */
+    char             *in_buf;
+    size_t            in_size;      /* grows only when input is fed */
+    size_t            in_start;     /* first byte not yet parsed */
+    size_t            in_end;       /* end of the data read so far */
+    size_t            in_skip;      /* rest of an oversized frame to drop */
+    bool_t            in_drained;   /* last read left the socket empty */
+    bool_t            in_eof;       /* fed input has ended */
 } network_context_socket_tcp_t;
 
+/* batch of datagrams for recvmmsg()/sendmmsg(); see network_io_udp.c */
+struct udp_batch;
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by UDP-based network layer */
+    mysock_context_t  *sock_ctx;
+    network_context_t *listen_ctx;  /* passive: listener whose socket we
+                                     * share (until _network_release_recv())
+                                     */
+
+    /* datagrams read by the last recvmmsg(), and the next to hand out.
+     * only the thread handling the mysocket's network input touches these.
+     */
+    struct udp_batch  *in;
+    int                in_next;
+    int                in_count;
+    bool_t             in_drained;  /* last batch left the socket empty */
+
+    /* datagrams held back while corked (see _network_cork()), touched only
+     * by whoever runs the transport layer.
+     */
+    bool_t             corked;
+    struct udp_batch  *out;
+    int                out_count;
+} network_context_socket_udp_t;
+
+/* shared memory holding a connection's packet rings; see network_io_shm.c */
+struct shm_segment;
+struct shm_ring;
+
+#define SHM_NAME_LEN 32
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by the shared memory network layer.  the
+     * socket is a TCP connection to the peer, as in the TCP version, but
+     * packets go through the rings instead; see network_io_shm.c.
+     */
+    mysock_context_t   *sock_ctx;
+    pthread_mutex_t     connect_lock;
+    bool_t              connected;
+    char                shm_name[SHM_NAME_LEN]; /* active: segment we made */
+
+    struct shm_segment *seg;        /* mapped once connected */
+    struct shm_ring    *in;         /* its rings, by direction */
+    struct shm_ring    *out;
+
+    /* listener:  temporary results of accepting a connection */
+    socket_t            new_socket;
+    struct shm_segment *new_seg;
+
+    /* touched only by whoever runs the transport layer */
+    bool_t              corked;     /* hold back the peer's wakeup */
+    bool_t              out_pushed; /* ...which is then owed */
+
+    /* touched only by the thread handling the mysocket's network input */
+    bool_t              in_eof;     /* the TCP connection has closed */
+} network_context_socket_shm_t;
+
 
 #define closesocket(s) close(s)
 
@@ -66,13 +185,60 @@ int _network_bind_socket(network_context_t *ctx,
                          struct sockaddr   *addr,
                          int                addrlen);
 
+/* create the context's socket, if it doesn't have one yet.  sockets are
+ * only created once they're needed (by binding), so a passive connection,
+ * which is handed its socket by the listener, never creates one of its own.
+ */
+int _network_ensure_socket(network_context_t *ctx);
+
+/* TRUE if accept() failed with the given errno because of the listening
+ * socket itself, rather than the connection it was accepting
+ */
+bool_t _network_accept_fatal(int err);
 
-/* this is not called directly.  use network_start_recv_thread() and
+
+/* this is not called directly; _network_handle_input() calls it once the
+ * socket is readable.  use network_start_recv_thread() and
  * network_stop_recv_thread() instead.
  */
 ssize_t _network_recv_packet(network_context_t *ctx,
                              void *dst, size_t max_len);
 
+/* called before the socket is handed to the reactor; returns -1 if the
+ * socket can't be used for input, or 1 if the mysocket's input arrives by
+ * some other means (so the socket isn't to be watched).  the TCP version
+ * connects an active socket here, since the reactor would see an
+ * unconnected stream socket as hung up.
+ */
+int _network_prepare_recv(network_context_t *ctx);
+
+/* called when the mysocket's input is stopped, to undo any arrangement
+ * _network_prepare_recv() made for it.  once this returns, the network
+ * layer must no longer deliver input for the mysocket.
+ */
+void _network_release_recv(network_context_t *ctx);
+
+/* hand the backend input that the io_uring reactor read from its socket;
+ * len 0 means the peer has finished (or the connection failed).  the data
+ * is returned by later _network_recv_packet() calls, which don't read the
+ * socket themselves.  returns -1 if it can't be taken.
+ */
+int _network_feed_input(network_context_t *ctx, const void *data, size_t len);
+
+
+/* network_io_uring.c */
+bool_t _network_uring_enabled(void);
+
+void _network_uring_start(mysock_context_t *ctx);
+
+void _network_uring_cancel(mysock_context_t *ctx);
+
+void _network_uring_pause(mysock_context_t *ctx);
+
+void _network_uring_resume(mysock_context_t *ctx);
+
+void _network_uring_stop(mysock_context_t *ctx);
+
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
 
@@ -5,9 +5,13 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
-#include <alloca.h>
+#include <sys/epoll.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -15,10 +19,43 @@
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
+/* size of the per-socket buffer that frames are gathered into while
+ * corked.  this holds a few full-sized STCP segments, with their length
+ * prefixes.
+ */
+#define TCP_CORK_BUF_SIZE   (4 * (MAX_IP_PAYLOAD_LEN + sizeof(uint16_t)))
+
+/* size of the per-socket buffer that input is read into, and split into
+ * frames from.  one read() of this much can deliver dozens of segments.
+ */
+#define TCP_INPUT_BUF_SIZE  65536
+
+/* a connection accepted by a listener, which is watched by the reactor
+ * until its SYN has arrived in full.  the frame is read no further, since
+ * anything after it belongs to the new context.
+ */
+typedef struct tcp_pending_syn
+{
+    struct tcp_pending_syn *next;
+    socket_t        sd;
+    struct sockaddr peer_addr;
+    socklen_t       peer_addr_len;
+    size_t          len;        /* bytes of the frame read so far */
+    char            frame[sizeof(uint16_t) + MAX_IP_PAYLOAD_LEN];
+} tcp_pending_syn_t;
+
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_set_nodelay(socket_t tcp_sd);
+static int _tcp_flush(network_context_t *ctx);
+static ssize_t _tcp_read_frame(network_context_t *ctx,
+                               void *dst, size_t max_len);
+static int _tcp_accept(network_context_t *ctx);
+static ssize_t _tcp_read_syn(tcp_pending_syn_t *pending, size_t max_len);
+static int _tcp_set_blocking(socket_t tcp_sd, bool_t blocking);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -57,6 +94,17 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     tcp_io_ctx->sock_ctx = sock_ctx;
     tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    tcp_io_ctx->corked = FALSE;
+    tcp_io_ctx->out_buf = NULL;
+    tcp_io_ctx->out_len = 0;
+    tcp_io_ctx->in_buf = NULL;
+    tcp_io_ctx->in_size = TCP_INPUT_BUF_SIZE;
+    tcp_io_ctx->in_start = tcp_io_ctx->in_end = 0;
+    tcp_io_ctx->in_skip = 0;
+    tcp_io_ctx->in_drained = FALSE;
+    tcp_io_ctx->in_eof = FALSE;
+    tcp_io_ctx->pending = NULL;
+    tcp_io_ctx->pending_released = FALSE;
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
 
@@ -72,6 +120,13 @@ void _network_close(network_context_t *ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
+    (void) _network_flush(ctx);
+    free(tcp_io_ctx->out_buf);
+    tcp_io_ctx->out_buf = NULL;
+    free(tcp_io_ctx->in_buf);
+    tcp_io_ctx->in_buf = NULL;
+    tcp_io_ctx->in_size = TCP_INPUT_BUF_SIZE;
+
     if (tcp_io_ctx->new_socket != -1)
     {
         DEBUG_LOG(("closing TCP network layer socket %d...\n",
@@ -88,16 +143,20 @@ void _network_close(network_context_t *ctx)
 int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
 {
     assert(ctx && addr);
-    VERIFY_SOCKET(ctx);
-
     return _network_bind_socket(ctx, addr, addrlen);
 }
 
+/* the listening socket is non-blocking, so that the reactor can accept
+ * every pending connection in one go.
+ */
 int _network_listen(network_context_t *ctx, int backlog)
 {
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
+    if (_tcp_set_blocking(GET_SOCKET(ctx), FALSE) < 0)
+        return -1;
+
     return listen(GET_SOCKET(ctx), backlog);
 }
 
@@ -122,9 +181,9 @@ void _network_update_passive_state(network_context_t *new_ctx,
      */
     assert(!new_tcp_ctx->sock_ctx->listening);
     assert(!new_tcp_ctx->sock_ctx->is_active);
-    closesocket(new_tcp_ctx->base.socket);
+    assert(new_tcp_ctx->base.socket < 0);   /* never needed one of its own */
     new_tcp_ctx->base.socket = accept_tcp_ctx->new_socket;
-    new_tcp_ctx->connected = TRUE;
+    __atomic_store_n(&new_tcp_ctx->connected, TRUE, __ATOMIC_RELEASE);
     accept_tcp_ctx->new_socket = -1;
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
@@ -134,11 +193,31 @@ void _network_update_passive_state(network_context_t *new_ctx,
 /* send the given packet to the peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send the packet gathered from the given iovec to the peer.  the length
+ * prefix and the packet go out in a single writev().  while corked, the
+ * frame is instead appended to those held back for _network_flush(), so
+ * that a burst of segments reaches the kernel in one write().
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+    struct iovec frame[NETWORK_MAX_IOV + 1];
     uint16_t packet_len;    /* network byte order */
+    size_t len = 0;
+    int k;
 
-    assert(ctx && src);
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= NETWORK_MAX_IOV);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,22 +229,187 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
+    for (k = 0; k < iovcnt; ++k)
+    {
+        frame[k + 1] = iov[k];
+        len += iov[k].iov_len;
+    }
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len  = sizeof(packet_len);
+
+    if (tcp_io_ctx->corked)
+    {
+        if (!tcp_io_ctx->out_buf &&
+            !(tcp_io_ctx->out_buf = (char *) malloc(TCP_CORK_BUF_SIZE)))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (tcp_io_ctx->out_len + sizeof(packet_len) + len >
+            TCP_CORK_BUF_SIZE && _tcp_flush(ctx) < 0)
+            return -1;
+
+        for (k = 0; k <= iovcnt; ++k)
+        {
+            memcpy(tcp_io_ctx->out_buf + tcp_io_ctx->out_len,
+                   frame[k].iov_base, frame[k].iov_len);
+            tcp_io_ctx->out_len += frame[k].iov_len;
+        }
+        return len;
+    }
+
+    if (_tcp_writev(GET_SOCKET(ctx), frame, iovcnt + 1) <= 0)
         return -1;
 
     return len;
 }
 
-/* read a packet from the peer */
+void _network_cork(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    tcp_io_ctx->corked = TRUE;
+}
+
+int _network_flush(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    tcp_io_ctx->corked = FALSE;
+    return _tcp_flush(ctx);
+}
+
+/* connect an active socket before the reactor starts watching it */
+int _network_prepare_recv(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->sock_ctx);
+
+    if (tcp_io_ctx->sock_ctx->is_active)
+        return _tcp_connect(ctx);
+    return 0;
+}
+
+/* each mysocket reads its own socket, so there's nothing to undo, except
+ * on a listener, whose pending connections are dropped
+ */
+void _network_release_recv(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_pending_syn_t *pending;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->sock_ctx);
+
+    if (!tcp_io_ctx->sock_ctx->listening)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
+    tcp_io_ctx->pending_released = TRUE;
+    while ((pending = tcp_io_ctx->pending) != NULL)
+    {
+        tcp_io_ctx->pending = pending->next;
+        (void) epoll_ctl(tcp_io_ctx->base.epfd, EPOLL_CTL_DEL,
+                         pending->sd, NULL);
+        closesocket(pending->sd);
+        free(pending);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+}
+
+/* append input read by the io_uring reactor to the frame buffer.  input
+ * that arrives while the network receive ring is full has nowhere else to
+ * go (see _network_uring_pause()), so the buffer grows to hold it.
+ */
+int _network_feed_input(network_context_t *ctx, const void *data, size_t len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    size_t avail;
+
+    assert(ctx);
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->base.uring_fed);
+
+    if (len == 0)
+    {
+        tcp_io_ctx->in_eof = TRUE;
+        return 0;
+    }
+
+    if (!tcp_io_ctx->in_buf &&
+        !(tcp_io_ctx->in_buf = (char *) malloc(TCP_INPUT_BUF_SIZE)))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* move any partial frame to the front */
+    avail = tcp_io_ctx->in_end - tcp_io_ctx->in_start;
+    if (avail > 0 && tcp_io_ctx->in_start > 0)
+        memmove(tcp_io_ctx->in_buf, tcp_io_ctx->in_buf + tcp_io_ctx->in_start,
+                avail);
+    tcp_io_ctx->in_start = 0;
+    tcp_io_ctx->in_end   = avail;
+
+    if (len > tcp_io_ctx->in_size - avail)
+    {
+        size_t size = tcp_io_ctx->in_size;
+        char *in_buf;
+
+        while (len > size - avail)
+            size *= 2;
+        if (!(in_buf = (char *) realloc(tcp_io_ctx->in_buf, size)))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        tcp_io_ctx->in_buf  = in_buf;
+        tcp_io_ctx->in_size = size;
+    }
+
+    memcpy(tcp_io_ctx->in_buf + avail, data, len);
+    tcp_io_ctx->in_end += len;
+    return 0;
+}
+
+bool_t _network_input_pending(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    return tcp_io_ctx->in_end > tcp_io_ctx->in_start;
+}
+
+/* read a packet from the peer, or on a listener, a new connection's SYN.
+ * this doesn't block; it returns -1 with errno set to EAGAIN once there is
+ * no complete packet left to return.
+ */
 ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
+    tcp_pending_syn_t *pending, **link;
+    ssize_t rc = 0;
 
     assert(ctx && dst);
 
@@ -174,70 +418,295 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
     assert(tcp_io_ctx->sock_ctx);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
     if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
         return -1;
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+    if (!tcp_io_ctx->sock_ctx->listening)
+        return _tcp_read_frame(ctx, dst, max_len);
+
+    /* a SYN passed up last time that no new context took (e.g. the
+     * backlog was full) is finished with
+     */
+    if (tcp_io_ctx->new_socket != -1)
     {
-        socket_t tmp_sd;
+        closesocket(tcp_io_ctx->new_socket);
+        tcp_io_ctx->new_socket = -1;
+    }
 
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
+    if (_tcp_accept(ctx) < 0)
+        return -1;
+
+    /* pass up the first SYN that has arrived in full, dropping any
+     * connection that has failed or closed first
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
+    for (link = &tcp_io_ctx->pending; (pending = *link) != NULL; )
+    {
+        if ((rc = _tcp_read_syn(pending, max_len)) < 0 && errno == EAGAIN)
         {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
+            link = &pending->next;
+            continue;
         }
 
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+        *link = pending->next;
+        (void) epoll_ctl(tcp_io_ctx->base.epfd, EPOLL_CTL_DEL,
+                         pending->sd, NULL);
+
+        /* the new context's socket blocks, as an active one does */
+        if (rc <= 0 || _tcp_set_blocking(pending->sd, TRUE) < 0)
+        {
+            DEBUG_LOG(("dropping connection before SYN: %d\n", (int) rc));
+            closesocket(pending->sd);
+            free(pending);
+            continue;
+        }
 
-        /* keep listening socket open for futher connection requests */
         /* we will not reenter this function until this SYN packet has
          * been dispatched to the right context, and that context's
          * socket updated to be 'new_socket'
          */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+        tcp_io_ctx->new_socket = pending->sd;
+        ctx->peer_addr         = pending->peer_addr;
+        ctx->peer_addr_len     = pending->peer_addr_len;
+        memcpy(dst, pending->frame + sizeof(uint16_t), rc);
+        break;
     }
+    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
 
-    DEBUG_PEER(ctx);
-
-#ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    if (!pending)
     {
-        DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
+        errno = EAGAIN;
         return -1;
     }
-#endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
+    free(pending);
+    DEBUG_PEER(ctx);
+    return rc;
+}
+
+/* accept every connection waiting on a listening socket.  each is watched
+ * by the reactor, without blocking, until its SYN has arrived.  returns -1
+ * only if the listening socket itself has failed.
+ */
+static int _tcp_accept(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_pending_syn_t *pending, **link;
+    struct sockaddr peer_addr;
+    socklen_t peer_addr_len;
+    struct epoll_event ev;
+    socket_t tmp_sd;
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->base.registered);
+
+    for (;;)
     {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
+        peer_addr_len = sizeof(peer_addr);
+        if ((tmp_sd = accept(GET_SOCKET(ctx),
+                             &peer_addr, &peer_addr_len)) < 0)
+        {
+            int err = errno;
+
+            if (err == EINTR)
+                continue;
+            if (err == EAGAIN || err == EWOULDBLOCK)
+                return 0;
+
+            /* a connection that failed (or that we've no descriptor for)
+             * doesn't stop the listener
+             */
+            perror("accept (network_io_tcp)");
+            errno = err;
+            return _network_accept_fatal(err) ? -1 : 0;
+        }
+
+        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+
+        if (!(pending = (tcp_pending_syn_t *) malloc(sizeof(*pending))) ||
+            _tcp_set_blocking(tmp_sd, FALSE) < 0)
+        {
+            closesocket(tmp_sd);
+            free(pending);
+            continue;
+        }
+
+        _tcp_set_nodelay(tmp_sd);
+        pending->sd            = tmp_sd;
+        pending->peer_addr     = peer_addr;
+        pending->peer_addr_len = peer_addr_len;
+        pending->len           = 0;
+        pending->next          = NULL;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = tcp_io_ctx->sock_ctx;
+
+        /* once input has been stopped, the reactor mustn't hear of it */
+        PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
+        if (tcp_io_ctx->pending_released ||
+            epoll_ctl(tcp_io_ctx->base.epfd, EPOLL_CTL_ADD, tmp_sd, &ev) < 0)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+            closesocket(tmp_sd);
+            free(pending);
+            continue;
+        }
+
+        /* SYNs are passed up in the order their connections arrived */
+        for (link = &tcp_io_ctx->pending; *link; link = &(*link)->next)
+            ;
+        *link = pending;
+        PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
     }
+}
+
+/* read what has arrived of an accepted connection's SYN, without blocking.
+ * returns the SYN's length once it's all there, or -1 with errno set to
+ * EAGAIN until then.  0 (or -1 with some other errno) means the connection
+ * is no good.
+ */
+static ssize_t _tcp_read_syn(tcp_pending_syn_t *pending, size_t max_len)
+{
+    assert(pending && max_len <= MAX_IP_PAYLOAD_LEN);
 
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    for (;;)
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        size_t want = sizeof(uint16_t);
+        ssize_t rc;
+
+        if (pending->len >= sizeof(uint16_t))
+        {
+            uint16_t packet_len;
+
+            memcpy(&packet_len, pending->frame, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (packet_len == 0 || packet_len > max_len)
+            {
+                DEBUG_LOG(("bad SYN length %u\n", packet_len));
+                errno = EPROTO;
+                return -1;
+            }
+
+            if (pending->len == sizeof(packet_len) + packet_len)
+                return packet_len;
+            want += packet_len;
+        }
+
+        if ((rc = read(pending->sd, pending->frame + pending->len,
+                       want - pending->len)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0 && errno == EWOULDBLOCK)
+                errno = EAGAIN;
+            return rc;
+        }
+        pending->len += rc;
     }
+}
 
-    if (packet_len > max_len)
+/* return the next complete frame from the connection's input buffer,
+ * reading more from the socket (without blocking) if need be.  frames
+ * larger than max_len are dropped.  returns -1 with errno set to EAGAIN if
+ * no complete frame has arrived; as a read that doesn't fill the buffer
+ * has emptied the socket, we don't try another read straight after one.
+ * if the io_uring reactor reads the socket for us, we only parse.
+ */
+static ssize_t _tcp_read_frame(network_context_t *ctx,
+                               void *dst, size_t max_len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && dst);
+
+    if (!tcp_io_ctx->in_buf &&
+        !(tcp_io_ctx->in_buf = (char *) malloc(TCP_INPUT_BUF_SIZE)))
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        errno = ENOMEM;
+        return -1;
     }
 
-    return packet_len;
-}
+    for (;;)
+    {
+        char *in = tcp_io_ctx->in_buf + tcp_io_ctx->in_start;
+        size_t avail = tcp_io_ctx->in_end - tcp_io_ctx->in_start;
+        size_t space;
+        ssize_t rc;
+
+        if (tcp_io_ctx->in_skip > 0)
+        {
+            size_t n = MIN(tcp_io_ctx->in_skip, avail);
+
+            tcp_io_ctx->in_skip  -= n;
+            tcp_io_ctx->in_start += n;
+            in    += n;
+            avail -= n;
+        }
+
+        if (tcp_io_ctx->in_skip == 0 && avail >= sizeof(uint16_t))
+        {
+            uint16_t packet_len;
+
+            memcpy(&packet_len, in, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+
+            if (packet_len > max_len)
+            {
+                DEBUG_LOG(("dropping %u byte packet\n", packet_len));
+                tcp_io_ctx->in_start += sizeof(packet_len);
+                tcp_io_ctx->in_skip   = packet_len;
+                continue;
+            }
+
+            if (avail >= sizeof(packet_len) + packet_len)
+            {
+                memcpy(dst, in + sizeof(packet_len), packet_len);
+                tcp_io_ctx->in_start += sizeof(packet_len) + packet_len;
+                return packet_len;
+            }
+        }
+
+        /* need more input */
+        if (tcp_io_ctx->base.uring_fed)
+        {
+            /* that arrives through _network_feed_input() */
+            if (tcp_io_ctx->in_eof)
+                return 0;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (tcp_io_ctx->in_drained)
+        {
+            tcp_io_ctx->in_drained = FALSE;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        /* move any partial frame to the front */
+        if (avail > 0 && tcp_io_ctx->in_start > 0)
+            memmove(tcp_io_ctx->in_buf, in, avail);
+        tcp_io_ctx->in_start = 0;
+        tcp_io_ctx->in_end   = avail;
+
+        space = TCP_INPUT_BUF_SIZE - tcp_io_ctx->in_end;
+        assert(space > 0);
+        if ((rc = recv(GET_SOCKET(ctx), tcp_io_ctx->in_buf + tcp_io_ctx->in_end,
+                       space, MSG_DONTWAIT)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            DEBUG_LOG(("_tcp_read_frame rc: %d\n", (int) rc));
+            return rc;
+        }
 
+        tcp_io_ctx->in_end    += rc;
+        tcp_io_ctx->in_drained = ((size_t) rc < space);
+    }
+}
 
 /* read/write count bytes into/from buf */
 static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
@@ -264,6 +733,39 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write out the whole of the given iovec, which is modified in the
+ * process.  returns the last writev() result on failure.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = writev(tcp_sd, iov, iovcnt)) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return rc;
+        }
+
+        /* skip over whatever was written */
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 1;
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -273,6 +775,12 @@ static int _tcp_connect(network_context_t *ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
+    /* every send and receive comes through here, so once connected, the
+     * lock is left alone
+     */
+    if (__atomic_load_n(&tcp_io_ctx->connected, __ATOMIC_ACQUIRE))
+        return 0;
+
     PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
     if (!tcp_io_ctx->connected)
     {
@@ -291,10 +799,60 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
-        tcp_io_ctx->connected = TRUE;
+        _tcp_set_nodelay(GET_SOCKET(ctx));
+        __atomic_store_n(&tcp_io_ctx->connected, TRUE, __ATOMIC_RELEASE);
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
 
     return 0;
 }
 
+/* every frame is written whole (or gathered by the cork buffer), so
+ * Nagle's algorithm would only hold back the last one of a burst waiting
+ * for an ACK that STCP itself may be waiting on.
+ */
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int one = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+    {
+        DEBUG_LOG(("TCP_NODELAY failed on %d (errno=%d)\n",
+                   (int) tcp_sd, errno));
+    }
+}
+
+static int _tcp_set_blocking(socket_t tcp_sd, bool_t blocking)
+{
+    int flags;
+
+    if ((flags = fcntl(tcp_sd, F_GETFL)) < 0)
+        return -1;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(tcp_sd, F_SETFL, flags);
+}
+
+/* write out the frames held back while corked.  they are discarded if
+ * this fails, just as a failed write would lose them uncorked.
+ */
+static int _tcp_flush(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    struct iovec iov;
+    int rc;
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    if (tcp_io_ctx->out_len == 0)
+        return 0;
+
+    iov.iov_base = tcp_io_ctx->out_buf;
+    iov.iov_len  = tcp_io_ctx->out_len;
+    tcp_io_ctx->out_len = 0;
+
+    if ((rc = _tcp_writev(GET_SOCKET(ctx), &iov, 1)) <= 0)
+        return -1;
+    return 0;
+}
+
@@ -0,0 +1,556 @@
+/* network_io_udp.c: UDP instantiation of the underlying
+ * datagram service.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "mysock_impl.h"
+#include "mysock_hash.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* most datagrams read by one recvmmsg(), or held back for one sendmmsg() */
+#define UDP_BATCH   32
+
+/* receive buffer asked for on a listening socket.  STCP doesn't
+ * retransmit, so anything the kernel drops for want of room here is lost
+ * for good; a burst of SYNs easily overruns the default.  the kernel caps
+ * this at net.core.rmem_max.
+ */
+#define UDP_LISTEN_RCVBUF   (4 << 20)
+
+/* datagrams for recvmmsg()/sendmmsg() */
+struct udp_batch
+{
+    struct mmsghdr     msgs[UDP_BATCH];
+    struct iovec       iov[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char               data[UDP_BATCH][MAX_IP_PAYLOAD_LEN];
+};
+
+static struct udp_batch *_udp_batch_alloc(void);
+static int _udp_send_batch(network_context_t *ctx);
+static void _udp_set_msg(struct udp_batch *batch, int k,
+                         network_context_socket_udp_t *udp_io_ctx,
+                         network_context_t *ctx, size_t len);
+
+
+/* a few words about the UDP network layer...
+ *
+ * each STCP segment is sent as a single datagram.  an active mysocket has
+ * a UDP socket of its own, connect()ed to the peer.  a listening mysocket
+ * has a single UDP socket on which all its connections' segments arrive;
+ * the connections it accepts send from (a duplicate of) that same socket,
+ * and are found for each incoming segment through udp_peer_table, keyed
+ * by the peer's address.  segments from peers not in the table are SYNs
+ * (or strays), and are passed on to the SYN demultiplexer.  this means
+ * that once a listening mysocket is closed, the connections it accepted
+ * no longer receive anything.
+ *
+ * unlike the TCP version, there is no kernel connection state behind a
+ * mysocket, and one lost or late segment doesn't hold up the rest of a
+ * listener's connections.
+ */
+typedef struct
+{
+    const network_context_t *listener;
+    uint32_t                 addr;  /* network byte order */
+    uint16_t                 port;  /* network byte order */
+} udp_peer_key_t;
+
+static INLINE bool_t _udp_peer_equal(udp_peer_key_t a, udp_peer_key_t b)
+{
+    return a.listener == b.listener && a.addr == b.addr && a.port == b.port;
+}
+
+static INLINE unsigned int _udp_peer_hash(udp_peer_key_t key,
+                                          unsigned int size)
+{
+    return (unsigned int) ((key.addr ^ (key.port * 2654435761U) ^
+                            (unsigned long) key.listener) % size);
+}
+
+#define UDP_PEER_TABLE_INITIAL_SIZE 64
+
+HASH_TABLE_DECLARE_EXTENDED(udp_peer_table, udp_peer_key_t,
+                            mysock_context_t *, _udp_peer_hash,
+                            _udp_peer_equal, UDP_PEER_TABLE_INITIAL_SIZE);
+static pthread_rwlock_t udp_peer_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static udp_peer_key_t _udp_peer_key(const network_context_t *listener,
+                                    const struct sockaddr_in *peer)
+{
+    udp_peer_key_t key;
+
+    memset(&key, 0, sizeof(key));
+    key.listener = listener;
+    key.addr     = peer->sin_addr.s_addr;
+    key.port     = peer->sin_port;
+    return key;
+}
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_DGRAM,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    /* the rest was zeroed by _network_init_socket() */
+    udp_io_ctx->sock_ctx = sock_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+    assert(!udp_io_ctx->listen_ctx);    /* see _network_release_recv() */
+
+    (void) _network_flush(ctx);
+    free(udp_io_ctx->in);
+    free(udp_io_ctx->out);
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* a datagram socket has no backlog of its own; the SYN demultiplexer
+ * keeps that.  the listening socket carries every connection's input,
+ * though, so it gets a bigger receive buffer.
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    int rcvbuf = UDP_LISTEN_RCVBUF;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    if (setsockopt(GET_SOCKET(ctx), SOL_SOCKET, SO_RCVBUF,
+                   &rcvbuf, sizeof(rcvbuf)) < 0)
+        perror("setsockopt(SO_RCVBUF) (network_io_udp)");
+    return 0;
+}
+
+/* a connection accepted on a listening socket sends from the listener's
+ * socket, and gets its input through the listener.
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_udp_t *new_udp_ctx;
+    udp_peer_key_t key;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr_valid);
+    assert(new_ctx->peer_addr.sa_family == AF_INET);
+
+    new_udp_ctx = (network_context_socket_udp_t *) new_ctx->impl_data;
+    assert(new_udp_ctx && !new_udp_ctx->sock_ctx->listening);
+    assert(new_udp_ctx->base.socket < 0);
+
+    VERIFY_SOCKET(accept_ctx);
+    if ((new_udp_ctx->base.socket = dup(GET_SOCKET(accept_ctx))) < 0)
+    {
+        /* sends will fail, and the connection with them */
+        perror("dup (network_io_udp)");
+    }
+    new_udp_ctx->listen_ctx = accept_ctx;
+
+    /* we're on the thread reading the listener's socket, so nothing for
+     * this peer can be looked up before it's in the table.
+     */
+    key = _udp_peer_key(accept_ctx, (struct sockaddr_in *) &new_ctx->peer_addr);
+    PTHREAD_CALL(pthread_rwlock_wrlock(&udp_peer_lock));
+    HASH_SET_ENTRY(udp_peer_table, key, new_udp_ctx->sock_ctx);
+    PTHREAD_CALL(pthread_rwlock_unlock(&udp_peer_lock));
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send the packet gathered from the given iovec to the peer, as a single
+ * datagram.  while corked, it is copied into the batch that
+ * _network_flush() sends with one sendmmsg() instead.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    struct msghdr msg;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= NETWORK_MAX_IOV);
+    assert(ctx->peer_addr_len > 0);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
+    if (udp_io_ctx->corked)
+    {
+        struct udp_batch *out;
+        char *dst;
+
+        if (!udp_io_ctx->out && !(udp_io_ctx->out = _udp_batch_alloc()))
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (udp_io_ctx->out_count == UDP_BATCH && _udp_send_batch(ctx) < 0)
+            return -1;
+
+        out = udp_io_ctx->out;
+        dst = out->data[udp_io_ctx->out_count];
+        for (k = 0; k < iovcnt; ++k)
+        {
+            memcpy(dst, iov[k].iov_base, iov[k].iov_len);
+            dst += iov[k].iov_len;
+        }
+        _udp_set_msg(out, udp_io_ctx->out_count++, udp_io_ctx, ctx, len);
+        return len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    if (udp_io_ctx->listen_ctx)
+    {
+        /* sending from the listener's (unconnected) socket */
+        msg.msg_name    = &ctx->peer_addr;
+        msg.msg_namelen = ctx->peer_addr_len;
+    }
+
+    if (sendmsg(GET_SOCKET(ctx), &msg, 0) < 0)
+    {
+        DEBUG_LOG(("sendmsg (network_io_udp) failed, errno=%d\n", errno));
+        return -1;
+    }
+
+    return len;
+}
+
+void _network_cork(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->corked = TRUE;
+}
+
+int _network_flush(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->corked = FALSE;
+    return _udp_send_batch(ctx);
+}
+
+/* connect an active socket to its peer, so that only the peer's datagrams
+ * are received on it.  a passive connection's input arrives through its
+ * listener, so it has nothing to register.
+ */
+int _network_prepare_recv(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx && udp_io_ctx->sock_ctx);
+
+    if (udp_io_ctx->listen_ctx)
+        return 1;
+
+    if (udp_io_ctx->sock_ctx->is_active)
+    {
+        assert(ctx->peer_addr_valid);
+        VERIFY_SOCKET(ctx);
+
+        if (connect(GET_SOCKET(ctx), &ctx->peer_addr, ctx->peer_addr_len) < 0)
+        {
+            perror("connect (network_io_udp)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* a passive connection is taken out of its listener's table, after which
+ * the thread reading the listener's socket can't be touching it.
+ */
+void _network_release_recv(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    udp_peer_key_t key;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    if (!udp_io_ctx->listen_ctx)
+        return;
+
+    key = _udp_peer_key(udp_io_ctx->listen_ctx,
+                        (struct sockaddr_in *) &ctx->peer_addr);
+    PTHREAD_CALL(pthread_rwlock_wrlock(&udp_peer_lock));
+    if (HASH_LOOKUP_PTR(udp_peer_table, key) == udp_io_ctx->sock_ctx)
+        HASH_DELETE(udp_peer_table, key);
+    PTHREAD_CALL(pthread_rwlock_unlock(&udp_peer_lock));
+
+    udp_io_ctx->listen_ctx = NULL;
+}
+
+/* datagram sockets are only ever polled by the io_uring reactor, never
+ * read by it, so there is nothing to feed.
+ */
+int _network_feed_input(network_context_t *ctx, const void *data, size_t len)
+{
+    assert(0);
+    errno = EINVAL;
+    return -1;
+}
+
+bool_t _network_input_pending(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    return udp_io_ctx->in_next < udp_io_ctx->in_count;
+}
+
+/* read a packet from the peer, without blocking.  datagrams are read a
+ * batch at a time with recvmmsg(), and handed out one per call; -1 is
+ * returned with errno set to EAGAIN once there are none left.  on a
+ * listening socket, datagrams from its connections' peers are queued for
+ * those connections here, so only the rest are returned, with peer_addr
+ * set to their source.
+ */
+ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    bool_t listening;
+
+    assert(ctx && dst);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx && udp_io_ctx->sock_ctx);
+    assert(!udp_io_ctx->listen_ctx);
+
+    VERIFY_SOCKET(ctx);
+    listening = udp_io_ctx->sock_ctx->listening;
+
+    if (!udp_io_ctx->in && !(udp_io_ctx->in = _udp_batch_alloc()))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (;;)
+    {
+        struct udp_batch *in = udp_io_ctx->in;
+        int n;
+
+        while (udp_io_ctx->in_next < udp_io_ctx->in_count)
+        {
+            int k = udp_io_ctx->in_next++;
+            size_t len = in->msgs[k].msg_len;
+            mysock_context_t *conn = NULL;
+
+            /* an empty datagram would look like an error to our caller */
+            if (len == 0 || len > max_len ||
+                (in->msgs[k].msg_hdr.msg_flags & MSG_TRUNC))
+            {
+                DEBUG_LOG(("dropping %u byte datagram\n", (unsigned) len));
+                continue;
+            }
+
+            if (listening)
+            {
+                udp_peer_key_t key = _udp_peer_key(ctx, &in->addrs[k]);
+
+                /* the connection can't go away while we hold the lock;
+                 * see _network_release_recv().  we can't wait for room in
+                 * its ring without holding up every other connection on
+                 * this socket, so if it's full, the datagram is lost, as
+                 * it would be if the socket's own buffer had overflowed.
+                 */
+                PTHREAD_CALL(pthread_rwlock_rdlock(&udp_peer_lock));
+                if ((conn = HASH_LOOKUP_PTR(udp_peer_table, key)) != NULL)
+                {
+                    if (_mysock_ring_full(&conn->network_recv_queue))
+                    {
+                        DEBUG_LOG(("dropping datagram for a full ring\n"));
+                    }
+                    else if (_mysock_segment_ok(conn, NULL,
+                                                in->data[k], len))
+                    {
+                        _mysock_ring_push(conn, &conn->network_recv_queue,
+                                          _mysock_buf_copy(in->data[k], len));
+                    }
+                }
+                PTHREAD_CALL(pthread_rwlock_unlock(&udp_peer_lock));
+
+                if (conn)
+                    continue;
+
+                memcpy(&ctx->peer_addr, &in->addrs[k], sizeof(in->addrs[k]));
+                ctx->peer_addr_len = sizeof(in->addrs[k]);
+            }
+
+            memcpy(dst, in->data[k], len);
+            return len;
+        }
+
+        /* a short batch means the socket was emptied */
+        if (udp_io_ctx->in_drained)
+        {
+            udp_io_ctx->in_drained = FALSE;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        for (n = 0; n < UDP_BATCH; ++n)
+        {
+            in->iov[n].iov_base = in->data[n];
+            in->iov[n].iov_len  = sizeof(in->data[n]);
+
+            memset(&in->msgs[n].msg_hdr, 0, sizeof(in->msgs[n].msg_hdr));
+            in->msgs[n].msg_hdr.msg_iov     = &in->iov[n];
+            in->msgs[n].msg_hdr.msg_iovlen  = 1;
+            in->msgs[n].msg_hdr.msg_name    = &in->addrs[n];
+            in->msgs[n].msg_hdr.msg_namelen = sizeof(in->addrs[n]);
+        }
+
+        udp_io_ctx->in_next = udp_io_ctx->in_count = 0;
+        if ((n = recvmmsg(GET_SOCKET(ctx), in->msgs, UDP_BATCH,
+                          MSG_DONTWAIT, NULL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            DEBUG_LOG(("recvmmsg (network_io_udp) failed, errno=%d\n",
+                       errno));
+            return -1;
+        }
+
+        udp_io_ctx->in_count   = n;
+        udp_io_ctx->in_drained = (n < UDP_BATCH);
+    }
+}
+
+
+static struct udp_batch *_udp_batch_alloc(void)
+{
+    return (struct udp_batch *) malloc(sizeof(struct udp_batch));
+}
+
+/* fill in the k'th message of an outgoing batch, of len bytes */
+static void _udp_set_msg(struct udp_batch *batch, int k,
+                         network_context_socket_udp_t *udp_io_ctx,
+                         network_context_t *ctx, size_t len)
+{
+    batch->iov[k].iov_base = batch->data[k];
+    batch->iov[k].iov_len  = len;
+
+    memset(&batch->msgs[k], 0, sizeof(batch->msgs[k]));
+    batch->msgs[k].msg_hdr.msg_iov    = &batch->iov[k];
+    batch->msgs[k].msg_hdr.msg_iovlen = 1;
+    if (udp_io_ctx->listen_ctx)
+    {
+        batch->msgs[k].msg_hdr.msg_name    = &ctx->peer_addr;
+        batch->msgs[k].msg_hdr.msg_namelen = ctx->peer_addr_len;
+    }
+}
+
+/* send the datagrams held back while corked.  any that can't be sent are
+ * discarded, just as a failed send would lose them uncorked.
+ */
+static int _udp_send_batch(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int sent = 0;
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    while (sent < udp_io_ctx->out_count)
+    {
+        int rc;
+
+        if ((rc = sendmmsg(GET_SOCKET(ctx), udp_io_ctx->out->msgs + sent,
+                           udp_io_ctx->out_count - sent, 0)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            DEBUG_LOG(("sendmmsg (network_io_udp) failed, errno=%d\n",
+                       errno));
+            udp_io_ctx->out_count = 0;
+            return -1;
+        }
+        sent += rc;
+    }
+
+    udp_io_ctx->out_count = 0;
+    return 0;
+}
@@ -0,0 +1,653 @@
+/* io_uring version of the network reactor (see network_io_socket.c).
+ *
+ * with MYSOCK_IO_URING set, mysockets that would otherwise be watched by the
+ * epoll reactor have their input driven by a single io_uring instead; only
+ * listeners stay with the reactor.  a connected stream socket gets a
+ * multishot recv, which picks its buffers from a ring of provided buffers
+ * registered with the kernel; the bytes are handed to the backend with
+ * _network_feed_input(), so it never reads the socket itself.  a datagram
+ * socket gets a multishot poll, and is read by _network_handle_input() as
+ * usual once it is readable.
+ *
+ * the buffers are registered as a ring where the kernel supports it, or
+ * else provided to it with IORING_OP_PROVIDE_BUFFERS; a recv on a socket
+ * pair tells us which of these works (see _uring_choose_bufs()).  if
+ * neither does, every socket is polled instead.  if the ring can't be set
+ * up at all, everything stays with the epoll reactor.
+ *
+ * the ring is set up without liburing, so we drive the submission and
+ * completion queues by hand.  submissions may come from any thread and are
+ * serialized by uring_lock; completions are only reaped by the uring thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+#define URING_SQ_ENTRIES    256
+#define URING_CQ_ENTRIES    4096
+#define URING_BUF_COUNT     256     /* provided buffers; a power of two */
+#define URING_BUF_SIZE      16384
+#define URING_BUF_GROUP     0
+
+#if (URING_BUF_COUNT & (URING_BUF_COUNT - 1)) != 0
+    #error URING_BUF_COUNT should be a power of two
+#endif
+
+/* each request's user_data is the mysock_context_t it's for (which is
+ * suitably aligned), tagged in the low bits with the kind of request.
+ * requests that aren't tied to a context have completions we ignore.
+ */
+#define URING_TAG_RECV      0
+#define URING_TAG_POLL      1
+#define URING_TAG_NONE      2
+#define URING_TAG_PROBE     3   /* see _uring_probe_recv() */
+#define URING_TAG_RESUME    4   /* see _network_uring_resume() */
+#define URING_TAG_MASK      7
+
+/* how the kernel is given recv buffers */
+#define URING_BUFS_NONE     0   /* it isn't; sockets are polled */
+#define URING_BUFS_RING     1   /* registered buffer ring */
+#define URING_BUFS_PROVIDED 2   /* IORING_OP_PROVIDE_BUFFERS */
+
+#define URING_CTX(user_data) \
+    ((mysock_context_t *) (uintptr_t) ((user_data) & ~(__u64) URING_TAG_MASK))
+
+
+static struct
+{
+    int                  fd;
+
+    /* submission queue; protected by uring_lock */
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_entries;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* completion queue; only touched by the uring thread */
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffers; handed back only by the uring thread */
+    int                       buf_mode;
+    struct io_uring_buf_ring *buf_ring;
+    char                     *bufs;
+    unsigned short            buf_tail;
+} uring;
+
+static bool_t          uring_ok;
+static pthread_once_t  uring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  uring_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void _uring_init(void);
+static int _uring_setup(void);
+static void _uring_choose_bufs(void);
+static bool_t _uring_probe_recv(void);
+static void _uring_add_buf(unsigned short bid);
+static void _uring_arm(mysock_context_t *ctx);
+static void _uring_cancel(mysock_context_t *ctx);
+static void _uring_submit(const struct io_uring_sqe *sqe);
+static void _uring_complete(const struct io_uring_cqe *cqe);
+static void *uring_thread_func(void *arg_ptr);
+
+
+/* TRUE if mysocket input should go through the io_uring reactor */
+bool_t _network_uring_enabled(void)
+{
+    PTHREAD_CALL(pthread_once(&uring_once, _uring_init));
+    return uring_ok;
+}
+
+/* start watching the given mysocket's socket */
+void _network_uring_start(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(uring_ok && net_ctx && !net_ctx->uring_armed);
+
+    net_ctx->uring_fed = (net_ctx->type == SOCK_STREAM && !ctx->listening &&
+                          uring.buf_mode != URING_BUFS_NONE);
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    net_ctx->uring_stopping = FALSE;
+    net_ctx->uring_paused   = FALSE;
+    _uring_arm(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+}
+
+/* ask for the given mysocket's request to be cancelled, without waiting
+ * for it to go.  it isn't rearmed after this.
+ */
+void _network_uring_cancel(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    if (net_ctx->uring_armed && !net_ctx->uring_stopping)
+        _uring_cancel(ctx);
+    net_ctx->uring_stopping = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+}
+
+/* stop reading the given mysocket's socket while its network receive ring
+ * is full; called by the uring thread.  completions already on their way
+ * are still handed to the backend.
+ */
+void _network_uring_pause(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    if (!net_ctx->uring_paused && !net_ctx->uring_stopping)
+    {
+        net_ctx->uring_paused = TRUE;
+        if (net_ctx->uring_armed)
+            _uring_cancel(ctx);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+}
+
+/* start reading the given mysocket's socket again.  a request whose
+ * cancellation is still on its way is renewed when it completes.  input
+ * the backend already holds wouldn't be reported by the socket, so a no-op
+ * request has the uring thread handle it.
+ */
+void _network_uring_resume(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct io_uring_sqe sqe;
+
+    assert(net_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    net_ctx->uring_paused = FALSE;
+    if (!net_ctx->uring_stopping)
+    {
+        if (!net_ctx->uring_armed)
+            _uring_arm(ctx);
+
+        if (!net_ctx->uring_resuming)
+        {
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode    = IORING_OP_NOP;
+            sqe.fd        = -1;
+            sqe.user_data = (__u64) (uintptr_t) ctx | URING_TAG_RESUME;
+
+            net_ctx->uring_resuming = TRUE;
+            _uring_submit(&sqe);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+}
+
+/* stop watching the given mysocket's socket.  this doesn't return until
+ * the uring thread can no longer be touching the context.
+ */
+void _network_uring_stop(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    _network_uring_cancel(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    while (net_ctx->uring_armed || net_ctx->uring_resuming)
+        PTHREAD_CALL(pthread_cond_wait(&uring_cond, &uring_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+}
+
+
+/* set up the ring and start its thread, if asked for; called once */
+static void _uring_init(void)
+{
+    const char *env = getenv("MYSOCK_IO_URING");
+
+    if (!env || !atoi(env))
+        return;
+
+    if (_uring_setup() < 0)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n",
+                strerror(errno));
+        return;
+    }
+
+    uring_ok = TRUE;
+    (void) _mysock_create_thread(uring_thread_func, NULL, TRUE);
+}
+
+/* create the ring, map its queues, and set up the provided buffers.
+ * returns -1 with errno set if the kernel isn't up to it.
+ */
+static int _uring_setup(void)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq_ptr, *cq_ptr;
+    int saved_errno;
+
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    if ((uring.fd = (int) syscall(__NR_io_uring_setup,
+                                  URING_SQ_ENTRIES, &p)) < 0)
+        return -1;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+    sq_ptr = (char *) mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring.fd,
+                           IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else if ((cq_ptr = (char *) mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, uring.fd,
+                                     IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+
+    uring.sqes = (struct io_uring_sqe *)
+        mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+             IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED)
+        goto fail;
+
+    uring.sq_head    = (unsigned *) (sq_ptr + p.sq_off.head);
+    uring.sq_tail    = (unsigned *) (sq_ptr + p.sq_off.tail);
+    uring.sq_mask    = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    uring.sq_entries = (unsigned *) (sq_ptr + p.sq_off.ring_entries);
+    uring.sq_array   = (unsigned *) (sq_ptr + p.sq_off.array);
+    uring.cq_head    = (unsigned *) (cq_ptr + p.cq_off.head);
+    uring.cq_tail    = (unsigned *) (cq_ptr + p.cq_off.tail);
+    uring.cq_mask    = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    uring.cqes       = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+    if (!(uring.bufs = (char *) malloc(URING_BUF_COUNT * URING_BUF_SIZE)))
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    _uring_choose_bufs();
+    return 0;
+
+fail:
+    /* the mappings go with the process; there is only ever one attempt */
+    saved_errno = errno;
+    (void) close(uring.fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/* work out how to give the kernel its recv buffers, and give it them.
+ * a buffer ring (linux 5.19 and later) is preferred, as handing a buffer
+ * back is then just a store; otherwise each one takes a request.  some
+ * kernels accept the ring but never take buffers from it, so each way is
+ * tried out before it's used.
+ */
+static void _uring_choose_bufs(void)
+{
+    struct io_uring_buf_reg reg;
+    struct io_uring_sqe sqe;
+    unsigned k;
+
+    /* the buffer ring itself must be page aligned */
+    uring.buf_ring = (struct io_uring_buf_ring *)
+        mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (__u64) (uintptr_t) uring.buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid         = URING_BUF_GROUP;
+    if (uring.buf_ring != MAP_FAILED &&
+        syscall(__NR_io_uring_register, uring.fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) == 0)
+    {
+        uring.buf_mode = URING_BUFS_RING;
+        for (k = 0; k < URING_BUF_COUNT; ++k)
+            _uring_add_buf((unsigned short) k);
+        if (_uring_probe_recv())
+            return;
+
+        (void) syscall(__NR_io_uring_register, uring.fd,
+                       IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_PROVIDE_BUFFERS;
+    sqe.fd        = URING_BUF_COUNT;
+    sqe.addr      = (__u64) (uintptr_t) uring.bufs;
+    sqe.len       = URING_BUF_SIZE;
+    sqe.off       = 0;
+    sqe.buf_group = URING_BUF_GROUP;
+    sqe.user_data = URING_TAG_NONE;
+
+    uring.buf_mode = URING_BUFS_PROVIDED;
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    _uring_submit(&sqe);
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+    if (_uring_probe_recv())
+        return;
+
+    uring.buf_mode = URING_BUFS_NONE;
+}
+
+/* check that a multishot recv gets its data, by reading a byte from a
+ * socket pair.  this runs before the uring thread is started, so it reaps
+ * the completions itself.
+ */
+static bool_t _uring_probe_recv(void)
+{
+    struct io_uring_sqe sqe;
+    bool_t ok = FALSE, done = FALSE;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return FALSE;
+
+    /* one byte, then end of file, which ends the request */
+    if (write(sv[1], "", 1) != 1)
+        done = TRUE;
+    (void) close(sv[1]);
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_RECV;
+    sqe.fd        = sv[0];
+    sqe.ioprio    = IORING_RECV_MULTISHOT;
+    sqe.flags     = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = URING_BUF_GROUP;
+    sqe.user_data = URING_TAG_PROBE;
+
+    if (!done)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+        _uring_submit(&sqe);
+        PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+    }
+
+    while (!done)
+    {
+        unsigned head, tail;
+
+        if (syscall(__NR_io_uring_enter, uring.fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            break;
+
+        head = *uring.cq_head;
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+
+            __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+            if (cqe.user_data != URING_TAG_PROBE)
+                continue;
+
+            if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+            {
+                ok = TRUE;
+                _uring_add_buf((unsigned short)
+                               (cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                done = TRUE;
+        }
+    }
+
+    (void) close(sv[0]);
+    return ok;
+}
+
+/* give a provided buffer (back) to the kernel */
+static void _uring_add_buf(unsigned short bid)
+{
+    char *data = uring.bufs + bid * URING_BUF_SIZE;
+
+    if (uring.buf_mode == URING_BUFS_RING)
+    {
+        struct io_uring_buf *buf =
+            &uring.buf_ring->bufs[uring.buf_tail & (URING_BUF_COUNT - 1)];
+
+        buf->addr = (__u64) (uintptr_t) data;
+        buf->len  = URING_BUF_SIZE;
+        buf->bid  = bid;
+        __atomic_store_n(&uring.buf_ring->tail, ++uring.buf_tail,
+                         __ATOMIC_RELEASE);
+    }
+    else
+    {
+        struct io_uring_sqe sqe;
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode    = IORING_OP_PROVIDE_BUFFERS;
+        sqe.fd        = 1;
+        sqe.addr      = (__u64) (uintptr_t) data;
+        sqe.len       = URING_BUF_SIZE;
+        sqe.off       = bid;
+        sqe.buf_group = URING_BUF_GROUP;
+        sqe.user_data = URING_TAG_NONE;
+
+        PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+        _uring_submit(&sqe);
+        PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+    }
+}
+
+/* submit the multishot request for the given mysocket.  the caller holds
+ * uring_lock.
+ */
+static void _uring_arm(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = net_ctx->socket;
+    if (net_ctx->uring_fed)
+    {
+        sqe.opcode    = IORING_OP_RECV;
+        sqe.ioprio    = IORING_RECV_MULTISHOT;
+        sqe.flags     = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = URING_BUF_GROUP;
+        sqe.user_data = (__u64) (uintptr_t) ctx | URING_TAG_RECV;
+    }
+    else
+    {
+        sqe.opcode        = IORING_OP_POLL_ADD;
+        sqe.poll32_events = POLLIN;
+        sqe.len           = IORING_POLL_ADD_MULTI;
+        sqe.user_data     = (__u64) (uintptr_t) ctx | URING_TAG_POLL;
+    }
+
+    net_ctx->uring_armed = TRUE;
+    _uring_submit(&sqe);
+}
+
+/* ask for the given mysocket's request to be cancelled.  the caller holds
+ * uring_lock.
+ */
+static void _uring_cancel(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe.fd        = -1;
+    sqe.addr      = (__u64) (uintptr_t) ctx |
+                    (net_ctx->uring_fed ? URING_TAG_RECV : URING_TAG_POLL);
+    sqe.user_data = URING_TAG_NONE;
+    _uring_submit(&sqe);
+}
+
+/* queue the given request and tell the kernel about it.  the caller holds
+ * uring_lock.  the kernel consumes the whole submission queue on every
+ * io_uring_enter(), so there is always room.
+ */
+static void _uring_submit(const struct io_uring_sqe *sqe)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned idx;
+
+    assert(tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) <
+           *uring.sq_entries);
+
+    idx = tail & *uring.sq_mask;
+    uring.sqes[idx]     = *sqe;
+    uring.sq_array[idx] = idx;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, uring.fd, 1, 0, 0, NULL, 0) < 0)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            assert(0);
+            break;
+        }
+    }
+}
+
+/* deal with one completion */
+static void _uring_complete(const struct io_uring_cqe *cqe)
+{
+    mysock_context_t *ctx = URING_CTX(cqe->user_data);
+    network_context_socket_t *net_ctx;
+
+    if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_NONE ||
+        (cqe->user_data & URING_TAG_MASK) == URING_TAG_PROBE)
+        return;
+
+    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
+
+    if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_RESUME)
+    {
+        bool_t stopping;
+
+        assert(net_ctx && net_ctx->uring_resuming);
+        PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+        stopping = net_ctx->uring_stopping;
+        PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+
+        if (!stopping && !net_ctx->hung_up)
+            _network_handle_input(ctx);
+
+        PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+        net_ctx->uring_resuming = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&uring_cond));
+        return;
+    }
+
+    assert(net_ctx && net_ctx->uring_armed);
+
+    if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_RECV)
+    {
+        if (cqe->res > 0)
+        {
+            unsigned short bid =
+                (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+            assert(cqe->flags & IORING_CQE_F_BUFFER);
+            if (_network_feed_input(&ctx->network_state,
+                                    uring.bufs + bid * URING_BUF_SIZE,
+                                    cqe->res) < 0)
+                (void) _network_feed_input(&ctx->network_state, NULL, 0);
+            _uring_add_buf(bid);
+            _network_handle_input(ctx);
+        }
+        else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED &&
+                 !net_ctx->hung_up)
+        {
+            /* end of file, or an error */
+            (void) _network_feed_input(&ctx->network_state, NULL, 0);
+            _network_handle_input(ctx);
+        }
+    }
+    else if (cqe->res > 0 && !net_ctx->hung_up)
+    {
+        _network_handle_input(ctx);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    /* the request is finished.  a multishot request may end on its own
+     * (e.g. when it runs out of buffers), so it's renewed unless the socket
+     * is finished with, or paused (see _network_uring_pause()).
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&uring_lock));
+    net_ctx->uring_armed = FALSE;
+    if (!net_ctx->uring_stopping && !net_ctx->uring_paused &&
+        !net_ctx->hung_up &&
+        (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED))
+        _uring_arm(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&uring_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&uring_cond));
+}
+
+/* reap completions as they arrive; this takes the place of the epoll
+ * reactor's thread for the mysockets it watches.
+ */
+static void *uring_thread_func(void *arg_ptr)
+{
+    DEBUG_LOG(("started io_uring reactor\n"));
+
+    for (;;)
+    {
+        unsigned head, tail;
+
+        if (syscall(__NR_io_uring_enter, uring.fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            assert(errno == EINTR || errno == EBUSY);
+
+        head = *uring.cq_head;
+        tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            /* copy it out, so the slot can be reused while we're busy */
+            struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+
+            __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+            _uring_complete(&cqe);
+        }
+    }
+
+    return NULL;
+}
+
@@ -29,7 +29,7 @@
 static char usage[] = "usage: ./server [server port number] \n";
 
 static void do_connection(mysocket_t bindsd);
-static int get_nvt_line(int sd, char *);
+static int get_nvt_line(int sd, char *, size_t);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
 
@@ -117,7 +117,7 @@ static void do_connection(mysocket_t sd)
 
     for (;;)
     {
-        rc = get_nvt_line(sd, line);
+        rc = get_nvt_line(sd, line, sizeof(line));
         if (rc < 0 || !*line)
             goto done;
         fprintf(stderr, "client: %s\n", line);
@@ -147,38 +147,35 @@ done:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t line_len)
 {
-    char last_char;
-    char this_char;
+    size_t total;
     int len;
 
-    last_char = '\0';
-    for (;;)
+    for (total = 0; total < line_len - 1; )
     {
-        len = myread(sd, &this_char, sizeof(this_char));
+        /* pull in everything up to the next LF in one call */
+        len = myreadline(sd, line + total, line_len - 1 - total, '\n');
         if (len < 0)
             return -1;
 
         if (len == 0)
         {
             /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
+            break;
         }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-        if (last_char == '\r' && this_char == '\n')
+        total += len;
+
+        if (total >= 2 && line[total - 2] == '\r' && line[total - 1] == '\n')
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
+            /* Reached the end of line; drop the CRLF */
+            total -= 2;
+            break;
         }
-
-        *line++ = this_char;
-        last_char = this_char;
     }
-    return -1;
+
+    line[total] = '\0';
+    return 0;
 }
 
 /**********************************************************************/
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "stcp_api.h"
@@ -66,33 +67,38 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    for (;;)
-    {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
-            rc |= APP_DATA;
+    /* nothing may be left corked (or held back) while we wait on the peer */
+    (void) _network_send_flush(sd);
 
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
-            rc |= NETWORK_DATA;
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
 
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
-        {
-            /* we should only wake up on this event once.  also, we don't
-             * pass the close event down to STCP until we've already passed
-             * it all outstanding data from the app.
-             */
-            ctx->close_requested = FALSE;
-            rc |= APP_CLOSE_REQUESTED;
-        }
+    /* a transport layer running as a coroutine switches back to the
+     * shard instead of blocking (see mysock_coro.c)
+     */
+    if (_mysock_coro_running(ctx))
+    {
+        rc = _mysock_take_events(ctx, flags);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        return rc ? rc : _mysock_coro_wait(ctx, flags, abstime);
+    }
 
+    /* the network receive thread pushes packets without taking
+     * data_ready_lock, so announce that we're waiting before looking at the
+     * ring (see _mysock_ring_push()).
+     */
+    __atomic_store_n(&ctx->event_waiting, TRUE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        rc = _mysock_take_events(ctx, flags);
         if (rc)
             break;
 
+        /* only wakeups meant for the transport layer arrive here */
         if (abstime)
         {
             /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
+            switch (pthread_cond_timedwait(&ctx->event_cond,
                                            &ctx->data_ready_lock,
                                            abstime))
             {
@@ -115,17 +121,34 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
         else
         {
             /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+            PTHREAD_CALL(pthread_cond_wait(&ctx->event_cond,
                                            &ctx->data_ready_lock));
         }
     }
 
 done:
+    __atomic_store_n(&ctx->event_waiting, FALSE, __ATOMIC_RELAXED);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
     return rc;
 }
 
+/* event-driven counterpart to stcp_wait_for_event(); see stcp_api.h.  the
+ * worker pool (mysock_pool.c) picks these up when the connection is next
+ * parked.
+ */
+void stcp_set_wait(mysocket_t             sd,
+                   unsigned int           flags,
+                   const struct timespec *abstime)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    (void) _network_send_flush(sd);
+    ctx->wait_flags = flags;
+    if ((ctx->wait_timed = (abstime != NULL)) != FALSE)
+        ctx->wait_timer.deadline = *abstime;
+}
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -157,16 +180,89 @@ void *stcp_get_context(mysocket_t sd)
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
-    ssize_t len = _network_recv(sd, dst, max_len);
+    ssize_t len;
 
-    /* checksum should have been verified by underlying network layer in
-     * this implementation.
+    /* on a coroutine, yield rather than block */
+    _mysock_coro_block(_mysock_get_context(sd), NETWORK_DATA);
+    len = _network_recv(sd, dst, max_len);
+
+    /* the network layer has already dropped any segment with a bad
+     * checksum (see _mysock_segment_ok())
      */
-    assert(len <= 0 ||
-           _mysock_verify_checksum(_mysock_get_context(sd), dst, len));
+    if (len > 0)
+        _mysock_pcap_capture(_mysock_get_context(sd), FALSE, dst, len);
     return len;
 }
 
+/* stcp_network_recv_buf
+ *
+ * Receive a datagram from the peer by reference.  The call blocks until
+ * data is available; the caller owns the returned buffer handle.
+ */
+stcp_buf_t *stcp_network_recv_buf(mysocket_t sd)
+{
+    mysock_buf_t *packet;
+
+    _mysock_coro_block(_mysock_get_context(sd), NETWORK_DATA);
+    packet = _network_recv_buf(sd);
+
+    assert(packet);
+
+    if (packet->data_len > 0)
+    {
+        _mysock_pcap_capture(_mysock_get_context(sd), FALSE,
+                             packet->data, packet->data_len);
+    }
+    return packet;
+}
+
+void *stcp_buf_data(stcp_buf_t *buf)
+{
+    assert(buf);
+    return buf->data;
+}
+
+size_t stcp_buf_len(const stcp_buf_t *buf)
+{
+    assert(buf);
+    return buf->data_len;
+}
+
+void stcp_buf_pull(stcp_buf_t *buf, size_t len)
+{
+    _mysock_buf_pull(buf, len);
+}
+
+void stcp_buf_release(stcp_buf_t *buf)
+{
+    _mysock_buf_release(buf);
+}
+
+int stcp_get_option(mysocket_t sd, int option, int default_value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_get_option(ctx, option, default_value);
+}
+
+/* fill in fields in the TCP header that aren't handled by students */
+static void _stcp_fill_header(mysock_context_t *ctx, struct tcphdr *header)
+{
+    assert(ctx && header);
+
+    header->th_sport = _network_get_port(&ctx->network_state);
+    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+    header->th_dport =
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
+    assert(header->th_dport > 0);
+
+    header->th_sum = 0; /* set by caller */
+    header->th_urp = 0; /* ignored */
+}
+
 /* stcp_network_send()
  *
  * Send data to the peer.
@@ -211,23 +307,88 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     }
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
     assert(packet_len >= sizeof(struct tcphdr));
     header = (struct tcphdr *) packet;
+    _stcp_fill_header(ctx, header);
 
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+    _mysock_set_checksum(ctx, packet, packet_len);
+    _mysock_pcap_capture(ctx, TRUE, packet, packet_len);
+    return _network_send(sd, packet, packet_len);
+}
 
-    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-    header->th_dport =
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-    assert(header->th_dport > 0);
+ssize_t stcp_network_send_buf(mysocket_t sd,
+                              const void *header, size_t header_len,
+                              stcp_buf_t *buf, size_t offset, size_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    char              header_copy[MYSOCK_BUF_HEADROOM];
+    struct iovec      iov[2];
+    int               iovcnt;
+    bool_t            pushed = FALSE;
+    char             *hdr;
+    ssize_t           rc;
+
+    assert(ctx && header && buf);
+    assert(header_len >= sizeof(struct tcphdr));
+    assert(header_len <= sizeof(header_copy));
+    assert(offset + len <= buf->data_len);
+    assert(header_len + len <= MAX_IP_PAYLOAD_LEN);
+
+    if (offset == 0 && _mysock_buf_headroom(buf) >= header_len)
+    {
+        /* header and payload are contiguous.  the headroom in front of a
+         * buffer's data is never part of anyone else's data, so it's safe to
+         * scribble on it even though the buffer may be shared.
+         */
+        hdr = (char *) _mysock_buf_push(buf, header_len);
+        pushed = TRUE;
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len  = header_len + len;
+        iovcnt = 1;
+    }
+    else
+    {
+        /* the bytes in front of the payload are earlier data that may still
+         * be needed, so the header goes separately.
+         */
+        hdr = header_copy;
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len  = header_len;
+        iov[1].iov_base = buf->data + offset;
+        iov[1].iov_len  = len;
+        iovcnt = (len > 0) ? 2 : 1;
+    }
 
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
+    memcpy(hdr, header, header_len);
+    _stcp_fill_header(ctx, (struct tcphdr *) hdr);
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    _mysock_set_checksum_iov(ctx, iov, iovcnt);
+    _mysock_pcap_capturev(ctx, TRUE, iov, iovcnt);
+    rc = _network_sendv(sd, iov, iovcnt);
+
+    if (pushed)
+        _mysock_buf_pull(buf, header_len);
+    return rc;
+}
+
+/* hold back the segments sent from here on, until stcp_network_uncork() */
+void stcp_network_cork(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    _network_send_cork(sd);
+}
+
+/* send everything held back since stcp_network_cork() in one go */
+int stcp_network_uncork(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _network_send_flush(sd);
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -242,10 +403,20 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
      * passed down to the transport layer.  if it doesn't fit in the specified
      * buffer, any left over is kept for the next call to app_recv().
      */
+    _mysock_coro_block(ctx, APP_DATA);
     return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
                                   dst, max_len, TRUE);
 }
 
+stcp_buf_t *stcp_app_recv_buf(mysocket_t sd, size_t max_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+
+    _mysock_coro_block(ctx, APP_DATA);
+    return _mysock_dequeue_buf(ctx, &ctx->app_recv_queue, max_len);
+}
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
@@ -259,6 +430,23 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     }
 }
 
+/* pass a buffer up to the application by reference */
+void stcp_app_send_buf(mysocket_t sd, stcp_buf_t *buf)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && buf);
+    if (buf->data_len > 0)
+    {
+        DEBUG_LOG(("stcp_app_send_buf(%d):  sending %u bytes up to app\n",
+                   sd, buf->data_len));
+        _mysock_enqueue_buf(ctx, &ctx->app_send_queue, buf);
+    }
+    else
+    {
+        _mysock_buf_release(buf);
+    }
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
@@ -61,6 +61,17 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
                                  unsigned int           wait_flags,
                                  const struct timespec *abstime);
 
+/* used with transport_open()/transport_dispatch() (see transport.h) in
+ * place of stcp_wait_for_event():  instead of blocking, tell the mysocket
+ * layer which events, and which timeout (if abstime is non-NULL), to call
+ * transport_dispatch() for next.  the arguments mean the same as for
+ * stcp_wait_for_event(), which also returns the close event regardless of
+ * wait_flags.
+ */
+void stcp_set_wait(mysocket_t             sd,
+                   unsigned int           wait_flags,
+                   const struct timespec *abstime);
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -98,6 +109,85 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
+/* zero-copy buffer interface.  stcp_buf_t is an opaque handle to a packet
+ * buffer owned by the mysocket layer.  rather than copying a packet out of
+ * the network layer and then copying its payload up to the application,
+ * you may receive the packet by handle, strip its header with
+ * stcp_buf_pull(), and pass the same buffer on to the application with
+ * stcp_app_send_buf().  each handle you're given must eventually be
+ * passed on that way, or released with stcp_buf_release().
+ */
+typedef struct mysock_buf stcp_buf_t;
+
+/* like stcp_network_recv(), but returns a handle to the received packet
+ * rather than copying it.  blocks until a packet is available.  a
+ * zero-length packet indicates an error in the network layer.
+ */
+stcp_buf_t *stcp_network_recv_buf(mysocket_t sd);
+
+/* start and length of the valid data in a buffer */
+void *stcp_buf_data(stcp_buf_t *buf);
+size_t stcp_buf_len(const stcp_buf_t *buf);
+
+/* strip len bytes (e.g. the STCP header) from the start of a buffer */
+void stcp_buf_pull(stcp_buf_t *buf, size_t len);
+
+/* give up a buffer handle you no longer need */
+void stcp_buf_release(stcp_buf_t *buf);
+
+/* like stcp_app_send(), but passes the buffer's data up to the application
+ * by reference.  this takes over your handle to the buffer.
+ */
+void stcp_app_send_buf(mysocket_t sd, stcp_buf_t *buf);
+
+/* like stcp_app_recv(), but returns a handle to up to max_len bytes of the
+ * application's data rather than copying it.  mywrite() already splits
+ * the application's data into STCP_MSS-sized buffers, so with
+ * max_len == STCP_MSS you normally get a whole buffer.  keep the handle for
+ * as long as the data may need to be (re)sent, then release it.
+ */
+stcp_buf_t *stcp_app_recv_buf(mysocket_t sd, size_t max_len);
+
+/* send an STCP segment consisting of the given header followed by len
+ * bytes of a buffer's data, starting at offset.  the header is placed in
+ * the buffer's reserved headroom where possible, so that the payload is
+ * not copied; otherwise the two are handed to the network layer as an
+ * iovec.  the caller's handle to the buffer is unaffected.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_buf(mysocket_t sd,
+                              const void *header, size_t header_len,
+                              stcp_buf_t *buf, size_t offset, size_t len);
+
+/* the value of the given SOL_STCP option (see mysetsockopt() in mysock.h)
+ * for this mysocket, or default_value if the application hasn't set it.
+ * look options up when they're used, rather than once at transport_init(),
+ * as the application may change them at any time.
+ */
+int stcp_get_option(mysocket_t sd, int option, int default_value);
+
+/* defaults for the SOL_STCP options the transport layer implements, in
+ * effect until the application sets them.  mygetsockopt() reports these
+ * too, so they must match what the transport layer passes above.
+ */
+#define STCP_DEFAULT_RCVWND         3072    /* bytes */
+#define STCP_DEFAULT_ACK_DELAY      2       /* seconds an ACK is held back */
+#define STCP_DEFAULT_FIN_TIMEOUT    2       /* seconds */
+
+/* corking.  segments sent between stcp_network_cork() and
+ * stcp_network_uncork() are held back, and go out to the network together
+ * (in as few system calls as the network layer can manage) when the latter
+ * is called; use this around a burst of segments, e.g. when filling the
+ * peer's window.  a send while corked only fails if the network layer had
+ * to make room by sending what it was holding; stcp_network_uncork()
+ * returns -1 if the held-back segments couldn't be sent, or 0 otherwise.
+ * anything still corked is sent when the transport layer next waits for an
+ * event.
+ */
+void stcp_network_cork(mysocket_t sd);
+int stcp_network_uncork(mysocket_t sd);
+
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
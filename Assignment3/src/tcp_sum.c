@@ -1,8 +1,10 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include "mysock_impl.h"
 #include "transport.h"
 #include "tcp_sum.h"
@@ -15,6 +17,23 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               uint32_t dst_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/)
+{
+    struct iovec iov;
+
+    assert(packet);
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = len;
+    return _mysock_tcp_checksum_iov(src_addr, dst_addr, &iov, 1);
+}
+
+/* as above, for a segment gathered from an iovec.  the pieces may be any
+ * length and alignment; 16-bit words that straddle two pieces are summed
+ * just as if the segment were contiguous.
+ */
+uint16_t _mysock_tcp_checksum_iov(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov,
+                                  int iovcnt)
 {
     struct
     {
@@ -23,39 +42,81 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         uint8_t  zero;
         uint8_t  protocol;
         uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    } __attribute__ ((packed)) pseudo_header;
 
     unsigned int k;
-    int32_t sum = 0;
+    uint32_t sum = 0;
+    size_t len = 0, offset = 0;
+    uint8_t word[2];
+    bool_t odd = FALSE;
+    int i;
 
-    assert(packet && len >= sizeof(struct tcphdr));
-    assert(sizeof(pseudo_header) == 12);
+    assert(iov && iovcnt > 0);
+    for (i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
 
+    assert(len >= sizeof(struct tcphdr));
+    assert(sizeof(pseudo_header) == 12);
 
     assert(src_addr > 0);
     assert(dst_addr > 0);
 
+    pseudo_header.src_addr = src_addr;
+    pseudo_header.dst_addr = dst_addr;
+    pseudo_header.zero     = 0;
+    pseudo_header.protocol = IPPROTO_TCP;
+    pseudo_header.len      = htons(len);
+
     /* process 96-bit pseudo header */
     for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
         sum += ((uint16_t *) &pseudo_header)[k];
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
+    /* process TCP header and payload.  offset is the position in the
+     * segment of the next byte; a word is summed once both its bytes have
+     * been seen.
+     */
+    assert((offsetof(struct tcphdr, th_sum) & 1) == 0);
+    for (i = 0; i < iovcnt; ++i)
     {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
+        const uint8_t *p = (const uint8_t *) iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+
+        assert(p || !n);
+        if (odd && n > 0)
+        {
+            uint16_t tmp;
+
+            word[1] = *p++;
+            --n;
+            ++offset;
+            memcpy(&tmp, word, sizeof(tmp));
+            if (offset - 2 != offsetof(struct tcphdr, th_sum))
+                sum += tmp;
+            odd = FALSE;
+        }
+
+        for (; n >= 2; n -= 2, p += 2, offset += 2)
+        {
+            uint16_t tmp;
+
+            if (offset == offsetof(struct tcphdr, th_sum))
+                continue;   /* th_sum == 0 during checksum computation */
+            memcpy(&tmp, p, sizeof(tmp));
+            sum += tmp;
+        }
+
+        if (n > 0)
+        {
+            word[0] = *p;
+            ++offset;
+            odd = TRUE;
+        }
     }
 
-    if (len & 1)
+    if (odd)
     {
         uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
+        *(uint8_t *) &tmp = word[0];
         sum += tmp;
     }
 
@@ -83,6 +144,25 @@ void _mysock_set_checksum(const mysock_context_t *ctx,
         packet, len);
 }
 
+/* update checksum in the STCP segment gathered from the given iovec; the
+ * first piece must contain the whole header.
+ */
+void _mysock_set_checksum_iov(const mysock_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    ((struct tcphdr *) iov[0].iov_base)->th_sum = _mysock_tcp_checksum_iov(
+        _network_get_local_addr((network_context_t *)
+                                &ctx->network_state), /*src*/
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
+            sin_addr.s_addr,
+        iov, iovcnt);
+}
+
 /* returns TRUE if checksum is correct, FALSE otherwise */
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len)
@@ -3,6 +3,7 @@
 #ifndef __TCP_CHECKSUM_H__
 #define __TCP_CHECKSUM_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
 struct mysock_context;
@@ -12,9 +13,17 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/);
 
+uint16_t _mysock_tcp_checksum_iov(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov,
+                                  int iovcnt);
+
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
+void _mysock_set_checksum_iov(const struct mysock_context *ctx,
+                              const struct iovec *iov, int iovcnt);
+
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len);
 
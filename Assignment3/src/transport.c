@@ -23,8 +23,6 @@
 #include <unistd.h>
 
 
-#define FIN_TIMEOUT 2 
-#define MAX_WIN 3072
 
 enum
 {
@@ -33,11 +31,16 @@ enum
     CSTATE_WAITING_FOR_FINACK_ACTIVE,
     CSTATE_WAITING_FOR_FIN_ACTIVE,
     CSTATE_DUMPING,//received fin, now dumping everything inside our queue, will terminate after that
+    CSTATE_WAITING_FOR_SYNACK,//active side, syn sent
+    CSTATE_WAITING_FOR_SYN,//passive side, nothing sent yet
+    CSTATE_WAITING_FOR_ACK,//passive side, syn ack sent
 };   /* obviously you should have more states */
 
+#define HANDSHAKING(ctx) ((ctx)->connection_state >= CSTATE_WAITING_FOR_SYNACK)
+
 
 typedef struct queue_node {
-    char *data;
+    stcp_buf_t *buf;//handle to the app's data, sent straight from the mysocket layer's buffer
     ssize_t size;
     ssize_t bytes_sent;
     struct queue_node *next;
@@ -48,9 +51,9 @@ typedef struct {
     queue_node_t *tail;
 } queue_t;
 
-void enqueue(queue_t *queue, char *data, ssize_t size) {
+void enqueue(queue_t *queue, stcp_buf_t *buf, ssize_t size) {
     queue_node_t *new_node = (queue_node_t *)malloc(sizeof(queue_node_t));
-    new_node->data = data;
+    new_node->buf = buf;
     new_node->size = size;
     new_node->bytes_sent = 0;
     new_node->next = NULL;
@@ -73,7 +76,7 @@ void dequeue(queue_t *queue) {
     if (!queue->head) queue->tail = NULL;
 
     printf("freeing data\n");
-    free(temp->data);
+    stcp_buf_release(temp->buf);
     printf("freeing temp\n");
     free(temp);
     printf("done\n");
@@ -93,26 +96,73 @@ typedef struct
     time_t fin_sent_time;
     queue_t data_queue;
     uint16_t other_side_avl_buffer;
+
+    //a segment whose ack is being held back; nothing else is looked at until that ack is out
+    bool_t ack_pending;
+    struct timespec ack_due;
+    STCPHeader pending_header;//its flags are handled once the ack has gone out
+    tcp_seq pending_ack_num;
+    bool_t close_pending;//app asked to close, handled after any held ack
+
+    //what we want transport_dispatch() to be called for next, see set_wait()
+    unsigned int wait_flags;
+    bool_t wait_timed;
+    struct timespec wait_time;
     /* any other connection-wide global variables go here */
 } context_t;
 
 
 static void generate_initial_seq_num(context_t *ctx);
-static void control_loop(mysocket_t sd, context_t *ctx);
+static void handshake_segment(mysocket_t sd, context_t *ctx);
+static void receive_segment(mysocket_t sd, context_t *ctx);
+static void finish_segment(mysocket_t sd, context_t *ctx);
+static void handle_flags(mysocket_t sd, context_t *ctx, const STCPHeader *header);
+static void send_pending(mysocket_t sd, context_t *ctx);
+static void set_wait(mysocket_t sd, context_t *ctx);
+static bool_t finish(mysocket_t sd, context_t *ctx);
 
 
 /* initialise the transport layer, and start the main loop, handling
  * any data from the peer or the application.  this function should not
  * return until the connection is closed.
+ *
+ * this is just transport_open() followed by transport_dispatch() for each
+ * event stcp_wait_for_event() gives us, for the thread-per-connection
+ * mode.
  */
 void transport_init(mysocket_t sd, bool_t is_active)
 {
     context_t *ctx;
 
+    if (transport_open(sd, is_active))
+        return;
+
+    ctx = (context_t *) stcp_get_context(sd);
+    for (;;)
+    {
+        unsigned int event = stcp_wait_for_event(sd, ctx->wait_flags,
+                                                 ctx->wait_timed ? &ctx->wait_time : NULL);
+
+        if (transport_dispatch(sd, event))
+            break;//ctx is gone now
+    }
+}
+
+
+/* set up a connection without blocking: send the SYN if is_active, or get
+ * ready for one to arrive if !is_active.  the rest of the handshake, and
+ * everything after it, happens in transport_dispatch().  returns TRUE if
+ * the connection is already over (the SYN couldn't be sent).
+ */
+bool_t transport_open(mysocket_t sd, bool_t is_active)
+{
+    context_t *ctx;
+
     ctx = (context_t *) calloc(1, sizeof(context_t));
     assert(ctx);
 
     generate_initial_seq_num(ctx);
+    stcp_set_context(sd, ctx);
 
     /* XXX: you should send a SYN packet here if is_active, or wait for one
      * to arrive if !is_active.  after the handshake completes, unblock the
@@ -133,177 +183,217 @@ void transport_init(mysocket_t sd, bool_t is_active)
         syn_packet.th_flags = TH_SYN;
         syn_packet.th_seq = htonl(ctx->next_seq_to_send);
         syn_packet.th_off = 5;
-        syn_packet.th_win = htons(MAX_WIN);
+        syn_packet.th_win = htons(stcp_get_option(sd, STCP_RCVWND, STCP_DEFAULT_RCVWND));
         if (stcp_network_send(sd, &syn_packet, sizeof(syn_packet), NULL) == -1){//syn send failed
             perror("Failed to send SYN");
             errno = ECONNREFUSED;
-            return;
+            return finish(sd, ctx);
         }
         ctx->next_seq_to_send++;
 
         // wait for syn ack
-        STCPHeader syn_ack_packet;
-        while (1){
-            ssize_t bytes_received = stcp_network_recv(sd, &syn_ack_packet, sizeof(syn_ack_packet));
-            if (bytes_received == -1){
-                perror("Failed to receive SYN ACK");
-                errno = ECONNREFUSED;
-                return;
-            }
-            //if ack exists
-            if ((syn_ack_packet.th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)){//syn ack is essentially joining the two
-                printf("syn_ack_packet.th_ack: %u\n", syn_ack_packet.th_ack);
-                printf("ctx->next_seq_to_send: %u\n", ctx->next_seq_to_send);
-                ctx->other_side_avl_buffer = ntohs(syn_ack_packet.th_win);
-                ctx->last_ack_received = ntohl(syn_ack_packet.th_ack);
-                break;
+        ctx->connection_state = CSTATE_WAITING_FOR_SYNACK;
+    } else {
+        printf("passive-shake\n");
+        // wait for syn
+        ctx->connection_state = CSTATE_WAITING_FOR_SYN;
+    }
+
+    set_wait(sd, ctx);
+    return false;
+}
+
+
+/* handle the events stcp_wait_for_event() (or the worker pool) reported
+ * for us, without blocking; we are called again for the next lot of events
+ * we asked for in set_wait().  returns TRUE once the connection is closed,
+ * at which point our context is freed.
+ */
+bool_t transport_dispatch(mysocket_t sd, unsigned int event)
+{
+    context_t *ctx = (context_t *) stcp_get_context(sd);
+
+    assert(ctx);
+
+    if (event & APP_CLOSE_REQUESTED) {
+        ctx->close_pending = true;//do it after anything else in this batch, like before
+    }
+
+    if (ctx->ack_pending) {
+        //we are holding an ack back, nothing else happens until it's out
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec < ctx->ack_due.tv_sec ||
+            (now.tv_sec == ctx->ack_due.tv_sec && now.tv_nsec < ctx->ack_due.tv_nsec)) {
+            set_wait(sd, ctx);
+            return false;
+        }
+        finish_segment(sd, ctx);
+    } else if (HANDSHAKING(ctx)) {
+        if (event & NETWORK_DATA) {
+            handshake_segment(sd, ctx);
+        }
+    } else {
+        /* check whether it was the network, app, or a close request */
+        if ((event & APP_DATA) && ctx->connection_state == CSTATE_ESTABLISHED) {//if we are closing the connection, we won't be sending anything anymore
+            //printf("sent\n");
+            /* the application has requested that data be sent */
+            /* see stcp_app_recv() */
+            stcp_buf_t *buffer = stcp_app_recv_buf(sd, stcp_get_option(sd, STCP_MAXSEG, STCP_MSS));//cut large chunk of data into smaller packets
+            ssize_t bytes_read = stcp_buf_len(buffer);
+
+
+            if (bytes_read > 0){
+               // printf("Bytes read from app: %zd\n", bytes_read);
+                enqueue(&ctx->data_queue, buffer, bytes_read);//we hold on to the handle until the data has been sent
+               // printf("Sending packet: SEQ=%u, Payload Size=%zd\n", data_packet.th_seq, bytes_read);
+            } else {
+                stcp_buf_release(buffer);
             }
+
+            //printf("sent-end\n");
+        }
+
+        if (event & NETWORK_DATA) {
+            receive_segment(sd, ctx);
+        }
+    }
+
+    if (!ctx->done && !ctx->ack_pending && !HANDSHAKING(ctx)) {
+        send_pending(sd, ctx);
+    }
+
+    if (ctx->done) {
+        return finish(sd, ctx);
+    }
+    set_wait(sd, ctx);
+    return false;
+}
+
+
+/* generate random initial sequence number for an STCP connection */
+static void generate_initial_seq_num(context_t *ctx)
+{
+    assert(ctx);
+
+#ifdef FIXED_INITNUM
+    /* please don't change this! */
+    ctx->initial_sequence_num = 1;
+#else
+    /* you have to fill this up */
+    ctx->initial_sequence_num = rand() % 256; //result from 0 to 255 inclusive
+#endif
+}
+
+
+/* one segment from the peer while the handshake is in progress; anything
+ * that isn't the segment we are waiting for is dropped.
+ */
+static void handshake_segment(mysocket_t sd, context_t *ctx)
+{
+    STCPHeader packet;
+    ssize_t bytes_received = stcp_network_recv(sd, &packet, sizeof(packet));
+
+    if (bytes_received <= 0){//the network layer hands us an empty packet on errors
+        perror("Failed to receive handshake packet");
+        errno = ECONNREFUSED;
+        ctx->done = true;
+        return;
+    }
+
+    if (ctx->connection_state == CSTATE_WAITING_FOR_SYNACK) {
+        //if ack exists
+        if ((packet.th_flags & (TH_SYN | TH_ACK)) != (TH_SYN | TH_ACK)){//syn ack is essentially joining the two
+            return;
         }
+        printf("syn_ack_packet.th_ack: %u\n", packet.th_ack);
+        printf("ctx->next_seq_to_send: %u\n", ctx->next_seq_to_send);
+        ctx->other_side_avl_buffer = ntohs(packet.th_win);
+        ctx->last_ack_received = ntohl(packet.th_ack);
 
         // send ack
         
         STCPHeader ack_packet = {0};
         ack_packet.th_flags = TH_ACK;//just use normal ack this time
         ack_packet.th_seq = htonl(ctx->next_seq_to_send);//the sequence number(+1 since ack and syn here takes 1 even if no payload exists)
-        ack_packet.th_ack = htonl(ntohl(syn_ack_packet.th_seq) + 1);//next expected number
+        ack_packet.th_ack = htonl(ntohl(packet.th_seq) + 1);//next expected number
         ack_packet.th_off = 5;
-        ack_packet.th_win = htons(MAX_WIN);
+        ack_packet.th_win = htons(stcp_get_option(sd, STCP_RCVWND, STCP_DEFAULT_RCVWND));
         //if send failed
         if (stcp_network_send(sd, &ack_packet, sizeof(ack_packet), NULL) == -1){
             perror("Failed to send ACK");
             errno = ECONNREFUSED;
+            ctx->done = true;
             return;
         }
         printf("active-shake-end\n");
 
-    } else {
-        printf("passive-shake\n");
-        // wait for syn
-        STCPHeader syn_packet;
-        while (1){
-            ssize_t bytes_received = stcp_network_recv(sd, &syn_packet, sizeof(syn_packet));
-            if (bytes_received == -1){
-                perror("Failed to receive SYN");
-                errno = ECONNREFUSED;
-                return;
-            }
-            //if ack exists
-            if ((syn_packet.th_flags & (TH_SYN)) == (TH_SYN)){
-                ctx->last_ack_received = ntohl(syn_packet.th_ack);
-                ctx->other_side_avl_buffer = ntohs(syn_packet.th_win);
-                break;
-            }
+    } else if (ctx->connection_state == CSTATE_WAITING_FOR_SYN) {
+        //if ack exists
+        if ((packet.th_flags & (TH_SYN)) != (TH_SYN)){
+            return;
         }
+        ctx->last_ack_received = ntohl(packet.th_ack);
+        ctx->other_side_avl_buffer = ntohs(packet.th_win);
 
         // send syn ack
         STCPHeader syn_ack_packet = {0};
         syn_ack_packet.th_flags = TH_SYN | TH_ACK;
         syn_ack_packet.th_seq = htonl(ctx->next_seq_to_send);
-        syn_ack_packet.th_ack = htonl(ntohl(syn_packet.th_seq) + 1);
+        syn_ack_packet.th_ack = htonl(ntohl(packet.th_seq) + 1);
         syn_ack_packet.th_off = 5;
-        syn_ack_packet.th_win = htons(MAX_WIN);
+        syn_ack_packet.th_win = htons(stcp_get_option(sd, STCP_RCVWND, STCP_DEFAULT_RCVWND));
         if (stcp_network_send(sd, &syn_ack_packet, sizeof(syn_ack_packet), NULL) == -1){//syn ack send failed
             perror("Failed to send SYN ACK");
+            ctx->done = true;
             return;
         }
         ctx->next_seq_to_send++;
 
         // wait for ack
-        STCPHeader ack_packet;
-        while (1){
-            ssize_t bytes_received = stcp_network_recv(sd, &ack_packet, sizeof(ack_packet));
-            if (bytes_received == -1){
-                perror("Failed to receive ACK");
-                return;
-            }
-            //if ack exists
-            if ((ack_packet.th_flags & (TH_ACK)) == (TH_ACK)){
-                ctx->last_ack_received = ntohl(ack_packet.th_ack);
-                ctx->other_side_avl_buffer = ntohs(ack_packet.th_win);
-                break;
-            }
+        ctx->connection_state = CSTATE_WAITING_FOR_ACK;
+        return;
+
+    } else {
+        assert(ctx->connection_state == CSTATE_WAITING_FOR_ACK);
+        //if ack exists
+        if ((packet.th_flags & (TH_ACK)) != (TH_ACK)){
+            return;
         }
+        ctx->last_ack_received = ntohl(packet.th_ack);
+        ctx->other_side_avl_buffer = ntohs(packet.th_win);
         printf("passive-shake-end\n");
     }
+
     ctx->connection_state = CSTATE_ESTABLISHED;
     stcp_unblock_application(sd);
-
-    control_loop(sd, ctx);
-
-    /* do any cleanup here */
-    free(ctx);
-}
-
-
-/* generate random initial sequence number for an STCP connection */
-static void generate_initial_seq_num(context_t *ctx)
-{
-    assert(ctx);
-
-#ifdef FIXED_INITNUM
-    /* please don't change this! */
-    ctx->initial_sequence_num = 1;
-#else
-    /* you have to fill this up */
-    ctx->initial_sequence_num = rand() % 256; //result from 0 to 255 inclusive
-#endif
 }
 
 
-/* control_loop() is the main STCP loop; it repeatedly waits for one of the
- * following to happen:
- *   - incoming data from the peer
- *   - new data from the application (via mywrite())
- *   - the socket to be closed (via myclose())
- *   - a timeout
+/* one segment from the peer once the connection is up.  if it needs an
+ * ack, the ack (and the rest of the segment's handling) is held back for
+ * STCP_DEFAULT_ACK_DELAY seconds (or STCP_ACK_DELAY), see finish_segment().
  */
-static void control_loop(mysocket_t sd, context_t *ctx)
+static void receive_segment(mysocket_t sd, context_t *ctx)
 {
-    assert(ctx);
-
-    while (!ctx->done)
-    {
-        unsigned int event;
-
-        //printf("prior wait event\n");
-        /* see stcp_api.h or stcp_api.c for details of this function */
-        /* XXX: you will need to change some of these arguments! */
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-        //printf("post wait event\n");
-
-        /* check whether it was the network, app, or a close request */
-        if (event & APP_DATA)
-        {
-            if(ctx->connection_state != CSTATE_ESTABLISHED){
-                continue;//if we are closing the connection, we won't be sending anything anymore
-            }
-            //printf("sent\n");
-            /* the application has requested that data be sent */
-            /* see stcp_app_recv() */
-            char *buffer = (char *)malloc(STCP_MSS);
-            ssize_t bytes_read;
-
-
-            if ((bytes_read = stcp_app_recv(sd, buffer, STCP_MSS)) > 0){//cut large chunk of data into smaller packets
-               // printf("Bytes read from app: %zd\n", bytes_read);
-                enqueue(&ctx->data_queue, buffer, bytes_read);
-               // printf("Sending packet: SEQ=%u, Payload Size=%zd\n", data_packet.th_seq, bytes_read);
-            }
-
-            //printf("sent-end\n");
-        }
-
-        if (event & NETWORK_DATA) {
            // printf("network receive 1\n");
-            /* received data from STCP peer */
-            char buffer[1024];
-            ssize_t bytes_received = stcp_network_recv(sd, buffer, sizeof(buffer));
+            /* received data from STCP peer.  the packet is handed to us by
+             * reference; its payload goes up to the app in the same buffer,
+             * so keep our own copy of the header.
+             */
+            stcp_buf_t *packet = stcp_network_recv_buf(sd);
+            ssize_t bytes_received = stcp_buf_len(packet);
+            STCPHeader header_copy;
             
             //printf("network receive 2\n");
             if (bytes_received > 0) {//similarly, if received from peer, send to app
-                STCPHeader *header = (STCPHeader *)buffer;
-                char *data = buffer + 20;
+                STCPHeader *header = &header_copy;
                 ssize_t data_bytes = bytes_received - 20;
+                memcpy(header, stcp_buf_data(packet), sizeof(header_copy));
+                if (data_bytes <= 0) {//nothing for the app, we are done with the packet
+                    stcp_buf_release(packet);
+                    packet = NULL;
+                }
 
                 //printf("Flags set: ");
                 //if (header->th_flags & TH_FIN) printf("FIN ");
@@ -323,25 +413,58 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
                 if (data_bytes > 0 || (header->th_flags & TH_FIN)){//send to app regardless
                     if(data_bytes > 0){
-                        stcp_app_send(sd, data, data_bytes);
+                        stcp_buf_pull(packet, 20);//strip the header, the payload itself is not copied
+                        stcp_app_send_buf(sd, packet);
+                        packet = NULL;
                         printf("Receiving a normal payload of size %zd bytes\n", data_bytes);
                     }
-                    sleep(2);
+                    //hold the ack back instead of sleeping on it, so nobody else waits with us
+                    ctx->ack_pending = true;
+                    ctx->pending_header = *header;
+                    ctx->pending_ack_num = next_expected_seq;
+                    clock_gettime(CLOCK_REALTIME, &ctx->ack_due);
+                    ctx->ack_due.tv_sec += stcp_get_option(sd, STCP_ACK_DELAY, STCP_DEFAULT_ACK_DELAY);
+                    return;
+                }
+
+                handle_flags(sd, ctx, header);
+            }else{
+                //printf("ELSE!!!\n");
+                stcp_buf_release(packet);
+            }
+}
+
+
+/* the held-back ack is due: send it, then deal with the rest of the
+ * segment it was for
+ */
+static void finish_segment(mysocket_t sd, context_t *ctx)
+{
+    assert(ctx->ack_pending);
+    ctx->ack_pending = false;
+
                         printf("sending ack\n");
                                             //otherwise if the header is not ack, we give it an ack back
                     STCPHeader ack_packet = {0};
                     ack_packet.th_flags = TH_ACK;
                     ack_packet.th_seq = htonl(ctx->next_seq_to_send);
-                    ack_packet.th_ack = htonl(next_expected_seq);
+                    ack_packet.th_ack = htonl(ctx->pending_ack_num);
                     ack_packet.th_off = 5;
-                    ack_packet.th_win = htons(MAX_WIN);
+                    ack_packet.th_win = htons(stcp_get_option(sd, STCP_RCVWND, STCP_DEFAULT_RCVWND));
 
                     if (stcp_network_send(sd, &ack_packet, sizeof(ack_packet), NULL) == -1){
                         perror("Failed to send ACK");
+                        ctx->done = true;
                         return;
                     }
-                }
 
+    handle_flags(sd, ctx, &ctx->pending_header);
+}
+
+
+/* ACK and FIN handling for a segment from the peer */
+static void handle_flags(mysocket_t sd, context_t *ctx, const STCPHeader *header)
+{
                     //printf("received\n");
                     if ((header->th_flags & TH_ACK)){//basically we already send fin and is now waiting for the final ack, and now we get it, so we close
                         printf("ack received\n");
@@ -354,7 +477,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                                 printf("terminating as ack received under waiting for finack passive state\n");
                             ctx->done = true;
                             stcp_fin_received(sd);
-                            break;
+                            return;
                         }else if(ctx->connection_state == CSTATE_WAITING_FOR_FINACK_ACTIVE){//for the active one, it sends fin, get ack, now it should be expecting a fin from the other side
                             
                             printf("fin ack received under state waiting_for_fin_ack_active, switch to state wait for fin\n");
@@ -373,7 +496,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                         printf("fin received under waiting for fin_active, terminating\n");
                         ctx->done = true;
                         stcp_fin_received(sd);
-                        break;
+                        return;
                         //in this case we should just send an ack and then terminate, we already sent ack in the past
                     }
 
@@ -391,15 +514,17 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                     //printf("Receiving packet: SEQ=%u, ACK=%u\n", header->th_seq, header->th_ack);
 
                     //printf("received-end\n");
-                
+}
 
-                
-            }else{
-                //printf("ELSE!!!\n");
-            }
-        }
 
-        if (event & APP_CLOSE_REQUESTED) {//do the handshake for termination(only for active since only it will get notified by the application)
+/* whatever is left to do after the events themselves: a pending close,
+ * the fin-ack timeout, and sending queued data (or our own fin once the
+ * queue has drained)
+ */
+static void send_pending(mysocket_t sd, context_t *ctx)
+{
+        if (ctx->close_pending) {//do the handshake for termination(only for active since only it will get notified by the application)
+            ctx->close_pending = false;
             printf("sending fin as application requirement\n");
             STCPHeader fin_packet = {0};
             fin_packet.th_flags = TH_FIN;
@@ -409,6 +534,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
             if (stcp_network_send(sd, &fin_packet, sizeof(fin_packet), NULL) == -1){
                 perror("Failed to send FIN");
+                ctx->done = true;
                 return;
             }
             
@@ -420,31 +546,29 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
 
         if ((ctx->connection_state == CSTATE_WAITING_FOR_FINACK_PASSIVE || ctx->connection_state == CSTATE_WAITING_FOR_FINACK_ACTIVE) &&
-            time(NULL) - ctx->fin_sent_time >= FIN_TIMEOUT) {
+            time(NULL) - ctx->fin_sent_time >= stcp_get_option(sd, STCP_FIN_TIMEOUT, STCP_DEFAULT_FIN_TIMEOUT)) {
             printf("FIN-ACK timeout reached. Closing connection.\n");
             ctx->done = true;
             stcp_fin_received(sd);
         }
 
+        stcp_network_cork(sd);//everything the window lets us send goes out in one write
         while ((ctx->connection_state == CSTATE_ESTABLISHED || ctx->connection_state == CSTATE_DUMPING) && ctx->data_queue.head && (ctx->last_ack_received + ctx->other_side_avl_buffer > ctx->next_seq_to_send)) {
             queue_node_t *current = ctx->data_queue.head;
             STCPHeader data_packet = {0};
             data_packet.th_seq = htonl(ctx->next_seq_to_send);
             data_packet.th_flags = NETWORK_DATA;
             data_packet.th_off = 5;
-            data_packet.th_win = htons(MAX_WIN);
+            data_packet.th_win = htons(stcp_get_option(sd, STCP_RCVWND, STCP_DEFAULT_RCVWND));
 
             size_t remaining_data = current->size - current->bytes_sent;
             size_t window_space = ctx->last_ack_received + ctx->other_side_avl_buffer - ctx->next_seq_to_send;
             size_t data_to_send = (remaining_data < window_space) ? remaining_data : window_space;
 
-            //put the header and packet together
-            char send_buffer[20 + data_to_send];
-            memcpy(send_buffer, &data_packet, 20);
-            memcpy(send_buffer + 20, current->data + current->bytes_sent, data_to_send);
-
-            if (stcp_network_send(sd, send_buffer, sizeof(STCPHeader) + data_to_send, NULL) == -1) {
+            //header goes in front of the payload without copying it
+            if (stcp_network_send_buf(sd, &data_packet, sizeof(STCPHeader), current->buf, current->bytes_sent, data_to_send) == -1) {
                 perror("Failed to send data");
+                ctx->done = true;
                 return;
             }
             printf("Sent data of size: %zu bytes\n", data_to_send);
@@ -456,6 +580,11 @@ static void control_loop(mysocket_t sd, context_t *ctx)
                 dequeue(&ctx->data_queue);
             }
         }
+        if (stcp_network_uncork(sd) == -1) {
+            perror("Failed to send data");
+            ctx->done = true;
+            return;
+        }
 
         if(!ctx->data_queue.head && ctx->connection_state == CSTATE_DUMPING){
                     ctx->fin_sent_time = time(NULL);
@@ -468,6 +597,7 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
                     if (stcp_network_send(sd, &fin_packet, sizeof(fin_packet), NULL) == -1){
                         perror("Failed to send FIN");
+                        ctx->done = true;
                         return;
                     }
                     ctx->next_seq_to_send++;
@@ -476,7 +606,49 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 
 
         /* etc. */
+}
+
+
+/* tell the mysocket layer what we want to hear about next.  while an ack
+ * is held back only its timer matters; during the handshake only the
+ * network does; and app data is only taken while we're established.
+ */
+static void set_wait(mysocket_t sd, context_t *ctx)
+{
+    ctx->wait_timed = false;
+    if (ctx->ack_pending) {
+        ctx->wait_flags = TIMEOUT;
+        ctx->wait_time = ctx->ack_due;
+        ctx->wait_timed = true;
+    } else if (HANDSHAKING(ctx)) {
+        ctx->wait_flags = NETWORK_DATA;
+    } else {
+        ctx->wait_flags = NETWORK_DATA | APP_CLOSE_REQUESTED;
+        if (ctx->connection_state == CSTATE_ESTABLISHED) {
+            ctx->wait_flags |= APP_DATA;
+        }
+        if (ctx->connection_state == CSTATE_WAITING_FOR_FINACK_PASSIVE || ctx->connection_state == CSTATE_WAITING_FOR_FINACK_ACTIVE) {
+            //a datagram network won't tell us the peer is gone, so give up on its fin-ack in time
+            ctx->wait_flags |= TIMEOUT;
+            ctx->wait_time.tv_sec = ctx->fin_sent_time + stcp_get_option(sd, STCP_FIN_TIMEOUT, STCP_DEFAULT_FIN_TIMEOUT);
+            ctx->wait_time.tv_nsec = 0;
+            ctx->wait_timed = true;
+        }
     }
+
+    stcp_set_wait(sd, ctx->wait_flags, ctx->wait_timed ? &ctx->wait_time : NULL);
+}
+
+
+/* the connection is over; do any cleanup here */
+static bool_t finish(mysocket_t sd, context_t *ctx)
+{
+    while (ctx->data_queue.head) {
+        dequeue(&ctx->data_queue);
+    }
+    stcp_set_context(sd, NULL);
+    free(ctx);
+    return true;
 }
 
 
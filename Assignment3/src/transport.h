@@ -119,4 +119,14 @@ typedef struct tcphdr
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
 
+/* event-driven interface to the transport layer.  transport_init() runs a
+ * whole connection on its own thread; when the mysocket layer runs
+ * connections on a pool of worker threads instead, it calls
+ * transport_open() once, then transport_dispatch() whenever one of the
+ * events (or the timeout) last given to stcp_set_wait() comes up.  neither
+ * blocks.  both return TRUE once the connection is finished.
+ */
+extern bool_t transport_open(mysocket_t sd, bool_t is_active);
+extern bool_t transport_dispatch(mysocket_t sd, unsigned int event);
+
 #endif  /* __TRANSPORT_H__ */